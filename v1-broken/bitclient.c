@@ -11,20 +11,50 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
 #include <curl/curl.h>
 
 #include "bitclient.h"
+#include "blockpool.h"
+#include "connmgr.h"
+#include "dht.h"
+#include "diskio.h"
+#include "flowctl.h"
 #include "magnet.h"
+#include "ratelimit.h"
+#include "rcache.h"
+#include "recheck.h"
+#include "resolver.h"
 #include "leecher.h"
 #include "seeder.h"
+#include "storage.h"
+#include "wcache.h"
 
 int log_verbosely = 0;
 
 #define USAGE                                                                  \
     "\
-Usage: bitclient [-vh] magnet:\n\
+Usage: bitclient [-vhr] [-c SECS] [-j N] [-p MIB] [-w MIB] [-R MIB] [-d N]\n\
+                 [-U KIB] [-D KIB] [-m N] [-H N] [-t PORT [-b HOST:PORT]...]\n\
+                 magnet:\n\
     Options:\n\
         -v || --verbose        Log debugging information\n\
+        -c || --checkpoint SECS\n\
+                               Save which blocks we have this often (10)\n\
+        -r || --recheck        Hash what's already in the file first\n\
+        -j || --threads N      Threads to recheck with (one per core)\n\
+        -p || --pool MIB       Memory for blocks in flight (64)\n\
+        -w || --write-cache MIB\n\
+                               How much of that may wait for its piece (16)\n\
+        -R || --read-cache MIB Memory for pieces we're seeding (32)\n\
+        -d || --disk-threads N Threads for disk I/O without io_uring (4)\n\
+        -U || --upload KIB     Upload at most this many KiB/s (0, unlimited)\n\
+        -D || --download KIB   Download at most this many KiB/s (0, unlimited)\n\
+        -m || --max-peers N    Connect to at most this many peers (50)\n\
+        -H || --half-open N    Of which this many may still be connecting (8)\n\
+        -t || --dht PORT       Find peers on the DHT too, from this UDP port\n\
+        -b || --dht-node HOST:PORT\n\
+                               Join the DHT through here (the usual routers)\n\
         -h || --help           Print this message and exit\n"
 
 void
@@ -56,6 +86,10 @@ print_torrent(torrent_t *t)
     printf("\tuploaded  = %lli\n", t->uploaded);
     printf("\tdloaded   = %lli\n", t->dloaded);
     printf("\tleft      = %lli\n", t->left);
+    if (t->flow != NULL) {
+        printf("\t");
+        flowctl_print(t->flow, stdout);
+    }
 }
 
 void
@@ -92,11 +126,85 @@ free_torrent(torrent_t *t)
     free(t);
 }
 
+/**
+ * Every peer the DHT finds for us goes in T, like a tracker's
+ */
+static void
+dht_found(void *raw, const uint8_t *peers, size_t n)
+{
+    torrent_t *t = (torrent_t*)raw;
+
+    for (size_t i = 0; i < n; i++) {
+        uint16_t port = (uint16_t)(peers[6*i + 4] << 8 | peers[6*i + 5]);
+        magnet_add_peer(t, peers + 6*i, port);
+    }
+}
+
+/**
+ * Join the DHT on PORT through the N NODES, each HOST:PORT, or through
+ * the well-known routers if there are none
+ */
+static dht_t *
+dht_join(torrent_t *t, int port, char **nodes, int n)
+{
+    static char *routers[] = {
+        "router.bittorrent.com:6881",
+        "dht.transmissionbt.com:6881",
+        "router.utorrent.com:6881",
+    };
+    char    path[4096];
+    dht_t  *d;
+
+    /* Where the routing table lives between runs */
+    snprintf(path, sizeof(path), "%s/.bitclient.dht",
+             getenv("HOME") != NULL ? getenv("HOME") : ".");
+    if ((d = dht_create((uint16_t)port, path)) == NULL) return NULL;
+
+    if (n == 0) {
+        nodes = routers;
+        n     = sizeof(routers) / sizeof(routers[0]);
+    }
+    for (int i = 0; i < n; i++) {
+        char        host[256], *colon = strrchr(nodes[i], ':');
+        res_addrs_t addrs;
+
+        if (colon == NULL || colon - nodes[i] >= (long)sizeof(host) || atoi(colon + 1) <= 0) {
+            FATAL("Bad DHT node %s, expected HOST:PORT\n", nodes[i]);
+            continue;
+        }
+        memcpy(host, nodes[i], (size_t)(colon - nodes[i]));
+        host[colon - nodes[i]] = '\0';
+        if (resolver_get(t->dns, host, &addrs) < 0) continue;
+        for (int j = 0; j < addrs.n; j++) {
+            if (addrs.addr[j].ss_family != AF_INET) continue;
+            resolver_port(&addrs.addr[j], (uint16_t)atoi(colon + 1));
+            dht_add_bootstrap(d, (struct sockaddr_in*)&addrs.addr[j]);
+            break;
+        }
+    }
+    return d;
+}
+
 int
 main(int argc, char *argv[])
 {
     torrent_t *t      = NULL;
     char *     magnet = NULL;
+    int        checkpoint_secs = 10;
+    int        recheck = 0;
+    int        check_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int        pool_mib = 64;
+    int        wcache_mib = 16;
+    int        rcache_mib = 32;
+    int        disk_threads = 4;
+    int        up_kib = 0;
+    int        down_kib = 0;
+    int        max_peers = 50;
+    int        half_open = 8;
+    int        dht_port = -1;
+    char      *dht_nodes[8];
+    int        ndht_nodes = 0;
+    rl_bucket_t up_all, down_all, up, down;
 
     if (argc < 2) {
         FATAL("%s", USAGE);
@@ -106,6 +214,69 @@ main(int argc, char *argv[])
     for (int i = 0; i < argc; i++) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
             log_verbosely = 1;
+        } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--checkpoint")) {
+            if (++i == argc || (checkpoint_secs = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--recheck")) {
+            recheck = 1;
+        } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--threads")) {
+            if (++i == argc || (check_threads = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--pool")) {
+            if (++i == argc || (pool_mib = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--write-cache")) {
+            if (++i == argc || (wcache_mib = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-R") || !strcmp(argv[i], "--read-cache")) {
+            if (++i == argc || (rcache_mib = atoi(argv[i])) < 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--disk-threads")) {
+            if (++i == argc || (disk_threads = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-U") || !strcmp(argv[i], "--upload")) {
+            if (++i == argc || (up_kib = atoi(argv[i])) < 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "--download")) {
+            if (++i == argc || (down_kib = atoi(argv[i])) < 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--max-peers")) {
+            if (++i == argc || (max_peers = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--half-open")) {
+            if (++i == argc || (half_open = atoi(argv[i])) <= 0) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--dht")) {
+            if (++i == argc || (dht_port = atoi(argv[i])) < 0 || dht_port > 65535) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--dht-node")) {
+            if (++i == argc || ndht_nodes == 8) {
+                FATAL("%s", USAGE);
+                return -1;
+            }
+            dht_nodes[ndht_nodes++] = argv[i];
         } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
             printf("%s", USAGE);
             return 0;
@@ -128,11 +299,123 @@ main(int argc, char *argv[])
     t->peer_id = "-PC0001-478269329936";
     t->port    = "6881";
     t->event   = "started";
-    if (magnet_request_tracker(t) < 0) {
+
+    /* Before telling the tracker what we need, pick up where a previous
+     * run left off, down to the block */
+    if ((t->storage = storage_open(t, checkpoint_secs)) == NULL)
+        DEBUG("Not saving anything until we know how big the file is\n");
+
+    /* Trust nothing the resume file says if asked to check it all again */
+    if (recheck && t->storage != NULL &&
+        recheck_run(t, check_threads > 0 ? check_threads : 1) < 0) {
+        FATAL("Failed to recheck %s\n", t->filename);
+        return -1;
+    }
+
+    /* Anything that's already there needn't be downloaded, and if it's all
+     * there we can go straight to seeding. The last piece is usually short,
+     * so count what we have piece by piece. */
+    if (t->storage != NULL) {
+        t->left = t->file_len;
+        for (uint32_t i = 0; i < t->storage->num_pieces; i++)
+            if (storage_has_piece(t->storage, i))
+                t->left -= storage_piece_size(t->storage, i);
+        if (t->left <= 0) {
+            t->left  = 0;
+            t->event = "completed";
+        }
+    }
+
+    /* Every block we receive or send lives in here on the way, so this is
+     * all the memory the transfer itself may use */
+    uint32_t blocks = (uint32_t)(((size_t)pool_mib << 20) / BLOCK_LEN);
+    if ((t->pool = blockpool_create(blocks)) == NULL) {
+        FATAL("Failed to set aside %d MiB for blocks\n", pool_mib);
+        return -1;
+    }
+
+    /* Blocks are written a piece at a time, once it's verified. The cache
+     * can't have the whole pool, or there'd be nothing left to receive
+     * the blocks that complete its pieces */
+    size_t wcache_blocks = ((size_t)wcache_mib << 20) / BLOCK_LEN;
+    if (wcache_blocks > blocks / 2) {
+        DEBUG("The write cache can have at most half of the pool\n");
+        wcache_blocks = blocks / 2;
+    }
+    if (t->storage != NULL &&
+        (t->wcache = wcache_create(t, wcache_blocks)) == NULL) {
+        FATAL("Failed to create the write cache\n");
+        return -1;
+    }
+    if (t->storage != NULL &&
+        (t->rcache = rcache_create(t->storage, (size_t)rcache_mib << 20)) == NULL) {
+        FATAL("Failed to create the read cache\n");
+        return -1;
+    }
+    if (t->storage != NULL &&
+        (t->dio = diskio_open(t->storage, t->pool, disk_threads)) == NULL) {
+        FATAL("Failed to set up disk I/O\n");
+        return -1;
+    }
+
+    /* Stop requesting blocks while the pool or the disk queue is full */
+    if ((t->flow = flowctl_create(t->pool, t->dio, t->wcache)) == NULL) {
+        FATAL("Failed to set up flow control\n");
+        return -1;
+    }
+
+    /* Every peer's bucket hangs off the torrent's, which hangs off the
+     * global limit, so a transfer has to fit in all three */
+    rl_init(&up_all, (uint64_t)up_kib << 10, NULL);
+    rl_init(&down_all, (uint64_t)down_kib << 10, NULL);
+    rl_init(&up, 0, &up_all);
+    rl_init(&down, 0, &down_all);
+    t->up   = &up;
+    t->down = &down;
+
+    /* Tracker and peer names are looked up off the event loop, and
+     * remembered for everyone */
+    if ((t->dns = resolver_create(4)) == NULL) {
+        FATAL("Failed to start the resolver\n");
+        return -1;
+    }
+
+    /* The leecher sets its own on_close, since it owns the poll set */
+    if ((t->conns = connmgr_create(max_peers, half_open, NULL, NULL)) == NULL) {
+        FATAL("Failed to set up the connection manager\n");
+        return -1;
+    }
+
+    if (t->trackers == NULL && dht_port < 0) {
+        FATAL("The magnet has no trackers, so we need the DHT (see -t)\n");
+        return -1;
+    }
+    if (dht_port >= 0 && (t->dht = dht_join(t, dht_port, dht_nodes, ndht_nodes)) == NULL) {
+        FATAL("Failed to join the DHT\n");
+        return -1;
+    }
+
+    /* With the DHT to fall back on, a tracker that doesn't answer is fine */
+    if (t->trackers != NULL && magnet_request_tracker(t) < 0 && t->dht == NULL) {
         FATAL("Failed to get information from the tracker\n");
         return -1;
     }
 
+    /* Ask the DHT as well, and announce ourselves there. A lookup takes a
+     * few rounds of a few hundred milliseconds each. */
+    if (t->dht != NULL) {
+        time_t give_up = time(NULL) + 30;
+        dht_lookup(t->dht, t->info_hash_raw, 1, (uint16_t)atoi(t->port), dht_found, t);
+        while (dht_run(t->dht, 250) > 0 && time(NULL) < give_up)
+            ;
+        if (t->peers == NULL) {
+            FATAL("Nobody on the DHT has this torrent\n");
+            return -1;
+        }
+    }
+    int added = connmgr_sync(t->conns, t->peers, t->dns);
+    DEBUG("%d peers to choose from\n", added);
+
     /* In order for the seeder and leecher to work, T must be full */
     if (log_verbosely) print_torrent(t);
 
@@ -151,6 +434,15 @@ main(int argc, char *argv[])
         return -1;
     }
 
+    dht_destroy(t->dht);
+    connmgr_destroy(t->conns);
+    resolver_destroy(t->dns);
+    flowctl_destroy(t->flow);
+    diskio_close(t->dio);
+    wcache_destroy(t->wcache);
+    rcache_destroy(t->rcache);
+    storage_close(t->storage);
+    blockpool_destroy(t->pool);
     free_torrent(t);
 
     return 0;
@@ -47,6 +47,7 @@ typedef struct torrent {
     /* Information we need in order to become a peer */
     char *     peer_id;   /* A hash to id myself when talking with peers */
     char *     info_hash; /* A unique id for the torrent we're transferring */
+    uint8_t    info_hash_raw[20]; /* The same, not URL-encoded */
     char *     filename;  /* The name of the file we'll save */
     tracker_t *trackers;  /* These guys tell us where to find peers */
     peers_t *  peers;     /* Some nice folks we'll share chunks with */
@@ -60,6 +61,26 @@ typedef struct torrent {
     be_num_t   dloaded;   /* Bytes we've downloaded */
     be_num_t   left;      /* Bytes we still need */
     /* Required for UDP trackers */
-    uint32_t   trans_id;  /* Our unique 32-bit ID, big endian */
-    uint32_t   conn_id;   /* An announce session ID, big endian */
+    uint32_t   trans_id;  /* Our unique 32-bit ID */
+    uint64_t   conn_id;   /* An announce session ID, from the connect */
+    /* Where the file goes, see storage.h */
+    struct storage *storage;
+    /* Buffers for blocks on their way to or from it, see blockpool.h */
+    struct blockpool *pool;
+    /* Which hold them until their piece is verified, see wcache.h */
+    struct wcache *wcache;
+    /* And the pieces we're seeding, see rcache.h */
+    struct rcache *rcache;
+    /* Which the event loop reads and writes through, see diskio.h */
+    struct diskio *dio;
+    /* Which decides when the network has to wait for it, see flowctl.h */
+    struct flowctl *flow;
+    /* How fast we may send and receive, see ratelimit.h */
+    struct rl_bucket *up, *down;
+    /* And which peers are worth connecting to, see connmgr.h */
+    struct connmgr *conns;
+    /* Which, like the trackers, may be names to look up, see resolver.h */
+    struct resolver *dns;
+    /* Where peers come from when there's no tracker, see dht.h */
+    struct dht *dht;
 } torrent_t;
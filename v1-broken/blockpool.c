@@ -0,0 +1,335 @@
+/*
+ * blockpool.c --- A fixed pool of 16 KiB block buffers
+ *
+ * A block is received into one of these, hashed, written and maybe served
+ * again, each by a different thread, so the buffers are allocated once, up
+ * front, and passed around by reference count. The arena is mapped with
+ * explicit huge pages if the system has any reserved and prefaulted either
+ * way, so the data path never takes a page fault or a trip through
+ * malloc(3).
+ *
+ * Each thread keeps up to POOL_CACHE free blocks to itself and only takes
+ * the pool's lock to swap half of them with the shared list, so threads
+ * allocating and freeing at the same rate hardly ever meet. Nothing is
+ * ever allocated beyond the pool: when it's empty, block_alloc() fails and
+ * block_alloc_wait() waits, and that's what slows the network down when
+ * the disk can't keep up.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "storage.h"
+
+#define HUGE_PAGE  (2UL << 20)
+#define WAIT_SLICE 100       /* ms a waiter sleeps before looking again */
+
+/* This thread's free blocks, all from one pool */
+static _Thread_local struct {
+    blockpool_t *pool;
+    block_t     *head;
+    int          n;
+} cache;
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+/**
+ * Map LEN bytes, from the huge page reserve if we can
+ */
+static uint8_t *
+arena_map(blockpool_t *p, size_t len)
+{
+    size_t   hlen = (len + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    uint8_t *a;
+
+    a = mmap(NULL, hlen, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (a != MAP_FAILED) {
+        p->arena_len = hlen;
+        p->huge      = 1;
+        return a;
+    }
+
+    DEBUG("No huge pages reserved, the block pool will use normal ones\n");
+    a = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (a == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    madvise(a, len, MADV_HUGEPAGE);   /* Transparent ones, if enabled */
+    p->arena_len = len;
+    p->huge      = 0;
+    return a;
+}
+
+/**
+ * Add MS milliseconds to T
+ */
+static void
+ts_add_ms(struct timespec *t, long ms)
+{
+    t->tv_sec  += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Move up to N blocks from the shared list to this thread's cache. The
+ * caller holds the lock.
+ */
+static void
+cache_refill(blockpool_t *p, int n)
+{
+    while (n-- > 0 && p->free != NULL) {
+        block_t *b = p->free;
+        p->free    = b->next;
+        b->next    = cache.head;
+        cache.head = b;
+        cache.n++;
+    }
+}
+
+/**
+ * And the other way. The caller holds the lock.
+ */
+static void
+cache_drain(blockpool_t *p, int n)
+{
+    while (n-- > 0 && cache.head != NULL) {
+        block_t *b = cache.head;
+        cache.head = b->next;
+        cache.n--;
+        b->next    = p->free;
+        p->free    = b;
+    }
+}
+
+static void
+block_release(block_t *b)
+{
+    blockpool_t *p = b->pool;
+
+    __atomic_sub_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+    if (cache.pool == NULL) cache.pool = p;
+
+    /* Keep it if there's room and nobody is waiting for one. Someone may
+     * start waiting just as we look, so look again once it's in the cache,
+     * behind a fence that pairs with the one in block_alloc_wait(): anyone
+     * who was already waiting by then gets the cache back. */
+    if (cache.pool == p && cache.n < POOL_CACHE &&
+        !__atomic_load_n(&p->waiters, __ATOMIC_RELAXED)) {
+        b->next    = cache.head;
+        cache.head = b;
+        cache.n++;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&p->waiters, __ATOMIC_RELAXED)) return;
+
+        pthread_mutex_lock(&p->lock);
+        cache_drain(p, cache.n);
+        pthread_cond_broadcast(&p->returned);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    /* A waiter can't reach into our cache, and we may never come back for
+     * what's in it, so give the whole lot back while anyone is waiting */
+    pthread_mutex_lock(&p->lock);
+    b->next = p->free;
+    p->free = b;
+    if (cache.pool == p && p->waiters)
+        cache_drain(p, cache.n);
+    else if (cache.pool == p && cache.n >= POOL_CACHE)
+        cache_drain(p, POOL_CACHE / 2);
+    if (p->waiters) pthread_cond_broadcast(&p->returned);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Create a pool of COUNT blocks of BLOCK_LEN bytes
+ */
+blockpool_t *
+blockpool_create(uint32_t count)
+{
+    blockpool_t *p;
+
+    if (count == 0) return NULL;
+    if ((p = (blockpool_t*)calloc(1, sizeof(blockpool_t))) == NULL ||
+        (p->blocks = (block_t*)calloc(count, sizeof(block_t))) == NULL) {
+        perror("calloc");
+        free(p);
+        return NULL;
+    }
+    if ((p->arena = arena_map(p, (size_t)count * BLOCK_LEN)) == NULL) {
+        free(p->blocks);
+        free(p);
+        return NULL;
+    }
+
+    p->count = count;
+    for (uint32_t i = count; i-- > 0;) {
+        p->blocks[i].data = p->arena + (size_t)i * BLOCK_LEN;
+        p->blocks[i].pool = p;
+        p->blocks[i].next = p->free;
+        p->free           = &p->blocks[i];
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->returned, NULL);
+
+    DEBUG("Block pool: %u blocks, %zu MiB%s\n", count, p->arena_len >> 20,
+          p->huge ? " of huge pages" : "");
+    return p;
+}
+
+/**
+ * Every other thread must have called blockpool_flush() by now
+ */
+void
+blockpool_destroy(blockpool_t *p)
+{
+    if (p == NULL) return;
+    blockpool_flush(p);
+    if (p->in_use) DEBUG("%u blocks still in use\n", p->in_use);
+
+    munmap(p->arena, p->arena_len);
+    pthread_cond_destroy(&p->returned);
+    pthread_mutex_destroy(&p->lock);
+    free(p->blocks);
+    free(p);
+}
+
+/**
+ * Give this thread's cached blocks back, e.g. before it exits
+ */
+void
+blockpool_flush(blockpool_t *p)
+{
+    if (cache.pool != p) return;
+    pthread_mutex_lock(&p->lock);
+    cache_drain(p, cache.n);
+    if (p->waiters) pthread_cond_broadcast(&p->returned);
+    pthread_mutex_unlock(&p->lock);
+    cache.pool = NULL;
+}
+
+uint32_t
+blockpool_in_use(blockpool_t *p)
+{
+    return __atomic_load_n(&p->in_use, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take a block with one reference, or NULL if they're all in use
+ */
+block_t *
+block_alloc(blockpool_t *p)
+{
+    block_t *b = NULL;
+
+    if (cache.pool == NULL) cache.pool = p;
+
+    if (cache.pool == p && cache.head == NULL) {
+        pthread_mutex_lock(&p->lock);
+        cache_refill(p, POOL_CACHE / 2);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    if (cache.pool == p && cache.head != NULL) {
+        b          = cache.head;
+        cache.head = b->next;
+        cache.n--;
+    } else if (cache.pool != p) {
+        /* This thread caches for another pool */
+        pthread_mutex_lock(&p->lock);
+        if ((b = p->free) != NULL) p->free = b->next;
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (b == NULL) return NULL;
+
+    b->next = NULL;
+    b->refs = 1;
+    b->len  = 0;
+    __atomic_add_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/**
+ * Like block_alloc(), but wait up to MS milliseconds (forever if it's
+ * negative) for a block to be returned.
+ *
+ * While we wait, every thread that releases a block gives its whole cache
+ * back, but we can't reach into the cache of a thread that has gone quiet.
+ * So we never sleep more than WAIT_SLICE at a time, and try again after
+ * each in case something was missed.
+ */
+block_t *
+block_alloc_wait(blockpool_t *p, int ms)
+{
+    struct timespec until;
+    block_t        *b;
+
+    if ((b = block_alloc(p)) != NULL || ms == 0) return b;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    if (ms > 0) ts_add_ms(&until, ms);
+
+    for (;;) {
+        struct timespec slice;
+        int             last = 0, err = 0;
+
+        clock_gettime(CLOCK_REALTIME, &slice);
+        ts_add_ms(&slice, WAIT_SLICE);
+        if (ms > 0 && (slice.tv_sec > until.tv_sec ||
+                       (slice.tv_sec == until.tv_sec && slice.tv_nsec >= until.tv_nsec))) {
+            slice = until;
+            last  = 1;
+        }
+
+        /* The fence pairs with the one in block_release() */
+        pthread_mutex_lock(&p->lock);
+        __atomic_add_fetch(&p->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (p->free == NULL && err != ETIMEDOUT)
+            err = pthread_cond_timedwait(&p->returned, &p->lock, &slice);
+        __atomic_sub_fetch(&p->waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&p->lock);
+
+        if ((b = block_alloc(p)) != NULL || last) return b;
+    }
+}
+
+void
+block_ref(block_t *b)
+{
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+block_unref(block_t *b)
+{
+    if (b != NULL && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        block_release(b);
+}
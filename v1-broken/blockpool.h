@@ -0,0 +1,48 @@
+/*
+ * blockpool.h --- A fixed pool of 16 KiB block buffers
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "bitclient.h"
+
+#define POOL_CACHE 32   /* Free blocks each thread keeps to itself */
+
+/* One BLOCK_LEN buffer. Whoever holds a reference may read it; it goes
+ * back to the pool when the last one is dropped */
+typedef struct block {
+    uint8_t          *data;
+    uint32_t          refs;
+    uint32_t          piece;   /* What's in it, for whoever's next */
+    uint32_t          begin;
+    uint32_t          len;
+    struct block     *next;    /* On a free list */
+    struct blockpool *pool;
+} block_t;
+
+typedef struct blockpool {
+    uint8_t        *arena;     /* All the buffers, back to back */
+    size_t          arena_len;
+    int             huge;      /* Backed by explicit huge pages */
+    block_t        *blocks;
+    uint32_t        count;
+    uint32_t        in_use;    /* Handed out and not yet returned */
+    /* Blocks no thread has cached */
+    pthread_mutex_t lock;
+    pthread_cond_t  returned;
+    block_t        *free;
+    int             waiters;
+} blockpool_t;
+
+extern blockpool_t *blockpool_create(uint32_t count);
+extern void blockpool_destroy(blockpool_t *p);
+extern void blockpool_flush(blockpool_t *p);
+extern uint32_t blockpool_in_use(blockpool_t *p);
+
+extern block_t *block_alloc(blockpool_t *p);
+extern block_t *block_alloc_wait(blockpool_t *p, int ms);
+extern void block_ref(block_t *b);
+extern void block_unref(block_t *b);
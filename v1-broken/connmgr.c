@@ -0,0 +1,564 @@
+/*
+ * connmgr.c --- Decide which peers to connect to, and when to give up on them
+ *
+ * The tracker hands us a pile of addresses and says nothing about which
+ * are any good. Most of a swarm is slow, unreachable or gone, so which
+ * ones we spend our connections on matters more to the download speed
+ * than anything else we do.
+ *
+ * Every peer we hear of gets a score: the chance it'll finish a handshake
+ * (from how often it has, starting from a coin toss), times how fast it
+ * delivered, over how long it took to connect. A peer we've never tried
+ * is assumed to be as fast as the average of our current ones, so it
+ * beats the ones we know are slow. Candidates sit in a max-heap by score,
+ * and peers that failed sit in a min-heap by when they may be retried,
+ * backing off exponentially, so picking the next one is never a walk.
+ *
+ * At most -H connects are half-open at once, so a swarm full of dead
+ * addresses can't use up every slot. Once every connection is taken, a
+ * peer that has been well under the average rate for a while is dropped
+ * to make room for a candidate, one per tick.
+ *
+ * Times are in nanoseconds from rl_now(). Only the leecher's event loop
+ * calls into here; there's no locking.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "bitclient.h"
+#include "connmgr.h"
+#include "resolver.h"
+
+#define NS                    1000000000ULL
+#define CM_TICK               NS
+#define CM_CONNECT_TIMEOUT    (10 * NS)
+#define CM_HANDSHAKE_TIMEOUT  (20 * NS)
+#define CM_BACKOFF_MIN        (15 * NS)     /* Doubled for each failure */
+#define CM_BACKOFF_MAX        (1800 * NS)
+#define CM_SLOW_FRAC          4             /* Under 1/4 of the average, */
+#define CM_SLOW_TICKS         20            /* for this many ticks, is slow */
+#define CM_RATE_UNIT          16384.0       /* Bytes per second */
+#define CM_RTT_UNIT           (100e6)       /* Nanoseconds */
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+static int
+by_score(const cm_peer_t *a, const cm_peer_t *b)
+{
+    return a->score > b->score;
+}
+
+static int
+by_retry(const cm_peer_t *a, const cm_peer_t *b)
+{
+    return a->retry_at < b->retry_at;
+}
+
+static void
+heap_swap(cm_heap_t *h, size_t i, size_t j)
+{
+    cm_peer_t *tmp = h->v[i];
+    h->v[i] = h->v[j];
+    h->v[j] = tmp;
+    h->v[i]->slot = i;
+    h->v[j]->slot = j;
+}
+
+static void
+heap_up(cm_heap_t *h, size_t i)
+{
+    while (i > 0 && h->before(h->v[i], h->v[(i - 1) / 2])) {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+heap_down(cm_heap_t *h, size_t i)
+{
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, best = i;
+        if (l < h->n && h->before(h->v[l], h->v[best])) best = l;
+        if (r < h->n && h->before(h->v[r], h->v[best])) best = r;
+        if (best == i) return;
+        heap_swap(h, i, best);
+        i = best;
+    }
+}
+
+static int
+heap_push(cm_heap_t *h, cm_peer_t *p)
+{
+    if (h->n == h->cap) {
+        size_t      cap = h->cap ? h->cap * 2 : 64;
+        cm_peer_t **v   = (cm_peer_t**)realloc(h->v, cap * sizeof(cm_peer_t*));
+        if (v == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        h->v   = v;
+        h->cap = cap;
+    }
+    p->slot      = h->n;
+    h->v[h->n++] = p;
+    heap_up(h, p->slot);
+    return 0;
+}
+
+static cm_peer_t *
+heap_pop(cm_heap_t *h)
+{
+    cm_peer_t *top;
+
+    if (h->n == 0) return NULL;
+    top = h->v[0];
+    if (--h->n > 0) {
+        h->v[0]       = h->v[h->n];
+        h->v[0]->slot = 0;
+        heap_down(h, 0);
+    }
+    return top;
+}
+
+static uint64_t
+hash_addr(const struct sockaddr_storage *addr, socklen_t len)
+{
+    const uint8_t *b = (const uint8_t*)addr;
+    uint64_t       h = 14695981039346656037ULL;   /* FNV-1a */
+
+    for (socklen_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static cm_peer_t *
+lookup(connmgr_t *cm, const struct sockaddr_storage *addr, socklen_t len)
+{
+    cm_peer_t *p = cm->table[hash_addr(addr, len) % cm->buckets];
+
+    for (; p != NULL; p = p->hnext)
+        if (p->addrlen == len && !memcmp(&p->addr, addr, len)) return p;
+    return NULL;
+}
+
+static int
+grow_table(connmgr_t *cm)
+{
+    size_t      buckets = cm->buckets * 2;
+    cm_peer_t **table   = (cm_peer_t**)calloc(buckets, sizeof(cm_peer_t*));
+
+    if (table == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (size_t i = 0; i < cm->buckets; i++) {
+        cm_peer_t *next;
+        for (cm_peer_t *p = cm->table[i]; p != NULL; p = next) {
+            size_t b = hash_addr(&p->addr, p->addrlen) % buckets;
+            next     = p->hnext;
+            p->hnext = table[b];
+            table[b] = p;
+        }
+    }
+    free(cm->table);
+    cm->table   = table;
+    cm->buckets = buckets;
+    return 0;
+}
+
+static double
+score(connmgr_t *cm, cm_peer_t *p)
+{
+    double ok   = (p->handshakes + 1.0) / (p->attempts + 2.0);
+    double rate = p->attempts == 0 ? (double)cm->avg_rate : (double)p->rate;
+
+    return ok * (1.0 + rate / CM_RATE_UNIT) / (1.0 + (double)p->rtt / CM_RTT_UNIT);
+}
+
+static void
+live_remove(connmgr_t *cm, cm_peer_t *p)
+{
+    cm->live[p->slot]       = cm->live[--cm->nlive];
+    cm->live[p->slot]->slot = p->slot;
+}
+
+/**
+ * Close P's connection and put it back in line: after a backoff if it
+ * FAILED, or after the longest backoff if we dropped it for being slow
+ */
+static void
+retire(connmgr_t *cm, cm_peer_t *p, uint64_t now, int failed)
+{
+    if (p->state == CM_CONNECTING) cm->half_open--;
+    live_remove(cm, p);
+    close(p->fd);
+    p->fd    = -1;
+    p->state = CM_IDLE;
+    p->since = now;
+
+    if (failed) {
+        uint32_t fails = p->attempts - p->handshakes;
+        uint64_t wait  = CM_BACKOFF_MIN << (fails > 8 ? 7 : fails > 0 ? fails - 1 : 0);
+        p->retry_at    = now + (wait < CM_BACKOFF_MAX ? wait : CM_BACKOFF_MAX);
+        cm->failures++;
+    } else {
+        p->retry_at = now + CM_BACKOFF_MAX;
+        cm->dropped++;
+    }
+    heap_push(&cm->waiting, p);
+}
+
+static void
+close_and_retire(connmgr_t *cm, cm_peer_t *p, uint64_t now, int failed)
+{
+    if (cm->on_close != NULL) cm->on_close(cm->arg, p);
+    retire(cm, p, now, failed);
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Keep at most MAX_CONNS connections, of which at most MAX_HALF_OPEN are
+ * still connecting. ON_CLOSE(ARG, peer) is called before we close one of
+ * the caller's sockets because it timed out or was too slow.
+ */
+connmgr_t *
+connmgr_create(int max_conns, int max_half_open, cm_close_fn on_close, void *arg)
+{
+    connmgr_t *cm;
+
+    if (max_conns <= 0 || max_half_open <= 0) return NULL;
+    if ((cm = (connmgr_t*)calloc(1, sizeof(connmgr_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    cm->buckets = 64;
+    if ((cm->live = (cm_peer_t**)calloc(max_conns, sizeof(cm_peer_t*))) == NULL ||
+        (cm->table = (cm_peer_t**)calloc(cm->buckets, sizeof(cm_peer_t*))) == NULL) {
+        perror("calloc");
+        free(cm->live);
+        free(cm);
+        return NULL;
+    }
+    cm->ready.before   = by_score;
+    cm->waiting.before = by_retry;
+    cm->max_conns      = max_conns;
+    cm->max_half_open  = max_half_open < max_conns ? max_half_open : max_conns;
+    cm->on_close       = on_close;
+    cm->arg            = arg;
+    return cm;
+}
+
+void
+connmgr_destroy(connmgr_t *cm)
+{
+    if (cm == NULL) return;
+    DEBUG("Peers: %zu known, %llu connects, %llu failed, %llu dropped as slow\n",
+          cm->npeers, (unsigned long long)cm->connects,
+          (unsigned long long)cm->failures, (unsigned long long)cm->dropped);
+
+    for (size_t i = 0; i < cm->buckets; i++) {
+        cm_peer_t *next;
+        for (cm_peer_t *p = cm->table[i]; p != NULL; p = next) {
+            next = p->hnext;
+            if (p->fd >= 0) close(p->fd);
+            free(p);
+        }
+    }
+    free(cm->table);
+    free(cm->live);
+    free(cm->ready.v);
+    free(cm->waiting.v);
+    free(cm);
+}
+
+/**
+ * Make the peer at ADDR a candidate, unless we already know it.
+ * Returns 1 if it's new, 0 if not, -1 on error.
+ */
+int
+connmgr_add_addr(connmgr_t *cm, const struct sockaddr *addr, socklen_t len)
+{
+    struct sockaddr_storage key;
+    cm_peer_t *p;
+
+    if (len > sizeof(key)) return -1;
+    memset(&key, 0, sizeof(key));
+    memcpy(&key, addr, len);
+    if (lookup(cm, &key, len) != NULL) return 0;
+    if (cm->npeers >= cm->buckets && grow_table(cm) < 0) return -1;
+
+    if ((p = (cm_peer_t*)calloc(1, sizeof(cm_peer_t))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    p->addr    = key;
+    p->addrlen = len;
+    p->fd      = -1;
+    p->score   = score(cm, p);
+    if (heap_push(&cm->ready, p) < 0) {
+        free(p);
+        return -1;
+    }
+    size_t b     = hash_addr(&p->addr, p->addrlen) % cm->buckets;
+    p->hnext     = cm->table[b];
+    cm->table[b] = p;
+    cm->npeers++;
+    return 1;
+}
+
+/**
+ * The same, for a peer at the numeric IP and PORT
+ */
+int
+connmgr_add(connmgr_t *cm, const char *ip, const char *port)
+{
+    struct addrinfo  hints, *res;
+    int              rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+    if ((rv = getaddrinfo(ip, port, &hints, &res)) != 0) {
+        DEBUG("Ignoring peer %s:%s: %s\n", ip, port, gai_strerror(rv));
+        return -1;
+    }
+    rv = connmgr_add_addr(cm, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    return rv;
+}
+
+/* A peer given by name, waiting on the resolver */
+struct named_peer {
+    connmgr_t *cm;
+    uint16_t   port;
+};
+
+static int
+add_addrs(connmgr_t *cm, uint16_t port, const res_addrs_t *addrs)
+{
+    int added = 0;
+
+    for (int i = 0; i < addrs->n; i++) {
+        struct sockaddr_storage a = addrs->addr[i];
+        resolver_port(&a, port);
+        if (connmgr_add_addr(cm, (struct sockaddr*)&a, addrs->len[i]) > 0) added++;
+    }
+    return added;
+}
+
+static void
+add_resolved(void *raw, const res_addrs_t *addrs, int err)
+{
+    struct named_peer *np = (struct named_peer*)raw;
+
+    if (err == 0) add_addrs(np->cm, np->port, addrs);
+    free(np);
+}
+
+/**
+ * Add every peer in PEERS, e.g. after an announce. With DNS, peers given
+ * by name are looked up, and added from resolver_reap() unless they're
+ * cached. Returns how many were added now.
+ */
+int
+connmgr_sync(connmgr_t *cm, peers_t *peers, resolver_t *dns)
+{
+    int added = 0;
+
+    for (peers_t *p = peers; p != NULL; p = p->next) {
+        struct named_peer *np;
+        res_addrs_t addrs;
+        int rv, port = atoi(p->port);
+
+        if (dns == NULL) {
+            if (connmgr_add(cm, p->ip, p->port) > 0) added++;
+            continue;
+        }
+        if (port <= 0 || port > 65535) continue;
+        if ((np = (struct named_peer*)malloc(sizeof(*np))) == NULL) {
+            perror("malloc");
+            break;
+        }
+        np->cm   = cm;
+        np->port = (uint16_t)port;
+        if ((rv = resolver_lookup(dns, p->ip, &addrs, add_resolved, np)) != 0) {
+            if (rv > 0) added += add_addrs(cm, np->port, &addrs);
+            free(np);
+        }
+    }
+    return added;
+}
+
+/**
+ * Start connecting to the best candidate, if there's room for another
+ * half-open connection. Returns it, with a non-blocking socket to wait
+ * for POLLOUT on, or NULL if there's nothing to do.
+ */
+cm_peer_t *
+connmgr_next(connmgr_t *cm, uint64_t now)
+{
+    cm_peer_t *p;
+
+    /* Whoever's done backing off gets back in line */
+    while (cm->waiting.n > 0 && cm->waiting.v[0]->retry_at <= now) {
+        p        = heap_pop(&cm->waiting);
+        p->score = score(cm, p);
+        heap_push(&cm->ready, p);
+    }
+
+    while (cm->half_open < cm->max_half_open && cm->nlive < (size_t)cm->max_conns &&
+           (p = heap_pop(&cm->ready)) != NULL) {
+        int fd = socket(p->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            heap_push(&cm->ready, p);
+            return NULL;
+        }
+
+        p->fd    = fd;
+        p->state = CM_CONNECTING;
+        p->since = now;
+        p->attempts++;
+        p->slot  = cm->nlive;
+        cm->live[cm->nlive++] = p;
+        cm->half_open++;
+        cm->connects++;
+
+        if (connect(fd, (struct sockaddr*)&p->addr, p->addrlen) == 0) {
+            connmgr_connected(cm, p, now);
+        } else if (errno != EINPROGRESS) {
+            retire(cm, p, now, 1);
+            continue;
+        }
+        return p;
+    }
+    return NULL;
+}
+
+/**
+ * P's socket became writable without an error
+ */
+void
+connmgr_connected(connmgr_t *cm, cm_peer_t *p, uint64_t now)
+{
+    uint64_t rtt = now - p->since;
+
+    if (p->state != CM_CONNECTING) return;
+    cm->half_open--;
+    p->rtt   = p->rtt ? (p->rtt * 7 + rtt) / 8 : rtt;
+    p->state = CM_CONNECTED;
+    p->since = now;
+}
+
+/**
+ * P sent back a valid handshake
+ */
+void
+connmgr_handshaken(connmgr_t *cm, cm_peer_t *p, uint64_t now)
+{
+    if (p->state == CM_CONNECTING) connmgr_connected(cm, p, now);
+    if (p->state != CM_CONNECTED) return;
+    p->handshakes++;
+    p->state      = CM_ACTIVE;
+    p->since      = now;
+    p->bytes      = 0;
+    p->slow_ticks = 0;
+}
+
+/**
+ * P delivered BYTES of blocks we asked for
+ */
+void
+connmgr_delivered(cm_peer_t *p, uint64_t bytes)
+{
+    p->bytes += bytes;
+}
+
+/**
+ * Something went wrong with P: the connect failed, the handshake was bad,
+ * or it broke the protocol. Its socket is closed and it backs off.
+ */
+void
+connmgr_failed(connmgr_t *cm, cm_peer_t *p, uint64_t now)
+{
+    if (p->fd < 0) return;
+    retire(cm, p, now, 1);
+}
+
+/**
+ * Call this at least once a second. Connects and handshakes that take
+ * too long are given up on, delivery rates are updated, and if we're out
+ * of connections and the best candidate is one we've never tried, the
+ * slowest peer that's been persistently slow makes room. Returns how many
+ * connections were closed.
+ */
+int
+connmgr_tick(connmgr_t *cm, uint64_t now)
+{
+    uint64_t   dt, sum = 0;
+    size_t     active = 0;
+    int        closed = 0;
+    cm_peer_t *slowest = NULL;
+
+    if (cm->last_tick == 0) cm->last_tick = now;
+    if ((dt = now - cm->last_tick) < CM_TICK) return 0;
+    cm->last_tick = now;
+
+    /* Backwards, since retiring one moves the last one into its place */
+    for (size_t i = cm->nlive; i-- > 0; ) {
+        cm_peer_t *p = cm->live[i];
+
+        if ((p->state == CM_CONNECTING && now - p->since > CM_CONNECT_TIMEOUT) ||
+            (p->state == CM_CONNECTED && now - p->since > CM_HANDSHAKE_TIMEOUT)) {
+            close_and_retire(cm, p, now, 1);
+            closed++;
+        } else if (p->state == CM_ACTIVE) {
+            uint64_t sample = p->bytes * NS / dt;
+            p->rate  = (p->rate * 3 + sample) / 4;
+            p->bytes = 0;
+            sum += p->rate;
+            active++;
+        }
+    }
+    cm->avg_rate = active > 0 ? sum / active : 0;
+
+    for (size_t i = 0; i < cm->nlive; i++) {
+        cm_peer_t *p = cm->live[i];
+        if (p->state != CM_ACTIVE) continue;
+        if (p->rate * CM_SLOW_FRAC < cm->avg_rate) p->slow_ticks++;
+        else p->slow_ticks = 0;
+        if (p->slow_ticks >= CM_SLOW_TICKS && (slowest == NULL || p->rate < slowest->rate))
+            slowest = p;
+    }
+
+    /* Only make room for someone we've never tried. A peer back from a
+     * backoff has already let us down, and is no better a bet. */
+    if (slowest != NULL && cm->nlive >= (size_t)cm->max_conns &&
+        cm->ready.n > 0 && cm->ready.v[0]->attempts == 0) {
+        DEBUG("Dropping a peer at %llu B/s, the average is %llu\n",
+              (unsigned long long)slowest->rate, (unsigned long long)cm->avg_rate);
+        close_and_retire(cm, slowest, now, 0);
+        closed++;
+    }
+    return closed;
+}
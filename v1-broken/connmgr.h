@@ -0,0 +1,81 @@
+/*
+ * connmgr.h --- Decide which peers to connect to, and when to give up on them
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "bitclient.h"
+#include "resolver.h"
+
+enum cm_state {
+    CM_IDLE,         /* A candidate, or waiting out a backoff */
+    CM_CONNECTING,   /* Half-open */
+    CM_CONNECTED,    /* Connected, but not handshaken yet */
+    CM_ACTIVE,       /* Handshaken, sending us blocks */
+};
+
+/* Everything we know about a peer, whether or not we're connected to it */
+typedef struct cm_peer {
+    struct sockaddr_storage addr;
+    socklen_t       addrlen;
+    int             fd;           /* -1 unless CONNECTING or later */
+    enum cm_state   state;
+    /* Its history with us, which its score comes from */
+    uint32_t        attempts;     /* Connects started */
+    uint32_t        handshakes;   /* Of which got as far as a handshake */
+    uint64_t        rtt;          /* Smoothed connect latency, ns */
+    uint64_t        rate;         /* Smoothed bytes per second delivered */
+    uint64_t        bytes;        /* Delivered since the last tick */
+    uint32_t        slow_ticks;   /* Ticks in a row it's been slow */
+    uint64_t        since;        /* When the current state began */
+    uint64_t        retry_at;     /* Not before this, after a failure */
+    double          score;
+    size_t          slot;         /* In whichever heap, or live[], it's in */
+    struct cm_peer *hnext;        /* Next in its hash chain */
+    void           *arg;          /* The caller's, e.g. its peerwire_t */
+} cm_peer_t;
+
+/* A binary heap of peers, ordered by BEFORE */
+typedef struct cm_heap {
+    cm_peer_t **v;
+    size_t      n, cap;
+    int       (*before)(const cm_peer_t *a, const cm_peer_t *b);
+} cm_heap_t;
+
+/* Called just before the manager closes a peer's socket itself */
+typedef void (*cm_close_fn)(void *arg, cm_peer_t *p);
+
+typedef struct connmgr {
+    cm_heap_t     ready;          /* Candidates, best score first */
+    cm_heap_t     waiting;        /* Backing off, soonest retry first */
+    cm_peer_t   **live;           /* CONNECTING and later, max_conns of them */
+    size_t        nlive;
+    cm_peer_t   **table;          /* Every peer we've heard of, by address */
+    size_t        buckets, npeers;
+    int           max_conns, max_half_open;
+    int           half_open;
+    uint64_t      avg_rate;       /* Of the ACTIVE peers, at the last tick */
+    uint64_t      last_tick;
+    cm_close_fn   on_close;
+    void         *arg;
+    /* For reporting */
+    uint64_t      connects, failures, dropped;
+} connmgr_t;
+
+extern connmgr_t *connmgr_create(int max_conns, int max_half_open,
+                                 cm_close_fn on_close, void *arg);
+extern void connmgr_destroy(connmgr_t *cm);
+extern int connmgr_add_addr(connmgr_t *cm, const struct sockaddr *addr, socklen_t len);
+extern int connmgr_add(connmgr_t *cm, const char *ip, const char *port);
+extern int connmgr_sync(connmgr_t *cm, peers_t *peers, resolver_t *dns);
+
+extern cm_peer_t *connmgr_next(connmgr_t *cm, uint64_t now);
+extern void connmgr_connected(connmgr_t *cm, cm_peer_t *p, uint64_t now);
+extern void connmgr_handshaken(connmgr_t *cm, cm_peer_t *p, uint64_t now);
+extern void connmgr_delivered(cm_peer_t *p, uint64_t bytes);
+extern void connmgr_failed(connmgr_t *cm, cm_peer_t *p, uint64_t now);
+extern int connmgr_tick(connmgr_t *cm, uint64_t now);
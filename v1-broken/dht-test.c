@@ -0,0 +1,166 @@
+/*
+ * dht-test.c --- Run a few DHT nodes against each other on loopback
+ *
+ * There's no DHT of our own to test against, but every node answers
+ * queries too, so NODES of them on 127.0.0.1 make one. They all bootstrap
+ * off the first, one announces itself for an info hash, another has to
+ * find it with get_peers, and the table one of them saves has to come
+ * back. Exits non-zero if any of that doesn't happen. Run with `make
+ * dht-test`.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "bitclient.h"
+#include "dht.h"
+
+#define NODES     20
+#define ANNOUNCER 3
+#define SEARCHER  17
+#define SAVER     5
+#define PEER_PORT 7777
+
+int log_verbosely = 0;
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+/**
+ * Count the peers a get_peers lookup finds at PEER_PORT on loopback
+ */
+static void
+found(void *arg, const uint8_t *peers, size_t n)
+{
+    int *count = (int*)arg;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t ip;
+        uint16_t port;
+        memcpy(&ip, peers + 6 * i, 4);
+        memcpy(&port, peers + 6 * i + 4, 2);
+        if (ntohl(ip) == INADDR_LOOPBACK && ntohs(port) == PEER_PORT) (*count)++;
+    }
+}
+
+/**
+ * Let every node in D send, receive and time out for MS milliseconds
+ */
+static void
+run(dht_t **d, int ms)
+{
+    struct pollfd pfd[NODES];
+
+    for (int t = 0; t < ms / 10; t++) {
+        for (int i = 0; i < NODES; i++) {
+            pfd[i].fd     = dht_fd(d[i]);
+            pfd[i].events = POLLIN;
+        }
+        if (poll(pfd, NODES, 10) < 0) perror("poll");
+        for (int i = 0; i < NODES; i++) {
+            if (pfd[i].revents & POLLIN) dht_recv(d[i]);
+            dht_tick(d[i]);
+            dht_flush(d[i]);
+        }
+    }
+}
+
+/**
+ * Where D is listening, as seen from loopback
+ */
+static int
+loopback_addr(dht_t *d, struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+
+    if (getsockname(dht_fd(d), (struct sockaddr*)addr, &len) < 0) {
+        perror("getsockname");
+        return -1;
+    }
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return 0;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+int
+main(void)
+{
+    dht_t             *d[NODES];
+    struct sockaddr_in boot;
+    char               path[] = "/tmp/dht-test.XXXXXX";
+    uint8_t            info_hash[20];
+    int                fd, peers = 0, failed = 0;
+
+    /* The saved table goes somewhere nobody else is using */
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+
+    for (int i = 0; i < NODES; i++) {
+        if ((d[i] = dht_create(0, i == SAVER ? path : NULL)) == NULL) {
+            fprintf(stderr, "FAIL: couldn't start node %d\n", i);
+            return 1;
+        }
+        if (i == 0) {
+            if (loopback_addr(d[0], &boot) < 0) return 1;
+        } else {
+            dht_add_bootstrap(d[i], &boot);
+        }
+    }
+
+    /* Looking ourselves up is how we fill our table */
+    for (int i = 1; i < NODES; i++) dht_lookup(d[i], d[i]->id, 0, 0, NULL, NULL);
+    run(d, 3000);
+    for (int i = 0; i < NODES; i++) {
+        if (dht_nodes(d[i]) > 0) continue;
+        fprintf(stderr, "FAIL: node %d didn't bootstrap\n", i);
+        failed = 1;
+    }
+
+    memset(info_hash, 0xab, sizeof(info_hash));
+    dht_lookup(d[ANNOUNCER], info_hash, 1, PEER_PORT, NULL, NULL);
+    run(d, 3000);
+    dht_lookup(d[SEARCHER], info_hash, 1, 0, found, &peers);
+    run(d, 3000);
+    if (peers == 0) {
+        fprintf(stderr, "FAIL: node %d didn't find node %d's announce\n",
+                SEARCHER, ANNOUNCER);
+        failed = 1;
+    }
+
+    /* Each saves its table on the way out, less any nodes that stopped
+     * answering, and comes back as the same node */
+    uint8_t id[20];
+    memcpy(id, d[SAVER]->id, sizeof(id));
+    for (int i = 0; i < NODES; i++) dht_destroy(d[i]);
+
+    dht_t *reloaded = dht_create(0, path);
+    int    nodes    = reloaded ? dht_nodes(reloaded) : 0;
+    if (nodes == 0 || memcmp(reloaded->id, id, sizeof(id))) {
+        fprintf(stderr, "FAIL: node %d's table didn't reload\n", SAVER);
+        failed = 1;
+    }
+    dht_destroy(reloaded);
+    unlink(path);
+
+    printf("%s: %d nodes, %d answers with the announced peer, %d nodes reloaded\n",
+           failed ? "FAIL" : "OK", NODES, peers, nodes);
+    return failed;
+}
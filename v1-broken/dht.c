@@ -0,0 +1,1038 @@
+/*
+ * dht.c --- Find peers without a tracker, on the mainline DHT (BEP 5)
+ *
+ * Trackers time out, and plenty of magnets don't name one at all, but
+ * every client out there is also a node in a Kademlia DHT keyed by info
+ * hash. We join it with one non-blocking UDP socket.
+ *
+ * The routing table is 160 buckets of K nodes each, by how many leading
+ * bits a node's id shares with ours, stored as one flat array so finding
+ * the closest nodes to something is a linear scan over a few dozen cache
+ * lines rather than a walk over a tree of pointers. A node that stops
+ * answering is replaced by the next one we hear of for its bucket.
+ *
+ * A lookup asks the ALPHA closest nodes it knows of that it hasn't asked
+ * yet, adds whoever they say is closer, and repeats as answers come in,
+ * until the K closest it knows of have all answered. get_peers lookups
+ * hand peers to the caller as they arrive, and afterwards announce us to
+ * the nodes that gave us a token. Queries are queued and go out with one
+ * sendmmsg(2), and answers come in with recvmmsg(2), so a lookup round
+ * costs a couple of system calls rather than one per node.
+ *
+ * We answer other nodes' queries too, and remember who announced what,
+ * so a few of us on loopback make a DHT of their own. The table is saved
+ * on the way out, so the next run needn't bootstrap from scratch.
+ *
+ * KRPC messages are small and always the same shape, so they're read in
+ * place without building a tree and written straight into the datagram.
+ * Only one thread calls into here; there's no locking.
+ */
+
+#define _GNU_SOURCE     /* sendmmsg(2), recvmmsg(2) */
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include <openssl/evp.h>
+
+#include "bitclient.h"
+#include "dht.h"
+
+#define NS              1000000000ULL
+#define DHT_TIMEOUT     (2 * NS)       /* Before a query counts as failed */
+#define DHT_ROTATE      (300 * NS)     /* How long a token secret lasts */
+#define DHT_MAX_FAILS   2              /* Before a node may be replaced */
+#define DHT_MAX_VALUES  100            /* Peers passed on at once */
+#define DHT_NODE_LEN    26             /* A compact node: id, IPv4, port */
+#define DHT_TOKEN_LEN   8
+#define DHT_MAGIC       "BCDHT1\n"
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Whether A is closer to T than B (-1), further (1), or the same (0)
+ */
+static int
+closer(const uint8_t *t, const uint8_t *a, const uint8_t *b)
+{
+    for (int i = 0; i < 20; i++) {
+        uint8_t da = a[i] ^ t[i], db = b[i] ^ t[i];
+        if (da != db) return da < db ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Which bucket ID goes in: how many leading bits it shares with ours
+ */
+static int
+bucket_of(dht_t *d, const uint8_t *id)
+{
+    for (int i = 0; i < 20; i++) {
+        uint8_t x = d->id[i] ^ id[i];
+        if (x) return i * 8 + __builtin_clz(x) - 24;
+    }
+    return DHT_ID_BITS - 1;
+}
+
+static int
+same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void
+compact_addr(const uint8_t *c, struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    memcpy(&addr->sin_addr.s_addr, c, 4);
+    memcpy(&addr->sin_port, c + 4, 2);
+}
+
+static void
+addr_compact(const struct sockaddr_in *addr, uint8_t *c)
+{
+    memcpy(c, &addr->sin_addr.s_addr, 4);
+    memcpy(c + 4, &addr->sin_port, 2);
+}
+
+/**
+ * A token for ADDR, from secret WHICH: whoever has one may announce to us
+ */
+static void
+make_token(dht_t *d, int which, const struct sockaddr_in *addr, uint8_t *token)
+{
+    uint8_t       in[16 + 4], md[EVP_MAX_MD_SIZE];
+    unsigned int  len;
+
+    memcpy(in, d->secret[which], 16);
+    memcpy(in + 16, &addr->sin_addr.s_addr, 4);
+    EVP_Digest(in, sizeof(in), md, &len, EVP_sha1(), NULL);
+    memcpy(token, md, DHT_TOKEN_LEN);
+}
+
+
+/* Reading bencode in place */
+
+/**
+ * Where the value at P ends, or NULL if it's malformed
+ */
+static const uint8_t *
+b_skip(const uint8_t *p, const uint8_t *end, int depth)
+{
+    if (p >= end || depth > 8) return NULL;
+
+    if (*p == 'i') {
+        for (p++; p < end && *p != 'e'; p++)
+            if (!isdigit(*p) && *p != '-') return NULL;
+        return p < end ? p + 1 : NULL;
+    }
+    if (*p == 'l' || *p == 'd') {
+        int dict = *p++ == 'd';
+        while (p < end && *p != 'e') {
+            if (dict && ((p = b_skip(p, end, depth + 1)) == NULL || p >= end))
+                return NULL;
+            if ((p = b_skip(p, end, depth + 1)) == NULL) return NULL;
+        }
+        return p < end ? p + 1 : NULL;
+    }
+    if (isdigit(*p)) {
+        size_t len = 0;
+        for (; p < end && isdigit(*p); p++)
+            if ((len = len * 10 + (size_t)(*p - '0')) > DHT_MSG_MAX) return NULL;
+        if (p >= end || *p++ != ':' || (size_t)(end - p) < len) return NULL;
+        return p + len;
+    }
+    return NULL;
+}
+
+/**
+ * The string at P, into S and LEN. Returns 0, or -1 if P isn't one.
+ */
+static int
+b_str(const uint8_t *p, const uint8_t *end, const uint8_t **s, size_t *len)
+{
+    size_t n = 0;
+
+    if (p == NULL || p >= end || !isdigit(*p)) return -1;
+    for (; p < end && isdigit(*p); p++)
+        if ((n = n * 10 + (size_t)(*p - '0')) > DHT_MSG_MAX) return -1;
+    if (p >= end || *p++ != ':' || (size_t)(end - p) < n) return -1;
+    *s   = p;
+    *len = n;
+    return 0;
+}
+
+/**
+ * The value of KEY in the dictionary at DICT, or NULL
+ */
+static const uint8_t *
+b_get(const uint8_t *dict, const uint8_t *end, const char *key)
+{
+    const uint8_t *p, *k;
+    size_t         klen;
+
+    if (dict == NULL || dict >= end || *dict != 'd') return NULL;
+    for (p = dict + 1; p < end && *p != 'e'; ) {
+        if (b_str(p, end, &k, &klen) < 0) return NULL;
+        p = k + klen;
+        if (klen == strlen(key) && !memcmp(k, key, klen)) return p;
+        if ((p = b_skip(p, end, 0)) == NULL) return NULL;
+    }
+    return NULL;
+}
+
+static int
+b_get_str(const uint8_t *dict, const uint8_t *end, const char *key,
+          const uint8_t **s, size_t *len)
+{
+    return b_str(b_get(dict, end, key), end, s, len);
+}
+
+
+/* Writing it */
+
+static void
+put(dht_out_t *o, const void *data, size_t len)
+{
+    if (o->len + len <= DHT_MSG_MAX) memcpy(o->buf + o->len, data, len);
+    o->len += len;   /* Too long to send, if it goes past DHT_MSG_MAX */
+}
+
+static void
+put_lit(dht_out_t *o, const char *lit)
+{
+    put(o, lit, strlen(lit));
+}
+
+static void
+put_str(dht_out_t *o, const void *s, size_t len)
+{
+    char hdr[24];
+    put(o, hdr, (size_t)snprintf(hdr, sizeof(hdr), "%zu:", len));
+    put(o, s, len);
+}
+
+static void
+put_int(dht_out_t *o, long long v)
+{
+    char num[24];
+    put(o, num, (size_t)snprintf(num, sizeof(num), "i%llde", v));
+}
+
+/**
+ * A datagram for TO, sent with the next dht_flush()
+ */
+static dht_out_t *
+out_next(dht_t *d, const struct sockaddr_in *to)
+{
+    dht_out_t *o;
+
+    if (d->nout == DHT_BATCH) dht_flush(d);
+    o      = &d->out[d->nout++];
+    o->len = 0;
+    o->to  = *to;
+    return o;
+}
+
+
+/* The routing table */
+
+/**
+ * ID at ADDR just answered us, or asked us something
+ */
+static void
+table_seen(dht_t *d, const uint8_t *id, const struct sockaddr_in *addr, uint64_t now)
+{
+    int         b = bucket_of(d, id), slot = -1;
+    dht_node_t *bucket = d->table[b];
+
+    if (!memcmp(id, d->id, 20) || addr->sin_port == 0) return;
+    for (int i = 0; i < d->count[b]; i++) {
+        if (!memcmp(bucket[i].id, id, 20)) {
+            bucket[i].addr  = *addr;
+            bucket[i].seen  = now;
+            bucket[i].fails = 0;
+            return;
+        }
+        if (bucket[i].fails >= DHT_MAX_FAILS &&
+            (slot < 0 || bucket[i].fails > bucket[slot].fails))
+            slot = i;
+    }
+    if (d->count[b] < DHT_K) slot = d->count[b]++;
+    if (slot < 0) return;     /* Everyone in there is still good */
+
+    memcpy(bucket[slot].id, id, 20);
+    bucket[slot].addr  = *addr;
+    bucket[slot].seen  = now;
+    bucket[slot].fails = 0;
+}
+
+static void
+table_failed(dht_t *d, const uint8_t *id)
+{
+    int b = bucket_of(d, id);
+
+    for (int i = 0; i < d->count[b]; i++) {
+        if (!memcmp(d->table[b][i].id, id, 20)) {
+            if (d->table[b][i].fails < UINT8_MAX) d->table[b][i].fails++;
+            return;
+        }
+    }
+}
+
+/**
+ * The (up to) K good nodes closest to TARGET, closest first, into OUT
+ */
+static int
+table_closest(dht_t *d, const uint8_t *target, dht_node_t **out, int k)
+{
+    int n = 0;
+
+    for (int b = 0; b < DHT_ID_BITS; b++) {
+        for (int i = 0; i < d->count[b]; i++) {
+            dht_node_t *node = &d->table[b][i];
+            int         j;
+
+            if (node->fails >= DHT_MAX_FAILS) continue;
+            if (n < k) j = n++;
+            else if (closer(target, node->id, out[k - 1]->id) < 0) j = k - 1;
+            else continue;
+            for (; j > 0 && closer(target, node->id, out[j - 1]->id) < 0; j--)
+                out[j] = out[j - 1];
+            out[j] = node;
+        }
+    }
+    return n;
+}
+
+/**
+ * Write the K nodes closest to TARGET into O, as a "nodes" string
+ */
+static void
+put_nodes(dht_t *d, dht_out_t *o, const uint8_t *target)
+{
+    dht_node_t *near[DHT_K];
+    uint8_t     compact[DHT_K * DHT_NODE_LEN];
+    int         n = table_closest(d, target, near, DHT_K);
+
+    for (int i = 0; i < n; i++) {
+        memcpy(compact + i * DHT_NODE_LEN, near[i]->id, 20);
+        addr_compact(&near[i]->addr, compact + i * DHT_NODE_LEN + 20);
+    }
+    put_lit(o, "5:nodes");
+    put_str(o, compact, (size_t)n * DHT_NODE_LEN);
+}
+
+
+/* Lookups */
+
+/**
+ * Hear of a node at ADDR, with ID if we know it. Candidates never move,
+ * since queries in flight refer to them by index; when they're full, a
+ * new one takes the place of the furthest one that isn't being asked.
+ */
+static void
+cand_add(dht_t *d, dht_lookup_t *l, const uint8_t *id, const struct sockaddr_in *addr)
+{
+    dht_cand_t *c;
+    int         far = -1;
+
+    if (addr->sin_port == 0 || (id != NULL && !memcmp(id, d->id, 20))) return;
+    for (int i = 0; i < l->n; i++) {
+        if (same_addr(&l->c[i].addr, addr) ||
+            (id != NULL && l->c[i].has_id && !memcmp(l->c[i].id, id, 20)))
+            return;
+        if (l->c[i].state != DHT_QUERIED && l->c[i].has_id &&
+            (far < 0 || closer(l->target, l->c[i].id, l->c[far].id) > 0))
+            far = i;
+    }
+
+    if (l->n < DHT_LOOKUP_MAX) {
+        c = &l->c[l->n++];
+    } else if (id != NULL && far >= 0 && closer(l->target, id, l->c[far].id) < 0) {
+        c = &l->c[far];
+    } else {
+        return;
+    }
+    memset(c, 0, sizeof(*c));
+    if (id != NULL) memcpy(c->id, id, 20);
+    c->has_id = id != NULL;
+    c->addr   = *addr;
+    c->state  = DHT_NEW;
+}
+
+/**
+ * The closest candidate nobody's asked yet, or -1. Those we don't know
+ * the id of come first, since we can't tell how close they are.
+ */
+static int
+cand_next(dht_lookup_t *l)
+{
+    int best = -1;
+
+    for (int i = 0; i < l->n; i++) {
+        if (l->c[i].state != DHT_NEW) continue;
+        if (!l->c[i].has_id) return i;
+        if (best < 0 || closer(l->target, l->c[i].id, l->c[best].id) < 0) best = i;
+    }
+    return best;
+}
+
+/**
+ * The K closest candidates that haven't failed, closest first
+ */
+static int
+cand_closest(dht_lookup_t *l, int *out)
+{
+    int n = 0;
+
+    for (int i = 0; i < l->n; i++) {
+        int j;
+        if (l->c[i].state == DHT_FAILED || !l->c[i].has_id) continue;
+        if (n < DHT_K) j = n++;
+        else if (closer(l->target, l->c[i].id, l->c[out[DHT_K - 1]].id) < 0) j = DHT_K - 1;
+        else continue;
+        for (; j > 0 && closer(l->target, l->c[i].id, l->c[out[j - 1]].id) < 0; j--)
+            out[j] = out[j - 1];
+        out[j] = i;
+    }
+    return n;
+}
+
+static void
+send_query(dht_t *d, dht_lookup_t *l, int i)
+{
+    dht_cand_t *c   = &l->c[i];
+    dht_out_t  *o   = out_next(d, &c->addr);
+    uint8_t     tid[4] = { 'l', (uint8_t)(l - d->lookups), (uint8_t)i, l->gen };
+
+    put_lit(o, "d1:ad2:id20:");
+    put(o, d->id, 20);
+    put_lit(o, l->get_peers ? "9:info_hash20:" : "6:target20:");
+    put(o, l->target, 20);
+    put_lit(o, l->get_peers ? "e1:q9:get_peers" : "e1:q9:find_node");
+    put_lit(o, "1:t");
+    put_str(o, tid, sizeof(tid));
+    put_lit(o, "1:y1:qe");
+    d->queries++;
+}
+
+static void
+send_announce(dht_t *d, dht_lookup_t *l, dht_cand_t *c)
+{
+    dht_out_t *o      = out_next(d, &c->addr);
+    uint8_t    tid[4] = { 'a', (uint8_t)(l - d->lookups), 0, l->gen };
+
+    put_lit(o, "d1:ad2:id20:");
+    put(o, d->id, 20);
+    put_lit(o, "12:implied_porti0e9:info_hash20:");
+    put(o, l->target, 20);
+    put_lit(o, "4:port");
+    put_int(o, l->announce_port);
+    put_lit(o, "5:token");
+    put_str(o, c->token, c->token_len);
+    put_lit(o, "e1:q13:announce_peer1:t");
+    put_str(o, tid, sizeof(tid));
+    put_lit(o, "1:y1:qe");
+}
+
+static void
+lookup_finish(dht_t *d, dht_lookup_t *l)
+{
+    int near[DHT_K], n = cand_closest(l, near), announced = 0;
+
+    if (l->get_peers && l->announce_port != 0) {
+        for (int i = 0; i < n; i++) {
+            dht_cand_t *c = &l->c[near[i]];
+            if (c->state != DHT_ANSWERED || c->token_len == 0) continue;
+            send_announce(d, l, c);
+            announced++;
+        }
+    }
+    DEBUG("DHT %s done: %d queries, %llu peers, announced to %d nodes\n",
+          l->get_peers ? "get_peers" : "find_node", l->queried,
+          (unsigned long long)l->peers_found, announced);
+    l->active = 0;
+}
+
+/**
+ * Give up on whoever's taken too long, stop if the K closest have all
+ * answered, or else ask more of them
+ */
+static void
+lookup_step(dht_t *d, dht_lookup_t *l, uint64_t now)
+{
+    int near[DHT_K], n, done = 1, i;
+
+    for (i = 0; i < l->n; i++) {
+        dht_cand_t *c = &l->c[i];
+        if (c->state == DHT_QUERIED && now - c->sent > DHT_TIMEOUT) {
+            c->state = DHT_FAILED;
+            l->inflight--;
+            if (c->has_id) table_failed(d, c->id);
+        }
+    }
+
+    n = cand_closest(l, near);
+    for (i = 0; i < n; i++)
+        if (l->c[near[i]].state != DHT_ANSWERED) done = 0;
+    if (n > 0 && done && l->inflight == 0) {
+        lookup_finish(d, l);
+        return;
+    }
+
+    while (l->inflight < DHT_ALPHA && (i = cand_next(l)) >= 0) {
+        send_query(d, l, i);
+        l->c[i].state = DHT_QUERIED;
+        l->c[i].sent  = now;
+        l->inflight++;
+        l->queried++;
+    }
+    if (l->inflight == 0) lookup_finish(d, l);   /* Nobody left to ask */
+}
+
+
+/* Handling messages */
+
+static void
+handle_response(dht_t *d, const uint8_t *msg, const uint8_t *end,
+                const struct sockaddr_in *from, uint64_t now)
+{
+    const uint8_t *r = b_get(msg, end, "r"), *tid, *id, *s, *v;
+    size_t         tid_len, id_len, len;
+    dht_lookup_t  *l;
+    dht_cand_t    *c;
+
+    if (b_get_str(msg, end, "t", &tid, &tid_len) < 0 || tid_len != 4 ||
+        b_get_str(r, end, "id", &id, &id_len) < 0 || id_len != 20)
+        return;
+    table_seen(d, id, from, now);
+
+    if (tid[0] != 'l' || tid[1] >= DHT_LOOKUPS) return;
+    l = &d->lookups[tid[1]];
+    if (!l->active || l->gen != tid[3] || tid[2] >= l->n) return;
+    c = &l->c[tid[2]];
+    if (c->state != DHT_QUERIED || !same_addr(&c->addr, from)) return;
+
+    c->state = DHT_ANSWERED;
+    l->inflight--;
+    if (!c->has_id) {
+        memcpy(c->id, id, 20);
+        c->has_id = 1;
+    }
+    if (b_get_str(r, end, "token", &s, &len) == 0 && len <= sizeof(c->token)) {
+        memcpy(c->token, s, len);
+        c->token_len = (uint8_t)len;
+    }
+
+    /* Peers, if it has any */
+    if (l->get_peers && (v = b_get(r, end, "values")) != NULL && *v == 'l') {
+        uint8_t peers[DHT_MAX_VALUES * 6];
+        size_t  n = 0;
+        for (v++; v < end && *v != 'e' && n < DHT_MAX_VALUES; v = s + len) {
+            if (b_str(v, end, &s, &len) < 0) break;
+            if (len == 6) memcpy(peers + 6 * n++, s, 6);
+        }
+        if (n > 0) {
+            l->peers_found += n;
+            if (l->on_peers != NULL) l->on_peers(l->arg, peers, n);
+        }
+    }
+
+    /* And nodes closer to the target */
+    if (b_get_str(r, end, "nodes", &s, &len) == 0 && len % DHT_NODE_LEN == 0) {
+        for (size_t i = 0; i < len; i += DHT_NODE_LEN) {
+            struct sockaddr_in addr;
+            compact_addr(s + i + 20, &addr);
+            cand_add(d, l, s + i, &addr);
+        }
+    }
+    lookup_step(d, l, now);
+}
+
+static void
+store_peer(dht_t *d, const uint8_t *info_hash, const struct sockaddr_in *addr)
+{
+    dht_store_t *st = NULL;
+    uint8_t      peer[6];
+
+    addr_compact(addr, peer);
+    for (int i = 0; i < d->nstore; i++)
+        if (!memcmp(d->store[i].info_hash, info_hash, 20)) st = &d->store[i];
+    if (st == NULL) {
+        /* Full, so the oldest torrent goes */
+        if (d->nstore < DHT_STORE) {
+            st = &d->store[d->nstore++];
+        } else {
+            st = &d->store[d->store_next];
+            d->store_next = (d->store_next + 1) % DHT_STORE;
+        }
+        memset(st, 0, sizeof(*st));
+        memcpy(st->info_hash, info_hash, 20);
+    }
+    for (int i = 0; i < st->n; i++)
+        if (!memcmp(st->peers[i], peer, 6)) return;
+    memcpy(st->peers[st->next], peer, 6);
+    st->next = (st->next + 1) % DHT_STORE_PEERS;
+    if (st->n < DHT_STORE_PEERS) st->n++;
+}
+
+static void
+handle_query(dht_t *d, const uint8_t *msg, const uint8_t *end,
+             const struct sockaddr_in *from, uint64_t now)
+{
+    const uint8_t *a = b_get(msg, end, "a"), *tid, *q, *id, *target;
+    size_t         tid_len, q_len, id_len, target_len;
+    dht_out_t     *o;
+
+    if (b_get_str(msg, end, "t", &tid, &tid_len) < 0 || tid_len > 32 ||
+        b_get_str(msg, end, "q", &q, &q_len) < 0 ||
+        b_get_str(a, end, "id", &id, &id_len) < 0 || id_len != 20)
+        return;
+    table_seen(d, id, from, now);
+
+#define IS(name) (q_len == strlen(name) && !memcmp(q, name, q_len))
+    if (!IS("ping") && !IS("find_node") && !IS("get_peers") && !IS("announce_peer"))
+        return;
+
+    o = out_next(d, from);
+    put_lit(o, "d1:rd2:id20:");
+    put(o, d->id, 20);
+
+    if (IS("find_node")) {
+        if (b_get_str(a, end, "target", &target, &target_len) < 0 || target_len != 20)
+            target = id;
+        put_nodes(d, o, target);
+
+    } else if (IS("get_peers")) {
+        uint8_t token[DHT_TOKEN_LEN];
+        if (b_get_str(a, end, "info_hash", &target, &target_len) < 0 || target_len != 20)
+            target = id;
+        put_nodes(d, o, target);
+        make_token(d, 0, from, token);
+        put_lit(o, "5:token");
+        put_str(o, token, sizeof(token));
+        for (int i = 0; i < d->nstore; i++) {
+            if (memcmp(d->store[i].info_hash, target, 20)) continue;
+            put_lit(o, "6:valuesl");
+            for (int j = 0; j < d->store[i].n; j++) put_str(o, d->store[i].peers[j], 6);
+            put_lit(o, "e");
+        }
+
+    } else if (IS("announce_peer")) {
+        const uint8_t     *token, *p;
+        size_t             token_len;
+        uint8_t            good[2][DHT_TOKEN_LEN];
+        struct sockaddr_in peer = *from;
+
+        make_token(d, 0, from, good[0]);
+        make_token(d, 1, from, good[1]);
+        if (b_get_str(a, end, "info_hash", &target, &target_len) < 0 || target_len != 20 ||
+            b_get_str(a, end, "token", &token, &token_len) < 0 ||
+            token_len != DHT_TOKEN_LEN ||
+            (memcmp(token, good[0], token_len) && memcmp(token, good[1], token_len))) {
+            d->nout--;     /* Not worth an error */
+            return;
+        }
+        /* Unless it says to use the port it sent from, it gave us one */
+        if ((p = b_get(a, end, "implied_port")) == NULL || end - p < 3 || memcmp(p, "i1e", 3)) {
+            long port = (p = b_get(a, end, "port")) != NULL && *p == 'i' ?
+                        strtol((const char*)p + 1, NULL, 10) : 0;
+            if (port <= 0 || port > 65535) {
+                d->nout--;
+                return;
+            }
+            peer.sin_port = htons((uint16_t)port);
+        }
+        store_peer(d, target, &peer);
+    }
+#undef IS
+
+    put_lit(o, "e1:t");
+    put_str(o, tid, tid_len);
+    put_lit(o, "1:y1:re");
+}
+
+static void
+handle(dht_t *d, const uint8_t *msg, size_t len, const struct sockaddr_in *from,
+       uint64_t now)
+{
+    const uint8_t *end = msg + len, *y;
+    size_t         y_len;
+
+    d->received++;
+    if (len == 0 || *msg != 'd' || b_skip(msg, end, 0) != end ||
+        b_get_str(msg, end, "y", &y, &y_len) < 0 || y_len != 1)
+        return;
+    if (*y == 'q') handle_query(d, msg, end, from, now);
+    else if (*y == 'r') handle_response(d, msg, end, from, now);
+}
+
+/**
+ * Read the table saved at D->path. Returns how many nodes were in it.
+ */
+static int
+load(dht_t *d)
+{
+    FILE   *f;
+    char    magic[sizeof(DHT_MAGIC) - 1];
+    uint8_t node[DHT_NODE_LEN];
+    int     n = 0;
+
+    if ((f = fopen(d->path, "rb")) == NULL) return -1;
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, DHT_MAGIC, sizeof(magic)) ||
+        fread(d->id, 1, 20, f) != 20) {
+        fclose(f);
+        return -1;
+    }
+    while (fread(node, 1, sizeof(node), f) == sizeof(node)) {
+        struct sockaddr_in addr;
+        compact_addr(node + 20, &addr);
+        table_seen(d, node, &addr, 0);
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Join the DHT on UDP PORT (0 for any), with the node id and routing
+ * table saved at PATH, if there are any
+ */
+dht_t *
+dht_create(uint16_t port, const char *path)
+{
+    dht_t              *d;
+    struct sockaddr_in  addr;
+    int                 n;
+
+    if ((d = (dht_t*)calloc(1, sizeof(dht_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (path != NULL && (d->path = strdup(path)) == NULL) {
+        perror("strdup");
+        free(d);
+        return NULL;
+    }
+    if ((d->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        free(d->path);
+        free(d);
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(port);
+    if (bind(d->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        dht_destroy(d);
+        return NULL;
+    }
+
+    if (getrandom(d->secret, sizeof(d->secret), 0) != sizeof(d->secret)) {
+        perror("getrandom");
+        dht_destroy(d);
+        return NULL;
+    }
+    if (d->path == NULL || (n = load(d)) < 0) {
+        if (getrandom(d->id, sizeof(d->id), 0) != sizeof(d->id)) {
+            perror("getrandom");
+            dht_destroy(d);
+            return NULL;
+        }
+        n = 0;
+    }
+    d->rotated = now_ns();
+    DEBUG("DHT node on port %u, %d nodes from last time\n", port, n);
+    return d;
+}
+
+/**
+ * Save the table and leave the DHT
+ */
+void
+dht_destroy(dht_t *d)
+{
+    if (d == NULL) return;
+    if (d->path != NULL && dht_nodes(d) > 0) dht_save(d);
+    DEBUG("DHT: %llu sent, %llu received, %llu queries of ours\n",
+          (unsigned long long)d->sent, (unsigned long long)d->received,
+          (unsigned long long)d->queries);
+    close(d->fd);
+    free(d->path);
+    free(d);
+}
+
+int
+dht_fd(dht_t *d)
+{
+    return d->fd;
+}
+
+/**
+ * Start lookups from ADDR when the table doesn't have K nodes yet
+ */
+int
+dht_add_bootstrap(dht_t *d, const struct sockaddr_in *addr)
+{
+    if (d->nboot == (int)(sizeof(d->boot) / sizeof(d->boot[0]))) return -1;
+    d->boot[d->nboot++] = *addr;
+    return 0;
+}
+
+/**
+ * How many good nodes we know of
+ */
+int
+dht_nodes(dht_t *d)
+{
+    int n = 0;
+
+    for (int b = 0; b < DHT_ID_BITS; b++)
+        for (int i = 0; i < d->count[b]; i++)
+            if (d->table[b][i].fails < DHT_MAX_FAILS) n++;
+    return n;
+}
+
+/**
+ * Write our id and the good nodes to D->path, replacing it atomically
+ */
+int
+dht_save(dht_t *d)
+{
+    char *tmp;
+    FILE *f;
+    int   rv = 0;
+
+    if ((tmp = (char*)malloc(strlen(d->path) + 5)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", d->path);
+    if ((f = fopen(tmp, "wb")) == NULL) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+    fwrite(DHT_MAGIC, 1, sizeof(DHT_MAGIC) - 1, f);
+    fwrite(d->id, 1, 20, f);
+    for (int b = 0; b < DHT_ID_BITS; b++) {
+        for (int i = 0; i < d->count[b]; i++) {
+            uint8_t node[DHT_NODE_LEN];
+            if (d->table[b][i].fails >= DHT_MAX_FAILS) continue;
+            memcpy(node, d->table[b][i].id, 20);
+            addr_compact(&d->table[b][i].addr, node + 20);
+            fwrite(node, 1, sizeof(node), f);
+        }
+    }
+    if (ferror(f) | fclose(f) || rename(tmp, d->path) < 0) {
+        perror(d->path);
+        rv = -1;
+    }
+    free(tmp);
+    return rv;
+}
+
+/**
+ * Look for the nodes closest to TARGET. With GET_PEERS, TARGET is an info
+ * hash and ON_PEERS(ARG, ...) gets the peers we find, and if
+ * ANNOUNCE_PORT isn't 0, we announce we're on it afterwards. Returns
+ * the lookup's number, or -1 if there are too many going already.
+ */
+int
+dht_lookup(dht_t *d, const uint8_t target[20], int get_peers,
+           uint16_t announce_port, dht_peers_fn on_peers, void *arg)
+{
+    dht_node_t   *near[DHT_LOOKUP_MAX];
+    dht_lookup_t *l = NULL;
+    int           n, slot;
+
+    for (slot = 0; slot < DHT_LOOKUPS; slot++) {
+        if (!d->lookups[slot].active) {
+            l = &d->lookups[slot];
+            break;
+        }
+    }
+    if (l == NULL) return -1;
+
+    uint8_t gen = (uint8_t)(l->gen + 1);
+    memset(l, 0, sizeof(*l));
+    l->active        = 1;
+    l->get_peers     = get_peers;
+    l->gen           = gen;
+    l->announce_port = announce_port;
+    l->on_peers      = on_peers;
+    l->arg           = arg;
+    memcpy(l->target, target, 20);
+
+    /* Start with the closest we know of, and the bootstrap nodes if
+     * that's not enough */
+    n = table_closest(d, target, near, DHT_LOOKUP_MAX);
+    for (int i = 0; i < n; i++) cand_add(d, l, near[i]->id, &near[i]->addr);
+    if (n < DHT_K)
+        for (int i = 0; i < d->nboot; i++) cand_add(d, l, NULL, &d->boot[i]);
+
+    lookup_step(d, l, now_ns());
+    return slot;
+}
+
+/**
+ * How many lookups haven't finished
+ */
+int
+dht_lookups(dht_t *d)
+{
+    int n = 0;
+
+    for (int i = 0; i < DHT_LOOKUPS; i++) n += d->lookups[i].active;
+    return n;
+}
+
+/**
+ * Handle whatever has arrived, DHT_BATCH datagrams at a time. Answers are
+ * queued for dht_flush(). Returns how many there were.
+ */
+int
+dht_recv(dht_t *d)
+{
+    struct mmsghdr     msgs[DHT_BATCH];
+    struct iovec       iov[DHT_BATCH];
+    struct sockaddr_in from[DHT_BATCH];
+    int                total = 0, n;
+
+    do {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < DHT_BATCH; i++) {
+            iov[i].iov_base              = d->in[i];
+            iov[i].iov_len               = sizeof(d->in[i]);
+            msgs[i].msg_hdr.msg_iov      = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen   = 1;
+            msgs[i].msg_hdr.msg_name     = &from[i];
+            msgs[i].msg_hdr.msg_namelen  = sizeof(from[i]);
+        }
+        if ((n = recvmmsg(d->fd, msgs, DHT_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmmsg");
+            break;
+        }
+
+        uint64_t now = now_ns();
+        for (int i = 0; i < n; i++) {
+            if (msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_in) ||
+                (msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+                continue;
+            handle(d, d->in[i], msgs[i].msg_len, &from[i], now);
+        }
+        total += n;
+    } while (n == DHT_BATCH);
+    return total;
+}
+
+/**
+ * Time out queries, move lookups along and rotate the token secret.
+ * Returns how many lookups are still going.
+ */
+int
+dht_tick(dht_t *d)
+{
+    uint64_t now = now_ns();
+
+    if (now - d->rotated > DHT_ROTATE) {
+        memcpy(d->secret[1], d->secret[0], sizeof(d->secret[0]));
+        if (getrandom(d->secret[0], sizeof(d->secret[0]), 0) < 0) perror("getrandom");
+        d->rotated = now;
+    }
+    for (int i = 0; i < DHT_LOOKUPS; i++)
+        if (d->lookups[i].active) lookup_step(d, &d->lookups[i], now);
+    return dht_lookups(d);
+}
+
+/**
+ * Send everything queued, in as few system calls as we can. Returns how
+ * many datagrams went out.
+ */
+int
+dht_flush(dht_t *d)
+{
+    struct mmsghdr msgs[DHT_BATCH];
+    struct iovec   iov[DHT_BATCH];
+    int            n = 0, sent = 0;
+
+    for (int i = 0; i < d->nout; i++) {
+        if (d->out[i].len > DHT_MSG_MAX) continue;   /* Never fit */
+        iov[n].iov_base = d->out[i].buf;
+        iov[n].iov_len  = d->out[i].len;
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_iov     = &iov[n];
+        msgs[n].msg_hdr.msg_iovlen  = 1;
+        msgs[n].msg_hdr.msg_name    = &d->out[i].to;
+        msgs[n].msg_hdr.msg_namelen = sizeof(d->out[i].to);
+        n++;
+    }
+    d->nout = 0;
+
+    while (sent < n) {
+        int rv = sendmmsg(d->fd, msgs + sent, (unsigned int)(n - sent), 0);
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            /* It's UDP; a query that's lost just times out */
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("sendmmsg");
+            break;
+        }
+        sent += rv;
+    }
+    d->sent += (uint64_t)sent;
+    return sent;
+}
+
+/**
+ * One turn of an event loop of our own, for when there isn't another:
+ * wait up to MS for something to arrive, then handle it. Returns how many
+ * lookups are still going.
+ */
+int
+dht_run(dht_t *d, int ms)
+{
+    struct pollfd pfd = { d->fd, POLLIN, 0 };
+
+    dht_flush(d);
+    if (poll(&pfd, 1, ms) < 0 && errno != EINTR) perror("poll");
+    if (pfd.revents & POLLIN) dht_recv(d);
+    ms = dht_tick(d);
+    dht_flush(d);
+    return ms;
+}
@@ -0,0 +1,108 @@
+/*
+ * dht.h --- Find peers without a tracker, on the mainline DHT (BEP 5)
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "bitclient.h"
+
+#define DHT_K          8      /* Nodes per bucket, and per lookup result */
+#define DHT_ALPHA      3      /* Queries in flight per lookup */
+#define DHT_ID_BITS    160
+#define DHT_LOOKUP_MAX 64     /* Candidates a lookup keeps */
+#define DHT_LOOKUPS    8      /* Lookups at once */
+#define DHT_BATCH      32     /* Datagrams per sendmmsg or recvmmsg */
+#define DHT_MSG_MAX    1500
+#define DHT_STORE      64     /* Torrents we keep announced peers for */
+#define DHT_STORE_PEERS 32    /* And peers per torrent */
+
+/* A node in the routing table. Buckets are flat arrays of these. */
+typedef struct dht_node {
+    uint8_t            id[20];
+    struct sockaddr_in addr;
+    uint64_t           seen;     /* When it last answered us, ns */
+    uint8_t            fails;    /* Queries in a row it hasn't answered */
+} dht_node_t;
+
+enum dht_cand_state { DHT_NEW, DHT_QUERIED, DHT_ANSWERED, DHT_FAILED };
+
+/* Someone a lookup has heard of, closest to the target first */
+typedef struct dht_cand {
+    uint8_t             id[20];
+    int                 has_id;    /* Bootstrap nodes don't, until they answer */
+    struct sockaddr_in  addr;
+    enum dht_cand_state state;
+    uint64_t            sent;
+    uint8_t             token[32];
+    uint8_t             token_len;
+} dht_cand_t;
+
+/* Called with N compact peers (6 bytes each) as get_peers finds them */
+typedef void (*dht_peers_fn)(void *arg, const uint8_t *peers, size_t n);
+
+typedef struct dht_lookup {
+    int           active;
+    int           get_peers;      /* Or find_node */
+    uint8_t       gen;            /* Tells a stale answer from a fresh one */
+    uint8_t       target[20];
+    dht_cand_t    c[DHT_LOOKUP_MAX];
+    int           n, inflight, queried;
+    uint16_t      announce_port;  /* Announce here once done, if not 0 */
+    dht_peers_fn  on_peers;
+    void         *arg;
+    uint64_t      peers_found;
+} dht_lookup_t;
+
+/* A datagram waiting for sendmmsg(2) */
+typedef struct dht_out {
+    uint8_t            buf[DHT_MSG_MAX];
+    size_t             len;
+    struct sockaddr_in to;
+} dht_out_t;
+
+/* Peers that announced themselves to us */
+typedef struct dht_store {
+    uint8_t  info_hash[20];
+    uint8_t  peers[DHT_STORE_PEERS][6];
+    int      n, next;
+} dht_store_t;
+
+typedef struct dht {
+    int           fd;
+    uint8_t       id[20];
+    dht_node_t    table[DHT_ID_BITS][DHT_K];
+    uint8_t       count[DHT_ID_BITS];
+    dht_lookup_t  lookups[DHT_LOOKUPS];
+    dht_out_t     out[DHT_BATCH];
+    uint8_t       in[DHT_BATCH][DHT_MSG_MAX];   /* For recvmmsg(2) */
+    int           nout;
+    dht_store_t   store[DHT_STORE];
+    int           nstore;
+    int           store_next;     /* The oldest, once it's full */
+    uint8_t       secret[2][16];  /* For tokens; the old one still counts */
+    uint64_t      rotated;
+    struct sockaddr_in boot[8];   /* Where to start with an empty table */
+    int           nboot;
+    char         *path;           /* Where the table is saved */
+    /* For reporting */
+    uint64_t      sent, received, queries;
+} dht_t;
+
+extern dht_t *dht_create(uint16_t port, const char *path);
+extern void dht_destroy(dht_t *d);
+extern int dht_fd(dht_t *d);
+extern int dht_add_bootstrap(dht_t *d, const struct sockaddr_in *addr);
+extern int dht_nodes(dht_t *d);
+extern int dht_save(dht_t *d);
+
+extern int dht_lookup(dht_t *d, const uint8_t target[20], int get_peers,
+                      uint16_t announce_port, dht_peers_fn on_peers, void *arg);
+extern int dht_lookups(dht_t *d);
+extern int dht_recv(dht_t *d);
+extern int dht_tick(dht_t *d);
+extern int dht_flush(dht_t *d);
+extern int dht_run(dht_t *d, int ms);
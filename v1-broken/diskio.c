@@ -0,0 +1,554 @@
+/*
+ * diskio.c --- Asynchronous block reads and writes
+ *
+ * Reads and writes are queued by the event loop, submitted in batches and
+ * reaped when the eventfd returned by dio_fd() polls readable, so the disk
+ * works while we're busy with the network and nobody blocks on it.
+ *
+ * Where the kernel lets us, this is an io_uring: each batch is a run of
+ * SQEs and one io_uring_enter(2). The block pool's arena is registered as
+ * a fixed buffer and the output file as a fixed file, so the kernel pins
+ * and looks them up once, not on every request. We talk to the ring
+ * directly (see io_uring_setup(2)) rather than through liburing, so
+ * there's nothing more to link against. Where there's no io_uring (old
+ * kernels, seccomp, containers) the same requests go to a small pool of
+ * threads doing pread(2)/pwrite(2), which signal the same eventfd.
+ *
+ * All the dio_* functions are meant to be called from one thread, the
+ * event loop.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "diskio.h"
+#include "storage.h"
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+static off_t
+req_offset(diskio_t *d, dio_req_t *r)
+{
+    return (off_t)r->piece * d->s->piece_len + r->begin;
+}
+
+/**
+ * Map an io_uring of ENTRIES and register what we can with it. Returns -1
+ * if there's no io_uring to be had.
+ */
+static int
+uring_setup(diskio_t *d, unsigned entries)
+{
+    dio_uring_t           *u = &d->u;
+    struct io_uring_params p;
+    struct iovec           arena;
+
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        DEBUG("No io_uring (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_len > u->sq_ring_len) u->sq_ring_len = u->cq_ring_len;
+        u->cq_ring_len = u->sq_ring_len;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) goto fail;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    u->entries    = p.sq_entries;
+    u->cq_entries = p.cq_entries;
+    u->sq_head  = (unsigned*)((char*)u->sq_ring + p.sq_off.head);
+    u->sq_tail  = (unsigned*)((char*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned*)((char*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((char*)u->sq_ring + p.sq_off.array);
+    u->cq_head  = (unsigned*)((char*)u->cq_ring + p.cq_off.head);
+    u->cq_tail  = (unsigned*)((char*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned*)((char*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*)((char*)u->cq_ring + p.cq_off.cqes);
+
+    /* We can't do without hearing about completions */
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_EVENTFD,
+                &d->efd, 1) < 0)
+        goto fail;
+
+    /* But we can do without these, just a little slower */
+    arena.iov_base = d->pool->arena;
+    arena.iov_len  = d->pool->arena_len;
+    u->fixed_bufs  = syscall(__NR_io_uring_register, u->fd,
+                             IORING_REGISTER_BUFFERS, &arena, 1) == 0;
+    u->fixed_file  = syscall(__NR_io_uring_register, u->fd,
+                             IORING_REGISTER_FILES, &d->s->fd, 1) == 0;
+    DEBUG("io_uring with %u entries, %u completions%s%s%s\n", u->entries,
+          u->cq_entries, u->fixed_bufs ? ", fixed buffers" : "",
+          u->fixed_file ? ", fixed file" : "",
+          p.features & IORING_FEAT_NODROP ? "" : ", completions can be dropped");
+    return 0;
+
+fail:
+    DEBUG("Can't set up io_uring (%s)\n", strerror(errno));
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_len);
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+    memset(u, 0, sizeof(*u));
+    return -1;
+}
+
+static void
+uring_teardown(dio_uring_t *u)
+{
+    munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+    if (u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_len);
+    munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+}
+
+/**
+ * Move as many queued requests as fit into SQEs and submit them at once.
+ *
+ * A free SQE isn't enough: every request in flight will need a CQE, and
+ * without IORING_FEAT_NODROP the kernel throws away completions that don't
+ * fit, leaving us waiting forever for them. Even with it, an overflowing
+ * CQ costs the kernel memory and us a slow path, so we never have more in
+ * flight than the CQ holds. The rest wait in the queue for dio_reap().
+ *
+ * A request counts as in flight as soon as its SQE is published, since
+ * from then on it either completes or is taken back by uring_reclaim().
+ * The kernel may not take every SQE at once, or may be too busy to take
+ * any, so whatever it leaves in the SQ goes again next time, from here or
+ * from dio_reap(). Returns how many requests were published, or -1 if the
+ * ring has failed.
+ */
+static int
+uring_submit(diskio_t *d)
+{
+    dio_uring_t *u    = &d->u;
+    unsigned     tail = *u->sq_tail;
+    unsigned     head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    int          n    = 0;
+
+    while (d->queued != NULL && tail - head < u->entries &&
+           d->inflight + (unsigned)n < u->cq_entries) {
+        dio_req_t           *r   = d->queued;
+        unsigned             idx = tail & *u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[idx];
+
+        d->queued = r->next;
+        memset(sqe, 0, sizeof(*sqe));
+        if (u->fixed_bufs) {
+            sqe->opcode    = r->op == DIO_READ ? IORING_OP_READ_FIXED
+                                               : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 0;
+        } else {
+            sqe->opcode    = r->op == DIO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        }
+        sqe->fd        = u->fixed_file ? 0 : d->s->fd;
+        sqe->flags     = u->fixed_file ? IOSQE_FIXED_FILE : 0;
+        sqe->addr      = (uint64_t)(uintptr_t)r->b->data;
+        sqe->len       = r->len;
+        sqe->off       = (uint64_t)req_offset(d, r);
+        sqe->user_data = (uint64_t)(uintptr_t)r;
+        u->sq_array[idx] = idx;
+        tail++, n++;
+    }
+    if (d->queued == NULL) d->queued_tail = NULL;
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+    d->inflight += (unsigned)n;
+
+    while ((head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) != tail) {
+        long ret = syscall(__NR_io_uring_enter, u->fd, tail - head, 0, 0, NULL, 0);
+        if (ret > 0 || (ret < 0 && errno == EINTR)) continue;
+        if (ret == 0 || errno == EAGAIN || errno == EBUSY) break;
+        perror("io_uring_enter");
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * Whether there are SQEs the kernel hasn't taken yet
+ */
+static int
+uring_unsubmitted(dio_uring_t *u)
+{
+    return *u->sq_tail != __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * One of the thread pool's threads
+ */
+static void *
+worker_tmain(void *raw)
+{
+    diskio_t *d   = (diskio_t*)raw;
+    uint64_t  one = 1;
+
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        dio_req_t *r;
+
+        while (!d->stopping && d->pending == NULL)
+            pthread_cond_wait(&d->work, &d->lock);
+        if ((r = d->pending) == NULL) break;
+        if ((d->pending = r->next) == NULL) d->pending_tail = NULL;
+        pthread_mutex_unlock(&d->lock);
+
+        uint32_t done = 0;
+        while (done < r->len) {
+            ssize_t n = r->op == DIO_READ
+                ? pread(d->s->fd, r->b->data + done, r->len - done,
+                        req_offset(d, r) + done)
+                : pwrite(d->s->fd, r->b->data + done, r->len - done,
+                         req_offset(d, r) + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += (uint32_t)n;
+        }
+        r->res = done == r->len ? (int)done : -EIO;
+
+        pthread_mutex_lock(&d->lock);
+        r->next     = d->finished;
+        d->finished = r;
+        if (write(d->efd, &one, sizeof(one)) < 0) perror("write");
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/**
+ * Finish R on the event loop: mark what was written and tell whoever asked
+ */
+static void
+complete(diskio_t *d, dio_req_t *r)
+{
+    d->inflight--;
+    d->inflight_bytes -= r->len;
+
+    if (r->res >= 0 && (uint32_t)r->res != r->len) r->res = -EIO;
+    if (r->op == DIO_WRITE && r->res >= 0)
+        storage_mark_blocks(d->s, r->piece, r->begin, r->len);
+    if (r->done) r->done(r->arg, r->b, r->res);
+
+    block_unref(r->b);
+    r->next  = d->spare;
+    d->spare = r;
+}
+
+/**
+ * Fail everything still queued, once there's no hope of submitting it
+ */
+static void
+fail_queued(diskio_t *d)
+{
+    while (d->queued != NULL) {
+        dio_req_t *r = d->queued;
+        d->queued = r->next;
+        r->res    = -EIO;
+        d->inflight++;   /* complete() takes it back off */
+        complete(d, r);
+    }
+    d->queued_tail = NULL;
+}
+
+/**
+ * Take back the SQEs the kernel never took, once the ring has failed, and
+ * fail their requests
+ */
+static void
+uring_reclaim(diskio_t *d)
+{
+    dio_uring_t *u    = &d->u;
+    unsigned     head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    dio_req_t   *r, *failed = NULL;
+
+    /* Collect them before any DONE callback can publish more over them */
+    for (unsigned i = head; i != *u->sq_tail; i++) {
+        struct io_uring_sqe *sqe = &u->sqes[u->sq_array[i & *u->sq_mask]];
+        r       = (dio_req_t*)(uintptr_t)sqe->user_data;
+        r->next = failed;
+        failed  = r;
+    }
+    __atomic_store_n(u->sq_tail, head, __ATOMIC_RELEASE);
+
+    while ((r = failed) != NULL) {
+        failed = r->next;
+        r->res = -EIO;
+        complete(d, r);
+    }
+}
+
+static int
+enqueue(diskio_t *d, int op, block_t *b, uint32_t piece, uint32_t begin,
+        uint32_t len, dio_done_fn done, void *arg)
+{
+    dio_req_t *r;
+
+    if (piece >= d->s->num_pieces ||
+        (uint64_t)begin + len > storage_piece_size(d->s, piece) || len > BLOCK_LEN)
+        return -1;
+
+    if ((r = d->spare) != NULL) {
+        d->spare = r->next;
+    } else if ((r = (dio_req_t*)malloc(sizeof(dio_req_t))) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    block_ref(b);
+    r->op    = op;
+    r->b     = b;
+    r->piece = piece;
+    r->begin = begin;
+    r->len   = len;
+    r->res   = 0;
+    r->done  = done;
+    r->arg   = arg;
+    r->next  = NULL;
+
+    if (d->queued_tail) d->queued_tail->next = r;
+    else d->queued = r;
+    d->queued_tail = r;
+    d->inflight_bytes += len;
+    return 0;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Do I/O on S's file into and out of POOL's blocks, with io_uring if we
+ * can and THREADS threads if we can't
+ */
+diskio_t *
+diskio_open(storage_t *s, blockpool_t *pool, int threads)
+{
+    diskio_t *d;
+
+    if (s == NULL || pool == NULL) return NULL;
+    if ((d = (diskio_t*)calloc(1, sizeof(diskio_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    d->s    = s;
+    d->pool = pool;
+    d->efd  = -1;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->work, NULL);
+
+    if ((d->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        goto fail;
+    }
+    if (uring_setup(d, DIO_DEPTH) == 0) {
+        d->uring = 1;
+        return d;
+    }
+
+    DEBUG("Doing disk I/O with %d threads instead\n", threads);
+    if ((d->threads = (pthread_t*)calloc((size_t)threads, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        goto fail;
+    }
+    for (; d->nthreads < threads; d->nthreads++)
+        if (pthread_create(&d->threads[d->nthreads], NULL, worker_tmain, d) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    if (d->nthreads == 0) goto fail;
+    return d;
+
+fail:
+    if (d->efd >= 0) close(d->efd);
+    free(d->threads);
+    pthread_cond_destroy(&d->work);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+    return NULL;
+}
+
+/**
+ * Wait for everything in flight, then stop
+ */
+void
+diskio_close(diskio_t *d)
+{
+    if (d == NULL) return;
+
+    for (;;) {
+        struct pollfd pfd = { d->efd, POLLIN, 0 };
+
+        /* If the ring has failed, what's left will never go. If the kernel
+         * is just busy, try again in a moment. */
+        if ((d->queued != NULL || (d->uring && uring_unsubmitted(&d->u))) &&
+            dio_submit(d) < 0) {
+            fprintf(stderr, "Giving up on queued disk requests\n");
+            fail_queued(d);
+        }
+        if (d->inflight == 0 && d->queued == NULL) break;
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) break;
+        dio_reap(d);
+    }
+
+    if (d->uring) {
+        uring_teardown(&d->u);
+    } else {
+        pthread_mutex_lock(&d->lock);
+        d->stopping = 1;
+        pthread_cond_broadcast(&d->work);
+        pthread_mutex_unlock(&d->lock);
+        for (int i = 0; i < d->nthreads; i++) pthread_join(d->threads[i], NULL);
+        free(d->threads);
+    }
+
+    while (d->spare != NULL) {
+        dio_req_t *r = d->spare;
+        d->spare = r->next;
+        free(r);
+    }
+    close(d->efd);
+    pthread_cond_destroy(&d->work);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+/**
+ * Poll this for POLLIN, then dio_reap()
+ */
+int
+dio_fd(diskio_t *d)
+{
+    return d->efd;
+}
+
+/**
+ * Queue a read of LEN bytes from BEGIN of PIECE into block B, or a write
+ * of B to where its piece, begin and len say. DONE is called from
+ * dio_reap() once it's finished. Nothing happens until dio_submit().
+ */
+int
+dio_read(diskio_t *d, block_t *b, uint32_t piece, uint32_t begin,
+         uint32_t len, dio_done_fn done, void *arg)
+{
+    return enqueue(d, DIO_READ, b, piece, begin, len, done, arg);
+}
+
+int
+dio_write(diskio_t *d, block_t *b, dio_done_fn done, void *arg)
+{
+    return enqueue(d, DIO_WRITE, b, b->piece, b->begin, b->len, done, arg);
+}
+
+/**
+ * Send everything queued to the disk. Returns how many requests went, or
+ * -1 on error.
+ */
+int
+dio_submit(diskio_t *d)
+{
+    int n = 0;
+
+    if (d->uring) {
+        /* It counts what it publishes itself */
+        if ((n = uring_submit(d)) < 0) uring_reclaim(d);
+        return n;
+    }
+
+    if (d->queued != NULL) {
+        pthread_mutex_lock(&d->lock);
+        for (dio_req_t *r = d->queued; r != NULL; r = r->next) n++;
+        if (d->pending_tail) d->pending_tail->next = d->queued;
+        else d->pending = d->queued;
+        d->pending_tail = d->queued_tail;
+        d->queued = d->queued_tail = NULL;
+        pthread_cond_broadcast(&d->work);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    /* Count what went, for flow control */
+    d->inflight += (unsigned)n;
+    return n;
+}
+
+/**
+ * Call the DONE callbacks of everything that's finished, then submit
+ * anything that didn't fit in the ring, or that the kernel didn't take,
+ * last time. Returns how many finished.
+ */
+int
+dio_reap(diskio_t *d)
+{
+    uint64_t   count;
+    int        n = 0;
+    dio_req_t *r;
+
+    if (read(d->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read");
+
+    if (d->uring) {
+        dio_uring_t *u    = &d->u;
+        unsigned     head = *u->cq_head;
+
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            r      = (dio_req_t*)(uintptr_t)cqe->user_data;
+            r->res = cqe->res;
+            __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+            complete(d, r);
+            n++;
+        }
+    } else {
+        pthread_mutex_lock(&d->lock);
+        r = d->finished;
+        d->finished = NULL;
+        pthread_mutex_unlock(&d->lock);
+        while (r != NULL) {
+            dio_req_t *next = r->next;
+            complete(d, r);
+            r = next;
+            n++;
+        }
+    }
+
+    if (d->queued != NULL || (d->uring && uring_unsubmitted(&d->u)))
+        dio_submit(d);
+    return n;
+}
@@ -0,0 +1,81 @@
+/*
+ * diskio.h --- Asynchronous block reads and writes
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "storage.h"
+
+#define DIO_DEPTH 128   /* Requests in flight at once, with io_uring */
+
+enum dio_op {
+    DIO_READ,
+    DIO_WRITE,
+};
+
+/* Called from dio_reap() with the bytes transferred, or -errno */
+typedef void (*dio_done_fn)(void *arg, block_t *b, int res);
+
+typedef struct dio_req {
+    int             op;
+    block_t        *b;          /* We hold a reference until it's done */
+    uint32_t        piece;
+    uint32_t        begin;
+    uint32_t        len;
+    int             res;
+    dio_done_fn     done;
+    void           *arg;
+    struct dio_req *next;
+} dio_req_t;
+
+/* The parts of an io_uring we touch, see io_uring_setup(2) */
+typedef struct dio_uring {
+    int       fd;
+    unsigned  entries;
+    unsigned  cq_entries;       /* How many completions fit, so can be in flight */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ring, *cq_ring;
+    size_t    sq_ring_len, cq_ring_len;
+    int       fixed_bufs;       /* The block pool is registered */
+    int       fixed_file;       /* And so is the output file */
+} dio_uring_t;
+
+typedef struct diskio {
+    storage_t      *s;
+    blockpool_t    *pool;
+    int             efd;        /* Readable when there's something to reap */
+    int             uring;      /* Otherwise we've a thread pool */
+    dio_uring_t     u;
+    dio_req_t      *queued;     /* Waiting for dio_submit() */
+    dio_req_t      *queued_tail;
+    dio_req_t      *spare;      /* Done with, for reuse */
+    unsigned        inflight;   /* Submitted and not yet reaped */
+    uint64_t        inflight_bytes; /* Queued or in flight */
+    /* The thread pool */
+    pthread_t      *threads;
+    int             nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    dio_req_t      *pending;    /* For the threads, oldest first */
+    dio_req_t      *pending_tail;
+    dio_req_t      *finished;   /* By the threads, for dio_reap() */
+    int             stopping;
+} diskio_t;
+
+extern diskio_t *diskio_open(storage_t *s, blockpool_t *pool, int threads);
+extern void diskio_close(diskio_t *d);
+extern int dio_fd(diskio_t *d);
+
+extern int dio_read(diskio_t *d, block_t *b, uint32_t piece, uint32_t begin,
+                    uint32_t len, dio_done_fn done, void *arg);
+extern int dio_write(diskio_t *d, block_t *b, dio_done_fn done, void *arg);
+extern int dio_submit(diskio_t *d);
+extern int dio_reap(diskio_t *d);
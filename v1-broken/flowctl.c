@@ -0,0 +1,158 @@
+/*
+ * flowctl.c --- Stop asking peers for blocks the disk can't take yet
+ *
+ * Every block we REQUEST will take a buffer from the pool until it's
+ * written, so if the network outruns the disk, the pool fills, the disk
+ * queue grows and everything waits on everything else. Instead, the event
+ * loop checks here before issuing REQUESTs. Once the pool or the disk
+ * queue crosses its high watermark we stop requesting and shrink every
+ * peer's pipeline, and we only start again once both are back under their
+ * low watermarks, so we don't flap around a single threshold.
+ *
+ * Pipelines shrink by half while throttled and grow back by one per
+ * update after that, so a peer's depth settles at what the disk can
+ * actually absorb.
+ *
+ * Blocks the write cache holds don't count: they only leave once more
+ * blocks complete their pieces, and throttling is what stops those
+ * arriving, so counting them could stop us for good. The pool watermarks
+ * are fractions of what the cache can't have instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "diskio.h"
+#include "flowctl.h"
+#include "storage.h"
+#include "wcache.h"
+
+static double
+secs_since(struct timespec *then)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - then->tv_sec) +
+           (double)(now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/**
+ * Watch POOL, and if there are any, DIO and WC. The watermarks are
+ * fractions of the blocks outside WC: stop at 85% of them in use or half
+ * the pool queued for the disk, start again below 60% and a quarter.
+ */
+flowctl_t *
+flowctl_create(blockpool_t *pool, diskio_t *dio, wcache_t *wc)
+{
+    flowctl_t *fc;
+
+    if (pool == NULL) return NULL;
+    /* main keeps the cache to half the pool, so there's room to finish
+     * whatever pieces it holds */
+    if (wc != NULL && wc->limit > pool->count / 2) {
+        FATAL("The write cache can't have more than half of the pool\n");
+        return NULL;
+    }
+    if ((fc = (flowctl_t*)calloc(1, sizeof(flowctl_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    fc->pool      = pool;
+    fc->dio       = dio;
+    fc->wc        = wc;
+    fc->outside   = pool->count - (wc != NULL ? (uint32_t)wc->limit : 0);
+    fc->pool_high = (uint32_t)((uint64_t)fc->outside * 85 / 100);
+    fc->pool_low  = (uint32_t)((uint64_t)fc->outside * 60 / 100);
+    fc->disk_high = (uint64_t)pool->count * BLOCK_LEN / 2;
+    fc->disk_low  = (uint64_t)pool->count * BLOCK_LEN / 4;
+    clock_gettime(CLOCK_MONOTONIC, &fc->since);
+    return fc;
+}
+
+void
+flowctl_destroy(flowctl_t *fc)
+{
+    if (fc == NULL) return;
+    if (log_verbosely) flowctl_print(fc, stderr);
+    free(fc);
+}
+
+/**
+ * Look at the pool and the disk queue again. Call it from the event loop
+ * whenever either may have changed. Returns whether we're throttled.
+ */
+int
+flowctl_update(flowctl_t *fc)
+{
+    int was = fc->throttled;
+
+    fc->pool_used = blockpool_in_use(fc->pool);
+    if (fc->wc != NULL) {
+        pthread_mutex_lock(&fc->wc->lock);
+        size_t held = fc->wc->held;
+        pthread_mutex_unlock(&fc->wc->lock);
+        fc->pool_used = held < fc->pool_used ? fc->pool_used - (uint32_t)held : 0;
+    }
+    fc->disk_queued = fc->dio != NULL ? fc->dio->inflight_bytes : 0;
+
+    if (!fc->throttled &&
+        (fc->pool_used >= fc->pool_high || fc->disk_queued >= fc->disk_high)) {
+        fc->throttled = 1;
+        fc->throttles++;
+    } else if (fc->throttled &&
+               fc->pool_used < fc->pool_low && fc->disk_queued < fc->disk_low) {
+        fc->throttled = 0;
+    }
+
+    if (fc->throttled != was) {
+        if (was) fc->throttled_secs += secs_since(&fc->since);
+        clock_gettime(CLOCK_MONOTONIC, &fc->since);
+        DEBUG("%s requesting: %u/%u blocks in use outside the write cache, "
+              "%llu KiB queued for disk\n",
+              fc->throttled ? "Stopped" : "Resumed", fc->pool_used,
+              fc->outside, (unsigned long long)(fc->disk_queued >> 10));
+    }
+    return fc->throttled;
+}
+
+/**
+ * Whether new REQUESTs may be sent at all
+ */
+int
+flowctl_may_request(flowctl_t *fc)
+{
+    return fc == NULL || !fc->throttled;
+}
+
+/**
+ * How many REQUESTs a peer with DEPTH outstanding should have from now on
+ */
+int
+flowctl_pipeline(flowctl_t *fc, int depth)
+{
+    if (fc != NULL && fc->throttled) return depth > 1 ? depth / 2 : 1;
+    return depth < FC_PIPELINE_MAX ? depth + 1 : FC_PIPELINE_MAX;
+}
+
+/**
+ * Print where we stand, e.g. for a status line
+ */
+void
+flowctl_print(flowctl_t *fc, FILE *f)
+{
+    double secs = fc->throttled_secs + (fc->throttled ? secs_since(&fc->since) : 0);
+
+    fprintf(f, "flow: %s, pool %u/%u outside the write cache (high %u, low %u), disk %llu KiB "
+            "(high %llu, low %llu), throttled %llu times for %.1fs\n",
+            fc->throttled ? "throttled" : "open", fc->pool_used,
+            fc->outside, fc->pool_high, fc->pool_low,
+            (unsigned long long)(fc->disk_queued >> 10),
+            (unsigned long long)(fc->disk_high >> 10),
+            (unsigned long long)(fc->disk_low >> 10),
+            (unsigned long long)fc->throttles, secs);
+}
@@ -0,0 +1,40 @@
+/*
+ * flowctl.h --- Stop asking peers for blocks the disk can't take yet
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "diskio.h"
+#include "wcache.h"
+
+#define FC_PIPELINE_MAX 32   /* REQUESTs outstanding per peer, at most */
+
+typedef struct flowctl {
+    blockpool_t    *pool;
+    diskio_t       *dio;
+    wcache_t       *wc;                    /* Whose blocks don't count */
+    uint32_t        outside;               /* Blocks the cache can't have */
+    /* Stop above a high watermark, start again once below both lows */
+    uint32_t        pool_high, pool_low;   /* Blocks in use, outside WC */
+    uint64_t        disk_high, disk_low;   /* Bytes waiting for the disk */
+    int             throttled;
+    /* What we last saw, and how often we've had to stop */
+    uint32_t        pool_used;
+    uint64_t        disk_queued;
+    uint64_t        throttles;
+    struct timespec since;                 /* The last change of state */
+    double          throttled_secs;        /* Before that */
+} flowctl_t;
+
+extern flowctl_t *flowctl_create(blockpool_t *pool, diskio_t *dio, wcache_t *wc);
+extern void flowctl_destroy(flowctl_t *fc);
+extern int flowctl_update(flowctl_t *fc);
+extern int flowctl_may_request(flowctl_t *fc);
+extern int flowctl_pipeline(flowctl_t *fc, int depth);
+extern void flowctl_print(flowctl_t *fc, FILE *f);
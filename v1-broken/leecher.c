@@ -95,8 +95,27 @@ leecher_tmain(void *raw)
         return NULL;
     }
 
+    /* Take peers from connmgr_next(t->conns, ...) while it has room, and */
+    /* tell it when they're connected, handshaken, deliver blocks or fail; */
+    /* connmgr_tick() once a second closes the slow and the stuck, through */
+    /* t->conns->on_close so they leave the poll set too. Poll */
+    /* resolver_fd(t->dns) and resolver_reap() when it's readable; that's */
+    /* when peers given by name reach t->conns */
+
     /* Loop through the segments, we'll fetch them sequentially for simplicity */
     /* for (chunk_t *c = t->pieces; c != NULL; c = c->next) { */
+    /*     Skip it if storage_has_piece(), and only request the blocks */
+    /*     from storage_next_missing() on that aren't storage_has_block() */
+    /*     Only while flowctl_may_request(t->flow), keeping each peer's */
+    /*     pipeline at flowctl_pipeline() REQUESTs */
+    /*     Frame each peer's replies with pw_open(), pw_fill() when it's */
+    /*     readable and pw_next() until it returns 0; PIECEs arrive in the */
+    /*     block on_block pointed at (block_alloc_wait() one from t->pool), */
+    /*     ready for wcache_put(t->wcache, ...). Poll dio_fd(t->dio) */
+    /*     alongside the sockets and dio_reap() when it's readable */
+    /*     Leave a peer out of the poll set unless rl_ready() on its down */
+    /*     bucket (parented to t->down), rl_charge() what pw_fill() read, */
+    /*     and poll no longer than rl_wait() */
 
     /* } */
 
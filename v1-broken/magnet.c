@@ -22,6 +22,8 @@
 #include <netdb.h>
 
 #include "magnet.h"
+#include "resolver.h"
+#include "wire.h"
 
 #include "bencode/bencode.h"
 #include "bencode/list.h"
@@ -33,38 +35,22 @@
 
 
 /**
- * Ansi C "itoa" based on Kernighan & Ritchie's "Ansi C":
- * Sourced from http://www.strudel.org.uk/itoa/
- * These are used for debugging in the packet generating functions
+ * Print a packet we're about to send, or just received, in hex
  */
-
-static void
-_strreverse(char* begin, char* end) {
-    char aux;
-    while(end>begin)
-        aux=*end, *end--=*begin, *begin++=aux;
-}
-
 static void
-_itoa(long long value, char* str, int base) {
-    static char num[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-    char* wstr=str;
-    long long sign;
-
-    // Validate base
-    if (base<2 || base>35){ *wstr='\0'; return; }
-
-    // Take care of sign
-    if ((sign=value) < 0) value = -value;
-
-    // Conversion. Number is reversed.
-    do *wstr++ = num[value%base]; while(value/=base);
-
-    if(sign<0) *wstr++='-';
-    *wstr='\0';
-
-    // Reverse string
-    _strreverse(str,wstr-1);
+dump_packet(const char *what, const uint8_t *pkt, size_t len)
+{
+    char line[3 * 16 + 1];
+
+    if (!log_verbosely) return;
+    DEBUG("-- BEGIN %s (%zu bytes) --\n", what, len);
+    for (size_t i = 0; i < len; i += 16) {
+        char *p = line;
+        for (size_t j = i; j < len && j < i + 16; j++, p += 3)
+            sprintf(p, "%02x ", pkt[j]);
+        DEBUG("%s\n", line);
+    }
+    DEBUG("--- END %s ---\n", what);
 }
 
 
@@ -92,206 +78,84 @@ hex_to_binary(void const* vinput, void* voutput, size_t byte_length)
  * These functions craft a UDP packet to send to the tracker as per bep 15:
  * www.bittorrent.org/beps/bep_0015.html
  * The first creates a connection (handshake) packet and the second creates
- * a packet to request peer information.
- * Take the url of the host we're contacting and a torrent structure, return
- * a successfully crafted packet or NULL on error
+ * a packet to request peer information. Both write into PKT, which must
+ * have room for WIRE_ANN_LEN bytes, and return the packet's length.
  */
-static uint8_t *
-udp_gen_conn_pkt(torrent_t *t)
+static size_t
+udp_gen_conn_pkt(torrent_t *t, uint8_t *pkt)
 {
-    uint64_t magic_number   = htobe64(0x41727101980);
-    uint32_t transaction_id = htobe32(3141592653);
-    uint8_t *packet = (uint8_t*)malloc(17);
-    memset(packet, 0, 17);
-
-    if (packet == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-
-    /* WARNING:
-     * Because of timeout issues in udo_request, I have no idea if this packet
-     * is actually valid. */
-
-    *packet        = (uint8_t)(magic_number >> 56);
-    *(packet + 1)  = (uint8_t)((magic_number << 8) >> 56);
-    *(packet + 2)  = (uint8_t)((magic_number << 16) >> 56);
-    *(packet + 3)  = (uint8_t)((magic_number << 24) >> 56);
-    *(packet + 4)  = (uint8_t)((magic_number << 32) >> 56);
-    *(packet + 5)  = (uint8_t)((magic_number << 40) >> 56);
-    *(packet + 6)  = (uint8_t)((magic_number << 48) >> 56);
-    *(packet + 7)  = (uint8_t)((magic_number << 56) >> 56);
-    *(packet + 8)  = 0;
-    *(packet + 9)  = 0;
-    *(packet + 10) = 0;
-    *(packet + 11) = 0;
-    *(packet + 12) = (uint8_t)(transaction_id >> 24);
-    *(packet + 13) = (uint8_t)((transaction_id << 8) >> 24);
-    *(packet + 14) = (uint8_t)((transaction_id << 16) >> 24);
-    *(packet + 15) = (uint8_t)((transaction_id << 24) >> 24);
-
-    /* Print the packet as binary */
-    if (log_verbosely) {
-        char dbg_magnum[65], dbg_transid[33], dbg_packet[137],
-            *ptr = &dbg_packet[0];
-
-        memset(dbg_magnum, 0, 65);
-        memset(dbg_transid, 0, 33);
-        memset(dbg_packet, 0, 137);
-
-        _itoa(magic_number, dbg_magnum, 2);
-        _itoa(transaction_id, dbg_transid, 2);
-        for (size_t i = 0; i < 16; i++) { _itoa(packet[i], ptr, 2); ptr++; }
-
-        DEBUG("-- BEGIN PACKET --\n");
-        DEBUG("%s00000000000000000000000000000000%s\n", dbg_magnum, dbg_transid);
-        DEBUG("%s\n", dbg_packet);
-        DEBUG("--- END PACKET ---\n");
-    }
+    size_t len;
 
-    t->trans_id = transaction_id;
-    
-    return packet;
+    t->trans_id = 3141592653;
+    len = wire_udp_connect(pkt, t->trans_id);
+    dump_packet("CONNECT", pkt, len);
+    return len;
 }
 
-static uint8_t *
-udp_gen_annc_pkt(torrent_t *t)
+static size_t
+udp_gen_annc_pkt(torrent_t *t, uint8_t *pkt)
 {
-    uint64_t connection_id  = t->conn_id;           /* Set in udp_gen_annc_pkt */
-    uint32_t action         = htobe32(1);
-    uint32_t transaction_id = t->trans_id;          /* Same as above */
-    char     info_hash[21];
-    char     peer_id[21];
-    uint64_t downloaded     = htobe64((uint64_t)t->dloaded);
-    uint64_t left           = htobe64((uint64_t)t->left);
-    uint64_t uploaded       = htobe64((uint64_t)t->uploaded);
-    uint32_t event          = 0;
-    uint8_t *packet = (uint8_t*)malloc(84);
-    memset(&info_hash, 0, 20);
-    memset(&peer_id, 0, 20);
-    memset(packet, 0, 84);
-
-    if (packet == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-
-    /* WARNING:
-    * Because of timeout issues in udo_request, I have no idea if this packet
-    * is actually valid. */
-
-    /* Copy info_hash and peer_id into big endian buffers */
-    for (size_t i = 0; i < 20; i++) info_hash[i] = (char)htobe32(*(t->info_hash + i));
-    for (size_t i = 0; i < 20; i++) peer_id[i] = (char)htobe32(*(t->peer_id + i));
+    wire_announce_t a;
+    size_t          len;
+
+    memset(&a, 0, sizeof(a));
+    a.conn_id   = t->conn_id;          /* Set in udp_parse_connect */
+    a.trans_id  = t->trans_id;         /* Set in udp_gen_conn_pkt */
+    a.info_hash = t->info_hash_raw;
+    a.peer_id   = (const uint8_t*)t->peer_id;
+    a.dloaded   = (uint64_t)t->dloaded;
+    a.left      = (uint64_t)t->left;
+    a.uploaded  = (uint64_t)t->uploaded;
+    a.num_want  = -1;
+    a.port      = (uint16_t)atoi(t->port);
 
     /* Set the event based on the current event */
-    if      (!strcmp(t->event, "completed")) event = htobe32(1);
-    else if (!strcmp(t->event, "started"))   event = htobe32(2);
-    else if (!strcmp(t->event, "stopped"))   event = htobe32(3);
-
-    *packet        = (uint8_t)(connection_id >> 56);
-    *(packet + 1)  = (uint8_t)((connection_id << 8) >> 56);
-    *(packet + 2)  = (uint8_t)((connection_id << 16) >> 56);
-    *(packet + 3)  = (uint8_t)((connection_id << 24) >> 56);
-    *(packet + 4)  = (uint8_t)((connection_id << 32) >> 56);
-    *(packet + 5)  = (uint8_t)((connection_id << 40) >> 56);
-    *(packet + 6)  = (uint8_t)((connection_id << 48) >> 56);
-    *(packet + 7)  = (uint8_t)((connection_id << 56) >> 56);
-    *(packet + 8)  = 0;
-    *(packet + 9)  = 0;
-    *(packet + 10) = 0;
-    *(packet + 11) = (uint8_t)action;
-    *(packet + 12) = (uint8_t)(transaction_id >> 24);
-    *(packet + 13) = (uint8_t)((transaction_id << 8) >> 24);
-    *(packet + 14) = (uint8_t)((transaction_id << 16) >> 24);
-    *(packet + 15) = (uint8_t)((transaction_id << 24) >> 24);
-    for (int i = 0, p = 16; i < 20; i++, p++) *(packet + p) = (uint8_t)info_hash[i];
-    for (int i = 0, p = 36; i < 20; i++, p++) *(packet + p) = (uint8_t)peer_id[i];
-    *(packet + 56) = (uint8_t)(downloaded >> 56);
-    *(packet + 57) = (uint8_t)((downloaded << 8) >> 56);
-    *(packet + 58) = (uint8_t)((downloaded << 16) >> 56);
-    *(packet + 59) = (uint8_t)((downloaded << 24) >> 56);
-    *(packet + 61) = (uint8_t)((downloaded << 32) >> 56);
-    *(packet + 62) = (uint8_t)((downloaded << 40) >> 56);
-    *(packet + 63) = (uint8_t)((downloaded << 48) >> 56);
-    *(packet + 63) = (uint8_t)((downloaded << 56) >> 56);
-    *(packet + 64) = (uint8_t)(left >> 56);
-    *(packet + 65) = (uint8_t)((left << 8) >> 56);
-    *(packet + 66) = (uint8_t)((left << 16) >> 56);
-    *(packet + 67) = (uint8_t)((left << 24) >> 56);
-    *(packet + 68) = (uint8_t)((left << 32) >> 56);
-    *(packet + 69) = (uint8_t)((left << 40) >> 56);
-    *(packet + 70) = (uint8_t)((left << 48) >> 56);
-    *(packet + 71) = (uint8_t)((left << 56) >> 56);
-    *(packet + 72) = (uint8_t)(uploaded >> 56);
-    *(packet + 73) = (uint8_t)((uploaded << 8) >> 56);
-    *(packet + 74) = (uint8_t)((uploaded << 16) >> 56);
-    *(packet + 75) = (uint8_t)((uploaded << 24) >> 56);
-    *(packet + 76) = (uint8_t)((uploaded << 32) >> 56);
-    *(packet + 77) = (uint8_t)((uploaded << 40) >> 56);
-    *(packet + 78) = (uint8_t)((uploaded << 48) >> 56);
-    *(packet + 79) = (uint8_t)((uploaded << 56) >> 56);
-    *(packet + 80) = (uint8_t)(event >> 24);
-    *(packet + 81) = (uint8_t)((event << 8) >> 24);
-    *(packet + 82) = (uint8_t)((event << 16) >> 24);
-    *(packet + 83) = (uint8_t)((event << 24) >> 24);
-
-    /* Print the packet as binary */
-    if (log_verbosely) {
-        char dbg_connid[65], dbg_action[33], dbg_transid[33], dbg_ihash[161],
-            dbg_pid[161], dbg_dloaded[65], dbg_left[65], dbg_uploaded[65],
-            dbg_event[33], dbg_packet[793], *ihash_ptr = &dbg_ihash[0],
-            *pid_ptr = &dbg_pid[0], *packet_ptr = &dbg_packet[0];
-
-        memset(dbg_connid, 0, 65);
-        memset(dbg_action, 0, 33);
-        memset(dbg_transid, 0, 33);
-        memset(dbg_ihash, 0, 161);
-        memset(dbg_pid, 0, 161);
-        memset(dbg_dloaded, 0, 65);
-        memset(dbg_left, 0, 65);
-        memset(dbg_uploaded, 0, 65);
-        memset(dbg_event, 0, 33);
-        memset(dbg_packet, 0, 793);
-
-        _itoa(connection_id, dbg_connid, 2);
-        _itoa(action, dbg_action, 2);
-        _itoa(transaction_id, dbg_transid, 2);
-        for (int i = 0; i < 21; i++) { _itoa(packet[i], ihash_ptr, 2); ihash_ptr++; }
-        for (int i = 0; i < 21; i++) { _itoa(packet[i], pid_ptr, 2); pid_ptr++; }
-        _itoa(downloaded, dbg_dloaded, 2);
-        _itoa(left, dbg_left, 2);
-        _itoa(uploaded, dbg_uploaded, 2);
-        _itoa(event, dbg_event, 2);
-        for (int i = 0; i < 84; i++) { _itoa(packet[i], packet_ptr, 2); packet_ptr++; }
-
-        printf("-- BEGIN PACKET --\n");
-        printf("%s%s%s%s%s%s%s%s%s%s\n", dbg_connid, dbg_action, dbg_transid,
-               dbg_ihash, dbg_pid, dbg_dloaded, dbg_left, dbg_uploaded,
-               dbg_event, dbg_packet);
-        printf("%s\n", dbg_packet);
-        printf("--- END PACKET ---\n");
-    }
+    if      (!strcmp(t->event, "completed")) a.event = WIRE_COMPLETED;
+    else if (!strcmp(t->event, "started"))   a.event = WIRE_STARTED;
+    else if (!strcmp(t->event, "stopped"))   a.event = WIRE_STOPPED;
 
-    return packet;
+    len = wire_udp_announce(pkt, &a);
+    dump_packet("ANNOUNCE", pkt, len);
+    return len;
 }
 
 /**
  * Parse a UDP tracker's response or the connect and announce sorts, 
- * respectively. The announce function fills in the torrent structure.
+ * respectively. The first remembers the connection id and the second
+ * adds the peers it lists to T.
  */
-int
-udp_parse_connect(char *body)
+static int
+udp_parse_connect(torrent_t *t, const uint8_t *body, size_t len)
 {
-    DEBUG("udp_parse_connect: body: %s\n", body);
+    dump_packet("CONNECT RESPONSE", body, len);
+    if (wire_udp_connected(body, len, t->trans_id, &t->conn_id) < 0) {
+        FATAL("Bad UDP connect response\n");
+        return -1;
+    }
     return 0;
 }
 
-int
-udp_parse_announce(torrent_t *t, char *body)
+static int
+udp_parse_announce(torrent_t *t, const uint8_t *body, size_t len)
 {
-    if (t == NULL) return -1;
-    DEBUG("udp_parse_announce: body: %s\n", body);
+    uint32_t interval;
+    int      n;
+
+    dump_packet("ANNOUNCE RESPONSE", body, len);
+    if ((n = wire_udp_announced(body, len, t->trans_id, &interval)) < 0) {
+        FATAL("Bad UDP announce response\n");
+        return -1;
+    }
+    DEBUG("Tracker gave us %d peers, and wants to hear from us in %us\n",
+          n, interval);
+
+    for (int i = 0; i < n; i++) {
+        uint8_t  ip[4];
+        uint16_t port;
+
+        wire_udp_peer(body, i, ip, &port);
+        if (magnet_add_peer(t, ip, port) < 0) return -1;
+    }
     return 0;
 }
 
@@ -306,6 +170,67 @@ write_callback(void *data, size_t size, size_t nmemb, void *userp)
     return size * nmemb;
 }
 
+/**
+ * Pull the host and port out of a tracker's URL. Returns 0 or -1.
+ */
+static int
+url_host_port(const char *url, char *host, size_t host_len, uint16_t *port)
+{
+    CURLU *u;
+    char *h = NULL, *p = NULL;
+    int rv = -1;
+
+    if ((u = curl_url()) == NULL) return -1;
+    if (curl_url_set(u, CURLUPART_URL, url, CURLU_NON_SUPPORT_SCHEME) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_HOST, &h, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_PORT, &p, CURLU_DEFAULT_PORT) == CURLUE_OK) {
+        /* IPv6 addresses come in brackets */
+        size_t len = strlen(h);
+        char *start = h;
+        if (len > 2 && h[0] == '[' && h[len-1] == ']') {
+            start++;
+            len -= 2;
+        }
+        if (len < host_len && atoi(p) > 0 && atoi(p) < 65536) {
+            memcpy(host, start, len);
+            host[len] = '\0';
+            *port = (uint16_t)atoi(p);
+            rv = 0;
+        }
+    }
+    curl_free(h);
+    curl_free(p);
+    curl_url_cleanup(u);
+    return rv;
+}
+
+/**
+ * Tell curl where HOST:PORT is, so it doesn't look it up again itself.
+ * Returns a list for CURLOPT_RESOLVE, or NULL to let it.
+ */
+static struct curl_slist *
+curl_pin(resolver_t *r, const char *host, uint16_t port)
+{
+    res_addrs_t addrs;
+    char entry[512], ip[INET6_ADDRSTRLEN];
+    int off;
+
+    if (resolver_get(r, host, &addrs) < 0) return NULL;
+    off = snprintf(entry, sizeof(entry), "%s:%u:", host, port);
+    for (int i = 0; i < addrs.n && off < (int)sizeof(entry); i++) {
+        struct sockaddr_storage *a = &addrs.addr[i];
+        if (a->ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in*)a)->sin_addr, ip, sizeof(ip));
+            off += snprintf(entry + off, sizeof(entry) - off, "%s%s", i ? "," : "", ip);
+        } else {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6*)a)->sin6_addr, ip, sizeof(ip));
+            off += snprintf(entry + off, sizeof(entry) - off, "%s[%s]", i ? "," : "", ip);
+        }
+    }
+    if (off >= (int)sizeof(entry)) return NULL;
+    return curl_slist_append(NULL, entry);
+}
+
 
 
 /************* L A R G E   H E L P E R   F U N C T I O N S *************/
@@ -313,47 +238,48 @@ write_callback(void *data, size_t size, size_t nmemb, void *userp)
 
 
 /**
- * Send an initial request to a tracker using the udp:// URI scheme.
+ * Send the LEN-byte PKT to a tracker using the udp:// URI scheme, and
+ * receive its response into BODY, which holds up to BODY_LEN bytes.
+ * Returns the length of the response or -1.
  * Networking code adapted from here:
  * www.beej.us/guide/bgnet/html/index-wide.html#datagram
  */
-static char *
-udp_request(torrent_t *t, char *url, char *pkt, char *body)
+static ssize_t
+udp_request(torrent_t *t, char *url, const uint8_t *pkt, size_t len,
+            uint8_t *body, size_t body_len)
 {
-    int sock, rv;
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr;
-    socklen_t addr_len;
-
-    /* Initial network setup */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;    /* IP version agnostic */
-    hints.ai_socktype = SOCK_DGRAM; /* UDP socket */
-
-    /* Get information about connections */
-    char *tmp = strdup(url+6);
-    char *host = strndup(tmp, (size_t)(strchr(tmp, ':') - tmp));
-    if ((rv = getaddrinfo(host, t->port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        free(host);
-        free(tmp);
-        return NULL;
+    int sock = -1, i;
+    char host[256];
+    uint16_t port;
+    res_addrs_t addrs;
+    struct sockaddr_storage *to, their_addr;
+    socklen_t to_len, addr_len;
+
+    /* Find the tracker, which is usually cached from the connect */
+    if (url_host_port(url, host, sizeof(host), &port) < 0) {
+        fprintf(stderr, "Can't find a host and port in %s\n", url);
+        return -1;
+    }
+    if (resolver_get(t->dns, host, &addrs) < 0) {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        return -1;
     }
-    free(host);
-    free(tmp);
 
     /* Establish a socket */
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+    for (i = 0; i < addrs.n; i++) {
+        if ((sock = socket(addrs.addr[i].ss_family, SOCK_DGRAM, 0)) == -1) {
             perror("socket");
             continue;
         }
         break;
     }
-    if (p == NULL) {
+    if (i == addrs.n) {
         FATAL("Failed to create a UDP socket\n");
-        return NULL;
+        return -1;
     }
+    to     = &addrs.addr[i];
+    to_len = addrs.len[i];
+    resolver_port(to, port);
 
     /* Set up a timeout */
     int n = 0;
@@ -362,60 +288,50 @@ udp_request(torrent_t *t, char *url, char *pkt, char *body)
     tv.tv_usec = 0;
     if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
         perror("setsockopt");
-        freeaddrinfo(servinfo);
         close(sock);
-        return NULL;
+        return -1;
     }
 
     /* Loop forever until we receive a good response */
-    size_t bytes;
+    ssize_t bytes;
     while (1) {
         /* Send the packet */
-        if (sendto(sock, pkt, strlen(pkt), 0, p->ai_addr, p->ai_addrlen) == -1) {
+        if (sendto(sock, pkt, len, 0, (struct sockaddr*)to, to_len) == -1) {
             perror("sendto");
-            return NULL;
+            close(sock);
+            return -1;
         }
 
         /* Recieve a response */
         addr_len = sizeof(their_addr);
-        bytes = recvfrom(sock, body, CURL_MAX_WRITE_SIZE, 0,
+        bytes = recvfrom(sock, body, body_len, 0,
                          (struct sockaddr *)&their_addr, &addr_len);
 
         /* If we've timeout out before, increase the timeout and try again */
-        if (errno == EWOULDBLOCK || body == 0) {   /* The socket timed out */
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             if (n < 8) {
                 DEBUG("UDP connection to %s timed out, retrying\n", url);
                 tv.tv_sec = 15 * (int)pow(2, n);
                 if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
                     perror("setsockopt");
-                    freeaddrinfo(servinfo);
                     close(sock);
-                    return NULL;
+                    return -1;
                 }
                 n++;
                 continue;
             } else {
                 DEBUG("UDP timeout to %s exceeded the max threshold\n", url);
                 close(sock);
-                freeaddrinfo(servinfo);
-                return NULL;
+                return -1;
             }
         }
         break;
     }
-
-    /* Resize the body buffer */
-    if ((body = (char*)reallocarray(body, bytes + 1, sizeof(char))) == NULL) {
-        perror("reallocarray");
-        return NULL;
-    }
-    char *end = body + bytes + 1;
-    *end = '\0';
+    if (bytes < 0) perror("recvfrom");
 
     close(sock);
-    freeaddrinfo(servinfo);
 
-    return body;
+    return bytes;
 }
 
 /**
@@ -569,56 +485,38 @@ magnet_request_tracker(torrent_t *t)
         return -1;
     }
 
+    /* Look up every tracker at once, rather than each as we get to it */
+    for (tracker_t *a = t->trackers; a != NULL; a = a->next) {
+        char host[256];
+        uint16_t port;
+        if (url_host_port(a->url, host, sizeof(host), &port) == 0)
+            resolver_lookup(t->dns, host, NULL, NULL, NULL);
+    }
+
     /* Try each of the announce urls until one works */
     for (tracker_t *a = t->trackers; a != NULL; a = a->next) {
         /* Make sure the body is properly zeroed */
         memset(body, 0, CURL_MAX_WRITE_SIZE + 1);
 
         if (!strncmp(a->url, "udp", 3)) {
-            uint8_t *connect_pkt, *announce_pkt;
-
-            FATAL("The UDP tracker protocol is broken, so it'll just timeout here\n");
-
-            /* Generate the handshake packet */
-            if ((connect_pkt = udp_gen_conn_pkt(t)) == NULL) {
-                FATAL("Failed to generate the connection UDP packet\n");
-                return -1;
-            }
-
-            DEBUG("Generated connection packet: (%s)\n", (char*)connect_pkt);
+            uint8_t *resp = (uint8_t*)body, pkt[WIRE_ANN_LEN];
+            ssize_t  got;
 
             /* Send and parse the intial handshake */
-            if (udp_request(t, a->url, (char*)connect_pkt, body) == NULL) {
-                free(connect_pkt);
-                continue;
-            }
-            DEBUG("Connection response body: (%s)\n", body);
-            free(connect_pkt);
-            if (udp_parse_connect(body) < 0) {
-                free(connect_pkt);
+            got = udp_request(t, a->url, pkt, udp_gen_conn_pkt(t, pkt), resp,
+                              CURL_MAX_WRITE_SIZE);
+            if (got < 0 || udp_parse_connect(t, resp, (size_t)got) < 0)
                 continue;
-            }
-
-            /* Generate the announce packet */
-            if ((announce_pkt = udp_gen_annc_pkt(t)) == NULL) {
-                FATAL("Failed to generate the announce UDP packet\n");
-                return -1;
-            }
-
-            DEBUG("Generated announce packet: (%s)\n", (char*)announce_pkt);
 
             /* Send the announce and parse the response into T */
-            if (udp_request(t, a->url, (char*)announce_pkt, body) == NULL) {
-                free(announce_pkt);
+            got = udp_request(t, a->url, pkt, udp_gen_annc_pkt(t, pkt), resp,
+                              CURL_MAX_WRITE_SIZE);
+            if (got < 0 || udp_parse_announce(t, resp, (size_t)got) < 0)
                 continue;
-            }
-            DEBUG("Announce response body: (%s)\n", body);
-            free(announce_pkt);
-            if (udp_parse_announce(t, body) < 0) {
-                free(announce_pkt);
-                continue;
-            }
-            break;
+
+            /* That isn't bencoded, so we're done */
+            free(body);
+            return 0;
 
         } else if (!strncmp(a->url, "http", 4)) {
             CURL *curl = NULL;
@@ -630,8 +528,16 @@ magnet_request_tracker(torrent_t *t)
                     a->url, t->info_hash, t->peer_id, t->port, t->uploaded,
                     t->dloaded, t->left, "0", t->event);
 
+            /* Point curl at the address we've already got */
+            char host[256];
+            uint16_t port;
+            struct curl_slist *pin = NULL;
+            if (url_host_port(a->url, host, sizeof(host), &port) == 0)
+                pin = curl_pin(t->dns, host, port);
+
             if ((curl = curl_easy_init()) != NULL) {
                 curl_easy_setopt(curl, CURLOPT_URL, url);
+                if (pin != NULL) curl_easy_setopt(curl, CURLOPT_RESOLVE, pin);
                 curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
                 curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)body);
                 curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
@@ -640,14 +546,17 @@ magnet_request_tracker(torrent_t *t)
                     fprintf(stderr, "CURL failed to reach tracker %s: %s\n",
                             a->url, curl_easy_strerror(err));
                     curl_easy_cleanup(curl);
+                    curl_slist_free_all(pin);
                     continue;
                 } else {
                     curl_easy_cleanup(curl);
+                    curl_slist_free_all(pin);
                     FATAL("If all went well (and you ran with -v), you should see some information,\n including a list of peers, printed on the screen.\n Sadly, this almost never happens so I haven't implemented the TCP peer protocol");
                     break;
                 }
             } else {
                 FATAL("Failed to intialize curl\n");
+                curl_slist_free_all(pin);
             }
         } else {
             fprintf(stderr, "Url has unknown protocol scheme: %s\n", a->url);
@@ -675,6 +584,37 @@ magnet_request_tracker(torrent_t *t)
     return 0;
 }
 
+/**
+ * Add the peer at IP and PORT to T, unless it's already there, e.g. from
+ * a tracker and the DHT both. Returns 0 or -1.
+ */
+int
+magnet_add_peer(torrent_t *t, const uint8_t ip[4], uint16_t port)
+{
+    peers_t *p;
+    char     ipstr[INET_ADDRSTRLEN], portstr[6];
+
+    inet_ntop(AF_INET, ip, ipstr, sizeof(ipstr));
+    sprintf(portstr, "%u", port);
+    for (p = t->peers; p != NULL; p = p->next)
+        if (!strcmp(p->ip, ipstr) && !strcmp(p->port, portstr)) return 0;
+
+    if ((p = (peers_t*)calloc(1, sizeof(peers_t))) == NULL ||
+        (p->id = strdup("")) == NULL || (p->ip = strdup(ipstr)) == NULL ||
+        (p->port = strdup(portstr)) == NULL) {
+        perror("calloc");
+        if (p != NULL) {
+            free(p->id);
+            free(p->ip);
+            free(p);
+        }
+        return -1;
+    }
+    p->next  = t->peers;
+    t->peers = p;
+    return 0;
+}
+
 /**
  * Take a magnet link and parse its contents into the torrent structure
  */
@@ -719,6 +659,7 @@ magnet_parse_uri(char *magnet)
 
             /* Hex is just too pretty, so we need URL-encoded binary :/ */
             hex_to_binary(hex, binptr, 20);
+            memcpy(t->info_hash_raw, binptr, 20);
             CURL *curl = curl_easy_init();
             if (curl) {
                 t->info_hash = curl_easy_escape(curl, binptr, strlen(binptr));
@@ -773,9 +714,9 @@ magnet_parse_uri(char *magnet)
         return NULL;
     }
 
+    /* Without trackers, the DHT is where we'll find peers */
     if (t->trackers == NULL) {
-        FATAL("Mangled magnet, failed to extract trackers\n");
-        return NULL;
+        DEBUG("No trackers in the magnet\n");
     }
 
     if (t->filename == NULL) {
@@ -4,3 +4,4 @@
 
 extern torrent_t *magnet_parse_uri(char *magnet);
 extern int magnet_request_tracker(torrent_t *t);
+extern int magnet_add_peer(torrent_t *t, const uint8_t ip[4], uint16_t port);
@@ -0,0 +1,343 @@
+/*
+ * peerwire.c --- Frame peer messages as they come off the socket
+ *
+ * TCP hands us whatever it has, so a message may arrive in a dozen reads
+ * or a dozen messages in one. Rather than copying each into its own
+ * buffer, every connection gets a receive ring that recv(2) writes into
+ * directly, and complete messages are handed out as views into it. The
+ * ring is mapped twice back to back (from a memfd), so a message that wraps
+ * around the end still reads as one contiguous run; where that isn't
+ * possible we fall back to a flat buffer that's compacted now and then.
+ *
+ * PIECE payloads don't even go through the ring. As soon as we've seen a
+ * PIECE's header the caller is asked where the block goes, and the rest of
+ * it is read straight there with readv(2), the ring taking whatever comes
+ * after it in the same read. The block is then hashed and written from
+ * where it landed.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "bitclient.h"
+#include "peerwire.h"
+
+#define PSTR     "BitTorrent protocol"
+#define PSTR_LEN 19
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return ntohl(n);
+}
+
+/**
+ * Map a ring of at least LEN bytes, mirrored if the kernel lets us
+ */
+static int
+ring_init(pw_ring_t *r, size_t len)
+{
+    size_t   page = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t *base;
+    int      fd;
+
+    r->size = (len + page - 1) / page * page;
+    r->head = r->tail = 0;
+
+    if ((fd = memfd_create("peerwire", MFD_CLOEXEC)) >= 0) {
+        base = mmap(NULL, 2 * r->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+        if (ftruncate(fd, (off_t)r->size) == 0 && base != MAP_FAILED &&
+            mmap(base, r->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) != MAP_FAILED &&
+            mmap(base + r->size, r->size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            close(fd);
+            r->buf      = base;
+            r->mirrored = 1;
+            return 0;
+        }
+        if (base != MAP_FAILED) munmap(base, 2 * r->size);
+        close(fd);
+    }
+
+    DEBUG("Can't mirror the receive ring, using a flat buffer\n");
+    if ((r->buf = (uint8_t*)malloc(r->size)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    r->mirrored = 0;
+    return 0;
+}
+
+static void
+ring_free(pw_ring_t *r)
+{
+    if (r->mirrored) munmap(r->buf, 2 * r->size);
+    else free(r->buf);
+}
+
+static size_t
+ring_used(pw_ring_t *r)
+{
+    return r->tail - r->head;
+}
+
+static uint8_t *
+ring_data(pw_ring_t *r)
+{
+    return r->buf + r->head;
+}
+
+static void
+ring_advance(pw_ring_t *r, size_t n)
+{
+    r->head += n;
+    if (r->mirrored && r->head >= r->size) {
+        r->head -= r->size;
+        r->tail -= r->size;
+    }
+}
+
+/**
+ * Where the next recv(2) should go, and how much it may take
+ */
+static uint8_t *
+ring_space(pw_ring_t *r, size_t *room)
+{
+    if (r->mirrored) {
+        *room = r->size - ring_used(r);
+        return r->buf + r->tail % r->size;
+    }
+
+    /* Slide what's left to the front once the end gets close */
+    if (r->head > 0 && (r->head == r->tail || r->size - r->tail < r->size / 4)) {
+        memmove(r->buf, r->buf + r->head, ring_used(r));
+        r->tail -= r->head;
+        r->head  = 0;
+    }
+    *room = r->size - r->tail;
+    return r->buf + r->tail;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Start framing what arrives on FD, which should be a connected socket
+ * we've sent our handshake on. RING_LEN must fit the biggest message we'll
+ * keep in the ring: a BITFIELD for a big torrent may need more than
+ * PW_RING_LEN. If ON_BLOCK is given, PIECE payloads go where it says.
+ */
+peerwire_t *
+pw_open(int fd, size_t ring_len, pw_block_fn on_block, void *arg)
+{
+    peerwire_t *pw;
+
+    if ((pw = (peerwire_t*)calloc(1, sizeof(peerwire_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (ring_init(&pw->ring, ring_len > 0 ? ring_len : PW_RING_LEN) < 0) {
+        free(pw);
+        return NULL;
+    }
+    pw->fd       = fd;
+    pw->on_block = on_block;
+    pw->arg      = arg;
+    return pw;
+}
+
+void
+pw_close(peerwire_t *pw)
+{
+    if (pw == NULL) return;
+    ring_free(&pw->ring);
+    free(pw);
+}
+
+/**
+ * Read once from the socket, into the block being scattered first and the
+ * ring after it. Returns what read(2) would; with a non-blocking socket
+ * call it until it fails with EAGAIN. Fails with ENOBUFS if the ring is
+ * full, meaning messages need consuming first.
+ */
+ssize_t
+pw_fill(peerwire_t *pw)
+{
+    struct iovec iov[2];
+    int          n = 0;
+    size_t       room;
+    uint8_t     *at = ring_space(&pw->ring, &room);
+    ssize_t      got;
+
+    if (pw->scatter != NULL && pw->scatter_left > 0) {
+        iov[n].iov_base = pw->scatter + (pw->scatter_len - pw->scatter_left);
+        iov[n].iov_len  = pw->scatter_left;
+        n++;
+    }
+    if (room > 0) {
+        iov[n].iov_base = at;
+        iov[n].iov_len  = room;
+        n++;
+    }
+    if (n == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do {
+        got = readv(pw->fd, iov, n);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) return got;
+
+    size_t rest = (size_t)got;
+    if (pw->scatter != NULL && pw->scatter_left > 0) {
+        size_t took = rest < pw->scatter_left ? rest : pw->scatter_left;
+        pw->scatter_left -= (uint32_t)took;
+        rest             -= took;
+    }
+    pw->ring.tail += rest;
+    return got;
+}
+
+/**
+ * Frame the next complete message into MSG. Returns 1 if there was one, 0
+ * if we need to pw_fill() first, or -1 if the peer isn't speaking the
+ * protocol (EPROTO) or sent something bigger than the ring (EMSGSIZE).
+ * Each message must be pw_consume()d before the next.
+ */
+int
+pw_next(peerwire_t *pw, pw_msg_t *msg)
+{
+    pw_ring_t     *r    = &pw->ring;
+    size_t         used = ring_used(r);
+    const uint8_t *p    = ring_data(r);
+    uint32_t       len;
+
+    memset(msg, 0, sizeof(*msg));
+
+    /* A scattered block is done once the last of it has been read */
+    if (pw->scatter != NULL) {
+        if (pw->scatter_left > 0) return 0;
+        msg->id    = PW_PIECE;
+        msg->len   = pw->scatter_len;
+        msg->index = pw->scatter_index;
+        msg->begin = pw->scatter_begin;
+        msg->block = pw->scatter;
+        return 1;
+    }
+
+    if (!pw->handshaken) {
+        if (used < PW_HANDSHAKE_LEN) return 0;
+        if (p[0] != PSTR_LEN || memcmp(p + 1, PSTR, PSTR_LEN)) {
+            errno = EPROTO;
+            return -1;
+        }
+        msg->id      = PW_HANDSHAKE;
+        msg->len     = PW_HANDSHAKE_LEN;
+        msg->payload = p;
+        return 1;
+    }
+
+    if (used < 4) return 0;
+    if ((len = get32(p)) == 0) {
+        msg->id = PW_KEEPALIVE;
+        return 1;
+    }
+    if (used < 5) return 0;
+    msg->id = p[4];
+    if (msg->id == PW_PIECE && len < 9) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* It's all here, so it can be read where it is */
+    if (used >= 4 + (size_t)len) {
+        msg->len     = len - 1;
+        msg->payload = p + 5;
+        if (msg->id == PW_PIECE) {
+            msg->index    = get32(p + 5);
+            msg->begin    = get32(p + 9);
+            msg->len     -= 8;
+            msg->payload += 8;
+        }
+        return 1;
+    }
+
+    /* A PIECE that isn't all here yet can go straight to its block */
+    if (msg->id == PW_PIECE && pw->on_block != NULL && used >= 13) {
+        uint32_t index = get32(p + 5), begin = get32(p + 9);
+        uint8_t *dest  = pw->on_block(pw->arg, index, begin, len - 9);
+
+        if (dest != NULL) {
+            uint32_t have = (uint32_t)(used - 13);
+            memcpy(dest, p + 13, have);
+            ring_advance(r, used);
+            pw->scatter       = dest;
+            pw->scatter_len   = len - 9;
+            pw->scatter_left  = len - 9 - have;
+            pw->scatter_index = index;
+            pw->scatter_begin = begin;
+            memset(msg, 0, sizeof(*msg));
+            return 0;
+        }
+    }
+
+    if (4 + (size_t)len > r->size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memset(msg, 0, sizeof(*msg));
+    return 0;
+}
+
+/**
+ * Done with MSG; its bytes may be reused
+ */
+void
+pw_consume(peerwire_t *pw, pw_msg_t *msg)
+{
+    if (msg->block != NULL) {
+        pw->scatter      = NULL;
+        pw->scatter_len  = 0;
+        pw->scatter_left = 0;
+        return;
+    }
+
+    switch (msg->id) {
+    case PW_HANDSHAKE:
+        pw->handshaken = 1;
+        ring_advance(&pw->ring, PW_HANDSHAKE_LEN);
+        break;
+    case PW_KEEPALIVE:
+        ring_advance(&pw->ring, 4);
+        break;
+    case PW_PIECE:
+        ring_advance(&pw->ring, 13 + (size_t)msg->len);
+        break;
+    default:
+        ring_advance(&pw->ring, 5 + (size_t)msg->len);
+    }
+}
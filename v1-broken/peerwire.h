@@ -0,0 +1,79 @@
+/*
+ * peerwire.h --- Frame peer messages as they come off the socket
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bitclient.h"
+
+#define PW_HANDSHAKE_LEN 68      /* pstrlen, pstr, reserved, info_hash, peer_id */
+#define PW_RING_LEN      65536   /* A 16 KiB PIECE and then some */
+
+/* BEP 3 message ids, plus two of our own for messages that have none */
+enum pw_id {
+    PW_CHOKE          = 0,
+    PW_UNCHOKE        = 1,
+    PW_INTERESTED     = 2,
+    PW_NOT_INTERESTED = 3,
+    PW_HAVE           = 4,
+    PW_BITFIELD       = 5,
+    PW_REQUEST        = 6,
+    PW_PIECE          = 7,
+    PW_CANCEL         = 8,
+    PW_PORT           = 9,
+    PW_KEEPALIVE      = 254,     /* Zero-length message */
+    PW_HANDSHAKE      = 255,     /* The 68 bytes before everything else */
+};
+
+/* A complete message. It points into the connection's buffers, so it's
+ * only good until pw_consume() or the next pw_fill() */
+typedef struct pw_msg {
+    uint8_t        id;
+    uint32_t       len;          /* Bytes of payload, not counting the id */
+    const uint8_t *payload;      /* In the ring; NULL if scattered */
+    /* PIECE only */
+    uint32_t       index;
+    uint32_t       begin;
+    uint8_t       *block;        /* Where a scattered block was received */
+} pw_msg_t;
+
+/* Asked where the LEN-byte block BEGIN of piece INDEX should go. Return
+ * NULL to have it framed in the ring like anything else */
+typedef uint8_t *(*pw_block_fn)(void *arg, uint32_t index, uint32_t begin,
+                                uint32_t len);
+
+/* Received bytes waiting to be framed. If mirrored, the buffer is mapped
+ * twice back to back so anything in it can be read in one piece */
+typedef struct pw_ring {
+    uint8_t *buf;
+    size_t   size;
+    size_t   head;               /* First unconsumed byte */
+    size_t   tail;               /* One past the last received byte */
+    int      mirrored;
+} pw_ring_t;
+
+typedef struct peerwire {
+    int         fd;              /* Not ours; the caller closes it */
+    pw_ring_t   ring;
+    int         handshaken;
+    pw_block_fn on_block;
+    void       *arg;
+    /* A PIECE being received straight into its block */
+    uint8_t    *scatter;
+    uint32_t    scatter_len;
+    uint32_t    scatter_left;
+    uint32_t    scatter_index;
+    uint32_t    scatter_begin;
+} peerwire_t;
+
+extern peerwire_t *pw_open(int fd, size_t ring_len, pw_block_fn on_block,
+                           void *arg);
+extern void pw_close(peerwire_t *pw);
+
+extern ssize_t pw_fill(peerwire_t *pw);
+extern int pw_next(peerwire_t *pw, pw_msg_t *msg);
+extern void pw_consume(peerwire_t *pw, pw_msg_t *msg);
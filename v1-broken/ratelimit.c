@@ -0,0 +1,163 @@
+/*
+ * ratelimit.c --- Token buckets for upload and download rates
+ *
+ * Each peer has a bucket per direction whose parent is its torrent's,
+ * whose parent is the global one, and a transfer has to fit in all of
+ * them. The event loop asks rl_ready() before putting a socket in the
+ * poll set: a throttled peer simply isn't polled for that direction, and
+ * rl_wait() says how long until one would be, which bounds the poll
+ * timeout. Nobody sleeps, and an idle bucket costs nothing.
+ *
+ * Buckets are refilled lazily from the monotonic clock in nanoseconds,
+ * carrying the fraction of a token over, so rates come out exact at any
+ * speed, and work is per send or recv, never per byte. A socket is only
+ * ready once every level has RL_QUANTUM bytes, so slow limits don't wake
+ * us up for a few bytes at a time.
+ *
+ * A hierarchy belongs to the thread that moves data in its direction;
+ * there's no locking here.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bitclient.h"
+#include "ratelimit.h"
+#include "storage.h"
+
+#define NS          1000000000ULL
+#define RL_QUANTUM  1460               /* A TCP segment's worth */
+#define RL_MIN_BURST (4 * BLOCK_LEN)   /* A PIECE always fits */
+#define RL_MAX_RATE (16ULL << 30)      /* So rate * NS can't overflow */
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+static void
+refill(rl_bucket_t *b, uint64_t now)
+{
+    uint64_t dt, acc;
+
+    if (b->rate == 0 || now <= b->last) return;
+    dt      = now - b->last;
+    b->last = now;
+
+    /* A second's worth fills any bucket */
+    if (dt > NS) dt = NS;
+    acc        = dt * b->rate + b->frac;
+    b->tokens += (int64_t)(acc / NS);
+    b->frac    = acc % NS;
+    if (b->tokens >= (int64_t)b->burst) {
+        b->tokens = (int64_t)b->burst;
+        b->frac   = 0;
+    }
+}
+
+static int64_t
+quantum(rl_bucket_t *b)
+{
+    return (int64_t)(b->burst < RL_QUANTUM ? b->burst : RL_QUANTUM);
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+uint64_t
+rl_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Start B full, at RATE bytes per second (0 for unlimited), under PARENT
+ */
+void
+rl_init(rl_bucket_t *b, uint64_t rate, rl_bucket_t *parent)
+{
+    memset(b, 0, sizeof(*b));
+    b->parent = parent;
+    b->last   = rl_now();
+    rl_set_rate(b, rate);
+    b->tokens = (int64_t)b->burst;
+}
+
+/**
+ * Change B's rate. It holds a tenth of a second's worth at most.
+ */
+void
+rl_set_rate(rl_bucket_t *b, uint64_t rate)
+{
+    refill(b, rl_now());
+    b->rate  = rate < RL_MAX_RATE ? rate : RL_MAX_RATE;
+    b->burst = b->rate / 10 > RL_MIN_BURST ? b->rate / 10 : RL_MIN_BURST;
+    if (b->tokens > (int64_t)b->burst) b->tokens = (int64_t)b->burst;
+}
+
+/**
+ * How much of WANT may go through B and all its parents right now
+ */
+uint64_t
+rl_quota(rl_bucket_t *b, uint64_t want, uint64_t now)
+{
+    for (; b != NULL; b = b->parent) {
+        if (b->rate == 0) continue;
+        refill(b, now);
+        if (b->tokens <= 0) return 0;
+        if ((uint64_t)b->tokens < want) want = (uint64_t)b->tokens;
+    }
+    return want;
+}
+
+/**
+ * N bytes went through B; take them from it and all its parents
+ */
+void
+rl_charge(rl_bucket_t *b, uint64_t n)
+{
+    for (; b != NULL; b = b->parent)
+        if (b->rate != 0) b->tokens -= (int64_t)n;
+}
+
+/**
+ * Whether B's socket belongs in the poll set for its direction
+ */
+int
+rl_ready(rl_bucket_t *b, uint64_t now)
+{
+    for (; b != NULL; b = b->parent) {
+        if (b->rate == 0) continue;
+        refill(b, now);
+        if (b->tokens < quantum(b)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Nanoseconds until rl_ready(B) will be true; 0 if it is now
+ */
+uint64_t
+rl_wait(rl_bucket_t *b, uint64_t now)
+{
+    uint64_t wait = 0;
+
+    for (; b != NULL; b = b->parent) {
+        int64_t short_by;
+
+        if (b->rate == 0) continue;
+        refill(b, now);
+        if ((short_by = quantum(b) - b->tokens) <= 0) continue;
+
+        uint64_t ns = ((uint64_t)short_by * NS - b->frac + b->rate - 1) / b->rate;
+        if (ns > wait) wait = ns;
+    }
+    return wait;
+}
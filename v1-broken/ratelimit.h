@@ -0,0 +1,32 @@
+/*
+ * ratelimit.h --- Token buckets for upload and download rates
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "bitclient.h"
+
+#define RL_UNLIMITED UINT64_MAX
+
+/* Tokens are bytes. A bucket may go into debt, since we only know how
+ * much a send or recv moved after the fact; nothing more goes through it
+ * until it's paid off. */
+typedef struct rl_bucket {
+    uint64_t          rate;     /* Bytes per second, 0 for unlimited */
+    uint64_t          burst;    /* Most tokens it holds */
+    int64_t           tokens;
+    uint64_t          frac;     /* Fractions of a token, in byte-nanoseconds */
+    uint64_t          last;     /* When it was last refilled */
+    struct rl_bucket *parent;   /* Peer -> torrent -> global */
+} rl_bucket_t;
+
+extern uint64_t rl_now(void);
+extern void rl_init(rl_bucket_t *b, uint64_t rate, rl_bucket_t *parent);
+extern void rl_set_rate(rl_bucket_t *b, uint64_t rate);
+
+extern uint64_t rl_quota(rl_bucket_t *b, uint64_t want, uint64_t now);
+extern void rl_charge(rl_bucket_t *b, uint64_t n);
+extern int rl_ready(rl_bucket_t *b, uint64_t now);
+extern uint64_t rl_wait(rl_bucket_t *b, uint64_t now);
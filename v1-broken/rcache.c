@@ -0,0 +1,199 @@
+/*
+ * rcache.c --- Keep the pieces peers keep asking for in memory
+ *
+ * Peers in a swarm tend to want the same pieces at about the same time,
+ * and a piece is requested block by block, so serving each REQUEST with
+ * its own pread(2) reads the same hot pieces over and over, 16 KiB at a
+ * time. Instead, a miss reads from the requested block to the end of its
+ * piece in one go (the whole piece, when the first block is asked for),
+ * and the pieces we've read are kept, least recently used first out, up
+ * to a budget.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "bitclient.h"
+#include "rcache.h"
+#include "storage.h"
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+/**
+ * The caller holds the lock for all of these
+ */
+static void
+lru_unlink(rcache_t *rc, rc_piece_t *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else rc->mru = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else rc->lru = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void
+lru_push(rcache_t *rc, rc_piece_t *e)
+{
+    e->prev = NULL;
+    e->next = rc->mru;
+    if (rc->mru) rc->mru->prev = e;
+    else rc->lru = e;
+    rc->mru = e;
+}
+
+/**
+ * Drop the least recently used pieces until NEED more bytes fit
+ */
+static void
+evict(rcache_t *rc, size_t need)
+{
+    while (rc->lru != NULL && rc->used + need > rc->budget) {
+        rc_piece_t *e = rc->lru;
+        lru_unlink(rc, e);
+        rc->pieces[e->piece] = NULL;
+        rc->used -= e->size;
+        free(e->data);
+        free(e);
+    }
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Cache up to BUDGET bytes of S's pieces
+ */
+rcache_t *
+rcache_create(storage_t *s, size_t budget)
+{
+    rcache_t *rc;
+
+    if (s == NULL) return NULL;
+    if ((rc = (rcache_t*)calloc(1, sizeof(rcache_t))) == NULL ||
+        (rc->pieces = (rc_piece_t**)calloc(s->num_pieces, sizeof(rc_piece_t*))) == NULL) {
+        perror("calloc");
+        free(rc);
+        return NULL;
+    }
+    rc->s      = s;
+    rc->budget = budget;
+    pthread_mutex_init(&rc->lock, NULL);
+    return rc;
+}
+
+void
+rcache_destroy(rcache_t *rc)
+{
+    if (rc == NULL) return;
+
+    DEBUG("Read cache: %llu hits, %llu misses (%.1f%%), %llu MiB read\n",
+          (unsigned long long)rc->hits, (unsigned long long)rc->misses,
+          100 * rcache_hit_rate(rc), (unsigned long long)(rc->read >> 20));
+    rc->budget = 0;
+    evict(rc, 0);
+    pthread_mutex_destroy(&rc->lock);
+    free(rc->pieces);
+    free(rc);
+}
+
+/**
+ * Copy LEN bytes from BEGIN of PIECE, which we must have, into BUF, from
+ * memory if we can. Returns 0 on success.
+ */
+int
+rcache_read(rcache_t *rc, uint32_t piece, uint32_t begin, void *buf,
+            uint32_t len)
+{
+    storage_t  *s = rc->s;
+    rc_piece_t *e;
+    uint32_t    size, lo;
+    uint8_t    *data;
+
+    if (piece >= s->num_pieces ||
+        (uint64_t)begin + len > storage_piece_size(s, piece) ||
+        !storage_has_piece(s, piece))
+        return -1;
+
+    pthread_mutex_lock(&rc->lock);
+    if ((e = rc->pieces[piece]) != NULL && begin >= e->lo) {
+        memcpy(buf, e->data + begin, len);
+        lru_unlink(rc, e);
+        lru_push(rc, e);
+        rc->hits++;
+        pthread_mutex_unlock(&rc->lock);
+        return 0;
+    }
+    rc->misses++;
+    pthread_mutex_unlock(&rc->lock);
+
+    /* Too big to keep; just read what was asked for */
+    size = storage_piece_size(s, piece);
+    if (size > rc->budget) return storage_read_block(s, piece, begin, buf, len);
+
+    /* Read ahead to the end of the piece, without holding the lock */
+    lo = begin - begin % BLOCK_LEN;
+    if ((data = (uint8_t*)malloc(size)) == NULL) {
+        perror("malloc");
+        return storage_read_block(s, piece, begin, buf, len);
+    }
+    if (storage_read_block(s, piece, lo, data + lo, size - lo) < 0) {
+        free(data);
+        return -1;
+    }
+    memcpy(buf, data + begin, len);
+
+    pthread_mutex_lock(&rc->lock);
+    rc->read += size - lo;
+    if ((e = rc->pieces[piece]) != NULL) {
+        /* Someone else read it meanwhile; keep whichever has more */
+        if (lo < e->lo) {
+            free(e->data);
+            e->data = data;
+            e->lo   = lo;
+        } else {
+            free(data);
+        }
+        lru_unlink(rc, e);
+    } else if ((e = (rc_piece_t*)calloc(1, sizeof(rc_piece_t))) != NULL) {
+        evict(rc, size);
+        e->piece  = piece;
+        e->lo     = lo;
+        e->size   = size;
+        e->data   = data;
+        rc->used += size;
+        rc->pieces[piece] = e;
+    } else {
+        free(data);
+    }
+    if (e != NULL) lru_push(rc, e);
+    pthread_mutex_unlock(&rc->lock);
+    return 0;
+}
+
+/**
+ * The fraction of reads served from memory so far
+ */
+double
+rcache_hit_rate(rcache_t *rc)
+{
+    uint64_t hits, total;
+
+    pthread_mutex_lock(&rc->lock);
+    hits  = rc->hits;
+    total = rc->hits + rc->misses;
+    pthread_mutex_unlock(&rc->lock);
+    return total ? (double)hits / (double)total : 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * rcache.h --- Keep the pieces peers keep asking for in memory
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitclient.h"
+#include "storage.h"
+
+/* Bytes LO up to the end of one piece, in a list from most to least
+ * recently used */
+typedef struct rc_piece {
+    uint32_t         piece;
+    uint32_t         lo;
+    uint32_t         size;      /* Of the piece */
+    uint8_t         *data;      /* All SIZE bytes, of which LO on are valid */
+    struct rc_piece *prev;
+    struct rc_piece *next;
+} rc_piece_t;
+
+typedef struct rcache {
+    storage_t      *s;
+    rc_piece_t    **pieces;     /* By index, NULL if it isn't cached */
+    rc_piece_t     *mru;
+    rc_piece_t     *lru;
+    size_t          used;       /* Bytes of piece buffers */
+    size_t          budget;
+    pthread_mutex_t lock;
+    /* For whoever's curious */
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        read;       /* Bytes read from disk */
+} rcache_t;
+
+extern rcache_t *rcache_create(storage_t *s, size_t budget);
+extern void rcache_destroy(rcache_t *rc);
+extern int rcache_read(rcache_t *rc, uint32_t piece, uint32_t begin,
+                       void *buf, uint32_t len);
+extern double rcache_hit_rate(rcache_t *rc);
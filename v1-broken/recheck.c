@@ -0,0 +1,146 @@
+/*
+ * recheck.c --- Hash whatever is already in the output file
+ *
+ * The file is mapped read-only and split between THREADS workers, which
+ * claim batches of pieces in order so the disk still sees one sequential
+ * stream. The whole mapping is marked MADV_SEQUENTIAL, and each worker
+ * asks for the batch after its own with MADV_WILLNEED so the kernel reads
+ * ahead while it hashes. Good pieces go straight into the storage's have
+ * bitmap, so the leecher never asks for them.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <openssl/sha.h>
+
+#include "bitclient.h"
+#include "recheck.h"
+#include "storage.h"
+
+#define BATCH 16 /* Pieces claimed at once */
+
+typedef struct recheck_job {
+    storage_t     *s;
+    const uint8_t *map;       /* The whole file */
+    char         **hashes;    /* 20-byte SHA1 per piece, from t->pieces */
+    uint32_t       next;      /* First unclaimed piece */
+    uint32_t       checked;   /* Pieces hashed so far */
+    uint32_t       good;      /* ...and how many of them matched */
+    uintptr_t      page;      /* madvise(2) wants aligned addresses */
+} recheck_job_t;
+
+static void *
+recheck_tmain(void *raw)
+{
+    recheck_job_t *j = (recheck_job_t*)raw;
+    storage_t     *s = j->s;
+    unsigned char  digest[SHA_DIGEST_LENGTH];
+
+    for (;;) {
+        uint32_t first = __atomic_fetch_add(&j->next, BATCH, __ATOMIC_RELAXED);
+        if (first >= s->num_pieces) break;
+        uint32_t last = first + BATCH < s->num_pieces ? first + BATCH : s->num_pieces;
+
+        /* Have the kernel fetch our next batch while we hash this one */
+        uint64_t from = (uint64_t)last * s->piece_len;
+        if ((be_num_t)from < s->file_len) {
+            uint64_t  len  = (uint64_t)s->piece_len * BATCH;
+            uintptr_t want = (uintptr_t)(j->map + from);
+            uintptr_t addr = want & ~(j->page - 1);
+            if (from + len > (uint64_t)s->file_len) len = s->file_len - from;
+            madvise((void*)addr, len + (want - addr), MADV_WILLNEED);
+        }
+
+        for (uint32_t p = first; p < last; p++) {
+            const uint8_t *piece = j->map + (uint64_t)p * s->piece_len;
+            int ok = j->hashes[p] != NULL &&
+                     SHA1(piece, storage_piece_size(s, p), digest) != NULL &&
+                     !memcmp(digest, j->hashes[p], SHA_DIGEST_LENGTH);
+
+            /* A bad piece keeps whatever blocks the resume file vouched
+             * for, unless it claimed the whole piece was good */
+            if (ok || storage_has_piece(s, p)) storage_piece_checked(s, p, ok);
+            if (ok) __atomic_fetch_add(&j->good, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&j->checked, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Hash every piece of T's output file with THREADS threads, marking the
+ * good ones in T's storage. Progress goes to stderr. Returns the number of
+ * good pieces, or -1 on error.
+ */
+int
+recheck_run(torrent_t *t, int threads)
+{
+    storage_t      *s = t->storage;
+    recheck_job_t   j;
+    pthread_t      *tids = NULL;
+    struct timespec start, now;
+    int             started = 0;
+
+    if (s == NULL) {
+        FATAL("Can't recheck a file we don't know the size of\n");
+        return -1;
+    }
+
+    memset(&j, 0, sizeof(j));
+    j.s    = s;
+    j.page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    if ((j.hashes = (char**)calloc(s->num_pieces, sizeof(char*))) == NULL ||
+        (tids = (pthread_t*)calloc((size_t)threads, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        free(j.hashes);
+        return -1;
+    }
+    for (chunk_t *c = t->pieces; c != NULL; c = c->next)
+        if (c->num >= 0 && c->num < s->num_pieces) j.hashes[c->num] = c->checksum;
+
+    j.map = mmap(NULL, (size_t)s->file_len, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (j.map == MAP_FAILED) {
+        perror("mmap");
+        free(j.hashes);
+        free(tids);
+        return -1;
+    }
+    madvise((void*)j.map, (size_t)s->file_len, MADV_SEQUENTIAL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; started < threads; started++)
+        if (pthread_create(&tids[started], NULL, recheck_tmain, &j) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    if (started == 0) recheck_tmain(&j);
+
+    /* Report progress while the workers get on with it */
+    for (uint32_t done = 0; done < s->num_pieces;) {
+        usleep(250000);
+        done = __atomic_load_n(&j.checked, __ATOMIC_RELAXED);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double secs = (double)(now.tv_sec - start.tv_sec) +
+                      (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+        double mib  = (double)done * (double)s->piece_len / 1048576;
+        fprintf(stderr, "\rChecked %u/%u pieces, %u good (%.1f MiB/s)", done,
+                s->num_pieces, __atomic_load_n(&j.good, __ATOMIC_RELAXED),
+                secs > 0 ? mib / secs : 0);
+    }
+    fputc('\n', stderr);
+
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    munmap((void*)j.map, (size_t)s->file_len);
+    free(j.hashes);
+    free(tids);
+    return (int)j.good;
+}
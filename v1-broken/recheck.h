@@ -0,0 +1,9 @@
+/*
+ * recheck.h --- Find out which pieces are already on disk
+ */
+
+#pragma once
+
+#include "bitclient.h"
+
+extern int recheck_run(torrent_t *t, int threads);
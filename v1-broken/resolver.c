@@ -0,0 +1,442 @@
+/*
+ * resolver.c --- Look up host names off the event loop, and remember them
+ *
+ * getaddrinfo(3) blocks for as long as the DNS server takes, and every
+ * announce used to call it, so one slow name held up every tracker after
+ * it. Lookups now go to a few threads instead. The event loop asks with
+ * resolver_lookup(), waits for resolver_fd() to be readable and calls
+ * resolver_reap() to get its answers; code that has to block anyway, like
+ * the announce itself, calls resolver_get().
+ *
+ * Every answer is cached by name for everyone: trackers, peers and, when
+ * there's more than one, torrents, so a host a hundred torrents announce
+ * to is looked up once. Concurrent lookups of a name share one query.
+ * getaddrinfo(3) doesn't tell us the record's TTL, so answers live for
+ * RES_TTL, which is less than most trackers' TTLs, and failures are
+ * remembered for a while too, so a dead tracker doesn't cost a query per
+ * announce. Numeric addresses never leave the caller's thread.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "bitclient.h"
+#include "resolver.h"
+
+#define RES_TTL         300     /* Seconds an answer is good for */
+#define RES_NEG_TTL     60      /* And a name that doesn't exist */
+#define RES_RETRY_TTL   5       /* And a server that didn't answer */
+#define RES_MAX_ENTRIES 1024    /* Past this, expired names are swept */
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+static time_t
+now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t
+hash_host(const char *host)
+{
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a, case-insensitively */
+
+    for (; *host != '\0'; host++) {
+        h ^= (uint8_t)tolower((unsigned char)*host);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Look HOST up, with FLAGS for getaddrinfo(3), into ADDRS. Returns 0 or
+ * a getaddrinfo(3) error.
+ */
+static int
+resolve(const char *host, int flags, res_addrs_t *addrs)
+{
+    struct addrinfo hints, *res;
+    int             rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;    /* Once per address, not per type */
+    hints.ai_flags    = flags;
+    memset(addrs, 0, sizeof(*addrs));
+    if ((rv = getaddrinfo(host, NULL, &hints, &res)) != 0) return rv;
+
+    for (struct addrinfo *p = res; p != NULL && addrs->n < RES_MAX_ADDRS; p = p->ai_next) {
+        memcpy(&addrs->addr[addrs->n], p->ai_addr, p->ai_addrlen);
+        addrs->len[addrs->n++] = p->ai_addrlen;
+    }
+    freeaddrinfo(res);
+    return addrs->n > 0 ? 0 : EAI_NONAME;
+}
+
+static void
+free_entry(res_entry_t *e)
+{
+    res_waiter_t *next;
+
+    for (res_waiter_t *w = e->waiters; w != NULL; w = next) {
+        next = w->next;
+        free(w);
+    }
+    free(e->host);
+    free(e);
+}
+
+/**
+ * Forget names that have expired and that nobody's waiting on.
+ * Called with R->lock held.
+ */
+static void
+sweep(resolver_t *r, time_t now)
+{
+    for (size_t i = 0; i < r->buckets; i++) {
+        res_entry_t **pp = &r->table[i];
+        while (*pp != NULL) {
+            res_entry_t *e = *pp;
+            if (e->state == RES_DONE && e->expires <= now && e->waiters == NULL) {
+                *pp = e->hnext;
+                free_entry(e);
+                r->n--;
+            } else {
+                pp = &e->hnext;
+            }
+        }
+    }
+}
+
+/**
+ * Find HOST's entry, making one if we've never heard of it.
+ * Called with R->lock held.
+ */
+static res_entry_t *
+find(resolver_t *r, const char *host, time_t now)
+{
+    size_t       b = hash_host(host) % r->buckets;
+    res_entry_t *e;
+
+    for (e = r->table[b]; e != NULL; e = e->hnext)
+        if (!strcasecmp(e->host, host)) return e;
+
+    if (r->n >= RES_MAX_ENTRIES) sweep(r, now);
+    if ((e = (res_entry_t*)calloc(1, sizeof(res_entry_t))) == NULL ||
+        (e->host = strdup(host)) == NULL) {
+        perror("calloc");
+        free(e);
+        return NULL;
+    }
+    e->state    = RES_DONE;     /* Expired, so it's queued right away */
+    e->hnext    = r->table[b];
+    r->table[b] = e;
+    r->n++;
+    return e;
+}
+
+/**
+ * Hand E to the threads, unless they already have it.
+ * Called with R->lock held.
+ */
+static void
+enqueue(resolver_t *r, res_entry_t *e)
+{
+    if (e->state != RES_DONE) return;
+    e->state      = RES_QUEUED;
+    e->qnext      = NULL;
+    *r->queue_tail = e;
+    r->queue_tail  = &e->qnext;
+    pthread_cond_signal(&r->work);
+}
+
+static void *
+worker(void *raw)
+{
+    resolver_t *r = (resolver_t*)raw;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        res_entry_t *e;
+        res_addrs_t  addrs;
+        int          err;
+
+        while (!r->stop && r->queue == NULL)
+            pthread_cond_wait(&r->work, &r->lock);
+        if (r->stop) break;
+
+        e = r->queue;
+        if ((r->queue = e->qnext) == NULL) r->queue_tail = &r->queue;
+        e->state = RES_RESOLVING;
+
+        /* Nobody frees an entry that's being resolved */
+        pthread_mutex_unlock(&r->lock);
+        err = resolve(e->host, AI_ADDRCONFIG, &addrs);
+        pthread_mutex_lock(&r->lock);
+
+        e->addrs   = addrs;
+        e->err     = err;
+        e->state   = RES_DONE;
+        e->expires = now_secs() + (err == 0 ? RES_TTL :
+                                   err == EAI_AGAIN ? RES_RETRY_TTL : RES_NEG_TTL);
+        if (err != 0) {
+            DEBUG("Couldn't resolve %s: %s\n", e->host, gai_strerror(err));
+        }
+
+        /* Pass the answer on to whoever's waiting in the event loop */
+        if (e->waiters != NULL) {
+            res_waiter_t *w, *next;
+            for (w = e->waiters; w != NULL; w = next) {
+                next     = w->next;
+                w->addrs = addrs;
+                w->err   = err;
+                w->next  = r->ready;
+                r->ready = w;
+            }
+            e->waiters = NULL;
+            uint64_t one = 1;
+            if (write(r->efd, &one, sizeof(one)) < 0) perror("write");
+        }
+        pthread_cond_broadcast(&r->resolved);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Start THREADS threads to look names up. One is shared by everything.
+ */
+resolver_t *
+resolver_create(int threads)
+{
+    resolver_t *r;
+
+    if (threads <= 0) return NULL;
+    if ((r = (resolver_t*)calloc(1, sizeof(resolver_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    r->buckets    = 64;
+    r->queue_tail = &r->queue;
+    r->efd        = -1;
+    if ((r->table = (res_entry_t**)calloc(r->buckets, sizeof(res_entry_t*))) == NULL ||
+        (r->threads = (pthread_t*)calloc(threads, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        goto fail;
+    }
+    if ((r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        goto fail;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->work, NULL);
+    pthread_cond_init(&r->resolved, NULL);
+
+    for (; r->nthreads < threads; r->nthreads++) {
+        if (pthread_create(&r->threads[r->nthreads], NULL, worker, r) != 0) {
+            perror("pthread_create");
+            resolver_destroy(r);
+            return NULL;
+        }
+    }
+    return r;
+
+fail:
+    free(r->table);
+    free(r->threads);
+    free(r);
+    return NULL;
+}
+
+/**
+ * Stop the threads, once they've finished what they're looking up, and
+ * forget everything. Pending callbacks are never called.
+ */
+void
+resolver_destroy(resolver_t *r)
+{
+    if (r == NULL) return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->work);
+    pthread_mutex_unlock(&r->lock);
+    for (int i = 0; i < r->nthreads; i++) pthread_join(r->threads[i], NULL);
+
+    DEBUG("Resolver: %zu names, %llu hits, %llu misses\n", r->n,
+          (unsigned long long)r->hits, (unsigned long long)r->misses);
+
+    for (size_t i = 0; i < r->buckets; i++) {
+        res_entry_t *next;
+        for (res_entry_t *e = r->table[i]; e != NULL; e = next) {
+            next = e->hnext;
+            free_entry(e);
+        }
+    }
+    res_waiter_t *next;
+    for (res_waiter_t *w = r->ready; w != NULL; w = next) {
+        next = w->next;
+        free(w);
+    }
+    pthread_cond_destroy(&r->resolved);
+    pthread_cond_destroy(&r->work);
+    pthread_mutex_destroy(&r->lock);
+    close(r->efd);
+    free(r->table);
+    free(r->threads);
+    free(r);
+}
+
+/**
+ * Readable once there are answers for resolver_reap()
+ */
+int
+resolver_fd(resolver_t *r)
+{
+    return r->efd;
+}
+
+/**
+ * Look HOST up without blocking. If the answer is cached, or HOST is
+ * numeric, it's copied into OUT (if it isn't NULL) and we return 1, or -1
+ * if it's a cached failure. Otherwise returns 0, and DONE(ARG, ...) will
+ * be called from resolver_reap(); a NULL DONE just warms the cache.
+ */
+int
+resolver_lookup(resolver_t *r, const char *host, res_addrs_t *out,
+                res_done_fn done, void *arg)
+{
+    res_addrs_t  tmp;
+    res_entry_t *e;
+    time_t       now = now_secs();
+    int          rv  = 0;
+
+    if (resolve(host, AI_NUMERICHOST, &tmp) == 0) {
+        if (out != NULL) *out = tmp;
+        return 1;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if ((e = find(r, host, now)) == NULL) {
+        rv = -1;
+    } else if (e->state == RES_DONE && e->expires > now) {
+        r->hits++;
+        if (out != NULL) *out = e->addrs;
+        rv = e->err == 0 ? 1 : -1;
+    } else {
+        r->misses++;
+        enqueue(r, e);
+        if (done != NULL) {
+            res_waiter_t *w = (res_waiter_t*)calloc(1, sizeof(res_waiter_t));
+            if (w == NULL) {
+                perror("calloc");
+                rv = -1;
+            } else {
+                w->done    = done;
+                w->arg     = arg;
+                w->next    = e->waiters;
+                e->waiters = w;
+            }
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+/**
+ * Call back everyone whose lookup has finished. Returns how many.
+ */
+int
+resolver_reap(resolver_t *r)
+{
+    res_waiter_t *ready, *next;
+    uint64_t      count;
+    int           n = 0;
+
+    /* Clear the eventfd first, so an answer that lands now isn't missed */
+    if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("read");
+
+    pthread_mutex_lock(&r->lock);
+    ready    = r->ready;
+    r->ready = NULL;
+    pthread_mutex_unlock(&r->lock);
+
+    for (; ready != NULL; ready = next, n++) {
+        next = ready->next;
+        ready->done(ready->arg, &ready->addrs, ready->err);
+        free(ready);
+    }
+    return n;
+}
+
+/**
+ * Look HOST up into OUT, waiting for the answer if it isn't cached.
+ * Returns 0 or -1.
+ */
+int
+resolver_get(resolver_t *r, const char *host, res_addrs_t *out)
+{
+    res_entry_t *e;
+    time_t       now = now_secs();
+    int          err;
+
+    if (resolve(host, AI_NUMERICHOST, out) == 0) return 0;
+
+    pthread_mutex_lock(&r->lock);
+    if ((e = find(r, host, now)) == NULL) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    if (e->state == RES_DONE && e->expires > now) {
+        r->hits++;
+    } else {
+        r->misses++;
+        enqueue(r, e);
+        while (e->state != RES_DONE) pthread_cond_wait(&r->resolved, &r->lock);
+    }
+    *out = e->addrs;
+    err  = e->err;
+    pthread_mutex_unlock(&r->lock);
+
+    if (err != 0) {
+        DEBUG("No address for %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Set the port of ADDR, which came from one of the above, to PORT
+ */
+void
+resolver_port(struct sockaddr_storage *addr, uint16_t port)
+{
+    if (addr->ss_family == AF_INET)
+        ((struct sockaddr_in*)addr)->sin_port = htons(port);
+    else if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+}
@@ -0,0 +1,73 @@
+/*
+ * resolver.h --- Look up host names off the event loop, and remember them
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "bitclient.h"
+
+#define RES_MAX_ADDRS 8
+
+/* What a name resolved to. Ports are 0; see resolver_port(). */
+typedef struct res_addrs {
+    struct sockaddr_storage addr[RES_MAX_ADDRS];
+    socklen_t               len[RES_MAX_ADDRS];
+    int                     n;
+} res_addrs_t;
+
+/* ERR is 0, or a getaddrinfo(3) error for gai_strerror() */
+typedef void (*res_done_fn)(void *arg, const res_addrs_t *addrs, int err);
+
+/* Someone waiting on a lookup from the event loop */
+typedef struct res_waiter {
+    res_done_fn        done;
+    void              *arg;
+    res_addrs_t        addrs;
+    int                err;
+    struct res_waiter *next;
+} res_waiter_t;
+
+enum res_state { RES_QUEUED, RES_RESOLVING, RES_DONE };
+
+/* One name, looked up or being looked up */
+typedef struct res_entry {
+    char             *host;
+    enum res_state    state;
+    res_addrs_t       addrs;
+    int               err;
+    time_t            expires;    /* Monotonic seconds */
+    res_waiter_t     *waiters;
+    struct res_entry *hnext;      /* In its hash chain */
+    struct res_entry *qnext;      /* In the queue */
+} res_entry_t;
+
+typedef struct resolver {
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;        /* Something was queued */
+    pthread_cond_t   resolved;    /* Something finished */
+    res_entry_t    **table;
+    size_t           buckets, n;
+    res_entry_t     *queue, **queue_tail;
+    res_waiter_t    *ready;       /* For resolver_reap() */
+    int              efd;         /* Readable while READY isn't empty */
+    pthread_t       *threads;
+    int              nthreads;
+    int              stop;
+    /* For reporting */
+    uint64_t         hits, misses;
+} resolver_t;
+
+extern resolver_t *resolver_create(int threads);
+extern void resolver_destroy(resolver_t *r);
+extern int resolver_fd(resolver_t *r);
+
+extern int resolver_lookup(resolver_t *r, const char *host, res_addrs_t *out,
+                           res_done_fn done, void *arg);
+extern int resolver_reap(resolver_t *r);
+extern int resolver_get(resolver_t *r, const char *host, res_addrs_t *out);
+extern void resolver_port(struct sockaddr_storage *addr, uint16_t port);
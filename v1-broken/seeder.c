@@ -27,7 +27,12 @@ seeder_tmain(void *raw)
 
     /* Start an infinte loop listening on t->port */
     /*     Check what we've got and inform the tracker */
-    /*     If a peer requests a chunk, read it from disk and send it */
+    /*     If a peer requests a chunk, rcache_read(t->rcache, ...) it and */
+    /*     send it; popular pieces come from memory */
+    /*     Only poll for POLLOUT while rl_ready() on the peer's up bucket */
+    /*     (parented to t->up), send rl_quota() of it and rl_charge() that */
+    /*     Poll dht_fd(t->dht) too, and dht_recv(), dht_tick(), dht_flush() */
+    /*     so we keep answering other nodes and re-announce now and then */
 
     return NULL;
 }
@@ -0,0 +1,513 @@
+/*
+ * storage.c --- The output file and the bitmaps that say what's in it
+ *
+ * Pieces are big and we'll have a lot of them in flight, so a crash
+ * shouldn't cost us every piece we haven't finished. Besides a bit per
+ * verified piece, we keep a bit per 16 KiB block that has been written,
+ * and a thread checkpoints both to FILENAME.resume every few seconds. After
+ * a restart, only the blocks that never made it to disk are requested
+ * again.
+ *
+ * A checkpoint must never claim a block the disk doesn't have, so it's
+ * written in this order: snapshot the bitmaps, fdatasync(2) the output file
+ * (every block in the snapshot was written before its bit was set), write
+ * the snapshot to a temporary file, fsync(2) it, rename(2) it over the old
+ * one and fsync(2) the directory. The file is only ever the old checkpoint
+ * or the new one, and a checksum catches anything else.
+ *
+ * The resume file is in host byte order; it's a cache, not an interchange
+ * format, and one that doesn't match is simply ignored.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "bitclient.h"
+#include "storage.h"
+
+#define BIT_GET(map, i) (((map)[(i) / 8] >> (7 - (i) % 8)) & 1)
+#define BIT_SET(map, i) ((map)[(i) / 8] |= (uint8_t)(0x80 >> ((i) % 8)))
+#define BIT_CLR(map, i) ((map)[(i) / 8] &= (uint8_t)~(0x80 >> ((i) % 8)))
+
+#define RESUME_MAGIC   "BCRS"
+#define RESUME_VERSION 1
+
+struct resume_header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t piece_len;
+    uint64_t file_len;
+    uint32_t num_pieces;
+    uint32_t blocks_per_piece;
+    uint64_t torrent;   /* Hash of the info hash, so we don't mix torrents up */
+    uint64_t checksum;  /* Of the bitmaps that follow */
+};
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+/**
+ * FNV-1a; plenty to notice a torn or foreign file
+ */
+static uint64_t
+fnv1a(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int
+pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n, len -= (size_t)n, off += n;
+    }
+    return 0;
+}
+
+/**
+ * pwritev(2) until it's all written; IOV is used up on the way
+ */
+static int
+pwritev_all(int fd, struct iovec *iov, int n, off_t off)
+{
+    while (n > 0) {
+        ssize_t w = pwritev(fd, iov, n, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        off += w;
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++, n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+static int
+pread_all(int fd, void *buf, size_t len, off_t off)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n, len -= (size_t)n, off += n;
+    }
+    return 0;
+}
+
+/**
+ * Load the bitmaps from S's resume file, if there's one that matches.
+ * Anything else leaves them empty.
+ */
+static void
+resume_load(storage_t *s)
+{
+    struct resume_header h;
+    int fd;
+
+    if ((fd = open(s->resume_path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) perror(s->resume_path);
+        return;
+    }
+
+    if (pread_all(fd, &h, sizeof(h), 0) < 0 ||
+        memcmp(h.magic, RESUME_MAGIC, 4) || h.version != RESUME_VERSION ||
+        h.piece_len != (uint64_t)s->piece_len ||
+        h.file_len != (uint64_t)s->file_len ||
+        h.num_pieces != s->num_pieces ||
+        h.blocks_per_piece != s->blocks_per_piece || h.torrent != s->torrent ||
+        pread_all(fd, s->have, s->have_len, sizeof(h)) < 0 ||
+        pread_all(fd, s->blocks, s->blocks_len,
+                  (off_t)(sizeof(h) + s->have_len)) < 0 ||
+        fnv1a(fnv1a(0xcbf29ce484222325ULL, s->have, s->have_len),
+              s->blocks, s->blocks_len) != h.checksum) {
+        DEBUG("Ignoring %s, it doesn't match this torrent\n", s->resume_path);
+        memset(s->have, 0, s->have_len);
+        memset(s->blocks, 0, s->blocks_len);
+    } else {
+        uint64_t n = 0;
+        for (uint64_t i = 0; i < (uint64_t)s->num_pieces * s->blocks_per_piece; i++)
+            n += BIT_GET(s->blocks, i);
+        DEBUG("Resuming with %llu blocks from %s\n", (unsigned long long)n,
+              s->resume_path);
+    }
+    close(fd);
+}
+
+/**
+ * Checkpoint every S->interval seconds, as long as something changed
+ */
+static void *
+checkpointer_tmain(void *raw)
+{
+    storage_t *s = (storage_t*)raw;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->stopping) {
+        struct timespec when;
+        clock_gettime(CLOCK_REALTIME, &when);
+        when.tv_sec += s->interval;
+        pthread_cond_timedwait(&s->wake, &s->lock, &when);
+
+        if (s->stopping || !s->dirty) continue;
+        pthread_mutex_unlock(&s->lock);
+        storage_checkpoint(s);
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Open (or create) T's output file and load its resume bitmaps. If
+ * INTERVAL is positive, checkpoint them that often. Returns NULL if T
+ * doesn't know the file's size yet or something went wrong.
+ */
+storage_t *
+storage_open(torrent_t *t, int interval)
+{
+    storage_t  *s = NULL;
+    struct stat st;
+
+    if (t == NULL || t->filename == NULL || t->piece_len <= 0 || t->file_len <= 0)
+        return NULL;
+
+    if ((s = (storage_t*)calloc(1, sizeof(storage_t))) == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    s->piece_len        = t->piece_len;
+    s->file_len         = t->file_len;
+    s->num_pieces       = (uint32_t)((t->file_len + t->piece_len - 1) / t->piece_len);
+    s->blocks_per_piece = (uint32_t)((t->piece_len + BLOCK_LEN - 1) / BLOCK_LEN);
+    s->have_len         = (s->num_pieces + 7) / 8;
+    s->blocks_len       = ((uint64_t)s->num_pieces * s->blocks_per_piece + 7) / 8;
+    s->interval         = interval;
+
+    if ((s->have = (uint8_t*)calloc(s->have_len, 1)) == NULL ||
+        (s->blocks = (uint8_t*)calloc(s->blocks_len, 1)) == NULL ||
+        (s->resume_path = (char*)malloc(strlen(t->filename) + 8)) == NULL) {
+        perror("calloc");
+        goto fail;
+    }
+    sprintf(s->resume_path, "%s.resume", t->filename);
+
+    /* The file is sparse until the blocks arrive */
+    if ((s->fd = open(t->filename, O_RDWR | O_CREAT, 0644)) < 0) {
+        perror(t->filename);
+        goto fail;
+    }
+    if (fstat(s->fd, &st) < 0 ||
+        (st.st_size < s->file_len && ftruncate(s->fd, s->file_len) < 0)) {
+        perror(t->filename);
+        close(s->fd);
+        goto fail;
+    }
+
+    s->torrent = fnv1a(0xcbf29ce484222325ULL, t->info_hash, strlen(t->info_hash));
+    resume_load(s);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    if (interval > 0 && pthread_create(&s->thread, NULL, checkpointer_tmain, s) != 0) {
+        perror("pthread_create");
+        s->interval = 0;
+    }
+    return s;
+
+fail:
+    free(s->have);
+    free(s->blocks);
+    free(s->resume_path);
+    free(s);
+    return NULL;
+}
+
+/**
+ * Stop checkpointing, write one last checkpoint and close the file
+ */
+void
+storage_close(storage_t *s)
+{
+    if (s == NULL) return;
+
+    if (s->interval > 0) {
+        pthread_mutex_lock(&s->lock);
+        s->stopping = 1;
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+    }
+    if (s->dirty) storage_checkpoint(s);
+
+    close(s->fd);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    free(s->have);
+    free(s->blocks);
+    free(s->resume_path);
+    free(s);
+}
+
+/**
+ * Bytes in PIECE; only the last one may be short
+ */
+uint32_t
+storage_piece_size(storage_t *s, uint32_t piece)
+{
+    if (piece + 1 < s->num_pieces) return (uint32_t)s->piece_len;
+    return (uint32_t)(s->file_len - (be_num_t)piece * s->piece_len);
+}
+
+uint32_t
+storage_num_blocks(storage_t *s, uint32_t piece)
+{
+    return (storage_piece_size(s, piece) + BLOCK_LEN - 1) / BLOCK_LEN;
+}
+
+/**
+ * Write a block that arrived in a PIECE message and remember that we have
+ * it. BEGIN must be on a block boundary. Returns 0 on success.
+ */
+int
+storage_write_block(storage_t *s, uint32_t piece, uint32_t begin,
+                    const void *buf, uint32_t len)
+{
+    struct iovec iov = { (void*)buf, len };
+    return storage_write_blocks(s, piece, begin, &iov, 1);
+}
+
+/**
+ * The same for a run of N consecutive blocks starting at BEGIN, in one
+ * pwritev(2). IOV is used up. Returns 0 on success.
+ */
+int
+storage_write_blocks(storage_t *s, uint32_t piece, uint32_t begin,
+                     struct iovec *iov, int n)
+{
+    uint64_t len = 0;
+
+    for (int i = 0; i < n; i++) len += iov[i].iov_len;
+    if (piece >= s->num_pieces || begin % BLOCK_LEN != 0 ||
+        begin + len > storage_piece_size(s, piece)) {
+        FATAL("Block %u+%llu of piece %u is out of bounds\n", begin,
+              (unsigned long long)len, piece);
+        return -1;
+    }
+
+    if (pwritev_all(s->fd, iov, n, (off_t)piece * s->piece_len + begin) < 0) {
+        perror("pwritev");
+        return -1;
+    }
+    storage_mark_blocks(s, piece, begin, len);
+    return 0;
+}
+
+/**
+ * Remember that the LEN bytes from BEGIN of PIECE have been written, by us
+ * or by someone doing I/O on S->fd for us
+ */
+void
+storage_mark_blocks(storage_t *s, uint32_t piece, uint32_t begin, uint64_t len)
+{
+    if (piece >= s->num_pieces || begin % BLOCK_LEN != 0) return;
+
+    /* Only a whole block counts; a short one is still missing */
+    if (begin + len != storage_piece_size(s, piece)) len -= len % BLOCK_LEN;
+    else len += BLOCK_LEN - 1;
+    pthread_mutex_lock(&s->lock);
+    for (uint32_t b = begin / BLOCK_LEN; b < (begin + len) / BLOCK_LEN; b++)
+        BIT_SET(s->blocks, (uint64_t)piece * s->blocks_per_piece + b);
+    s->dirty = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+int
+storage_read_block(storage_t *s, uint32_t piece, uint32_t begin, void *buf,
+                   uint32_t len)
+{
+    if (piece >= s->num_pieces ||
+        (uint64_t)begin + len > storage_piece_size(s, piece))
+        return -1;
+
+    if (pread_all(s->fd, buf, len, (off_t)piece * s->piece_len + begin) < 0) {
+        perror("pread");
+        return -1;
+    }
+    return 0;
+}
+
+int
+storage_has_piece(storage_t *s, uint32_t piece)
+{
+    int has;
+    pthread_mutex_lock(&s->lock);
+    has = piece < s->num_pieces && BIT_GET(s->have, piece);
+    pthread_mutex_unlock(&s->lock);
+    return has;
+}
+
+int
+storage_has_block(storage_t *s, uint32_t piece, uint32_t block)
+{
+    int has;
+    pthread_mutex_lock(&s->lock);
+    has = piece < s->num_pieces && block < s->blocks_per_piece &&
+          BIT_GET(s->blocks, (uint64_t)piece * s->blocks_per_piece + block);
+    pthread_mutex_unlock(&s->lock);
+    return has;
+}
+
+/**
+ * Return the first block of PIECE we still need to request, or -1 if
+ * they've all been written
+ */
+int
+storage_next_missing(storage_t *s, uint32_t piece)
+{
+    int      missing = -1;
+    uint32_t n       = storage_num_blocks(s, piece);
+    uint64_t base    = (uint64_t)piece * s->blocks_per_piece;
+
+    pthread_mutex_lock(&s->lock);
+    for (uint32_t b = 0; b < n; b++) {
+        if (!BIT_GET(s->blocks, base + b)) {
+            missing = (int)b;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return missing;
+}
+
+/**
+ * Record the result of hashing PIECE. A bad piece loses its blocks too,
+ * so they're requested again.
+ */
+void
+storage_piece_checked(storage_t *s, uint32_t piece, int ok)
+{
+    uint64_t base = (uint64_t)piece * s->blocks_per_piece;
+
+    if (piece >= s->num_pieces) return;
+    pthread_mutex_lock(&s->lock);
+    if (ok) {
+        BIT_SET(s->have, piece);
+        for (uint32_t b = 0; b < storage_num_blocks(s, piece); b++)
+            BIT_SET(s->blocks, base + b);
+    } else {
+        BIT_CLR(s->have, piece);
+        for (uint32_t b = 0; b < s->blocks_per_piece; b++)
+            BIT_CLR(s->blocks, base + b);
+    }
+    s->dirty = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Write the bitmaps out, crash-safely (see the top of this file). Returns 0
+ * on success.
+ */
+int
+storage_checkpoint(storage_t *s)
+{
+    struct resume_header h;
+    uint8_t *snap;
+    char    *tmp = NULL, *dir = NULL;
+    int      fd = -1, dfd = -1, ret = -1;
+
+    if ((snap = (uint8_t*)malloc(s->have_len + s->blocks_len)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutex_lock(&s->lock);
+    memcpy(snap, s->have, s->have_len);
+    memcpy(snap + s->have_len, s->blocks, s->blocks_len);
+    s->dirty = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RESUME_MAGIC, 4);
+    h.version          = RESUME_VERSION;
+    h.piece_len        = (uint64_t)s->piece_len;
+    h.file_len         = (uint64_t)s->file_len;
+    h.num_pieces       = s->num_pieces;
+    h.blocks_per_piece = s->blocks_per_piece;
+    h.checksum         = fnv1a(0xcbf29ce484222325ULL, snap,
+                               s->have_len + s->blocks_len);
+    h.torrent          = s->torrent;
+
+    if ((tmp = (char*)malloc(strlen(s->resume_path) + 5)) == NULL ||
+        (dir = strdup(s->resume_path)) == NULL) {
+        perror("malloc");
+        goto out;
+    }
+    sprintf(tmp, "%s.tmp", s->resume_path);
+
+    if (fdatasync(s->fd) < 0) {
+        perror("fdatasync");
+        goto out;
+    }
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        pwrite_all(fd, &h, sizeof(h), 0) < 0 ||
+        pwrite_all(fd, snap, s->have_len + s->blocks_len, sizeof(h)) < 0 ||
+        fsync(fd) < 0) {
+        perror(tmp);
+        goto out;
+    }
+    if (rename(tmp, s->resume_path) < 0) {
+        perror("rename");
+        goto out;
+    }
+    if ((dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0 || fsync(dfd) < 0) {
+        perror("fsync");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        pthread_mutex_lock(&s->lock);
+        s->dirty = 1; /* Try again next time */
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (fd >= 0) close(fd);
+    if (dfd >= 0) close(dfd);
+    free(snap);
+    free(tmp);
+    free(dir);
+    return ret;
+}
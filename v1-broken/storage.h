@@ -0,0 +1,57 @@
+/*
+ * storage.h --- Keep track of which blocks of the file we have on disk
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "bitclient.h"
+
+#define BLOCK_LEN 16384 /* Bytes per REQUEST; what every client uses */
+
+typedef struct storage {
+    int        fd;               /* The output file */
+    char      *resume_path;      /* Where the bitmaps are checkpointed */
+    uint64_t   torrent;          /* Tells our resume file from another's */
+    be_num_t   piece_len;        /* Same as in the torrent */
+    be_num_t   file_len;         /* Ditto */
+    uint32_t   num_pieces;
+    uint32_t   blocks_per_piece; /* Of a full-sized piece */
+    uint8_t   *have;             /* One bit per verified piece */
+    uint8_t   *blocks;           /* blocks_per_piece bits per piece */
+    size_t     have_len;         /* Bytes in each of those */
+    size_t     blocks_len;
+    int        dirty;            /* Bitmaps changed since the last checkpoint */
+    /* The checkpointer thread */
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_t       thread;
+    int             interval;    /* Seconds between checkpoints */
+    int             stopping;
+} storage_t;
+
+extern storage_t *storage_open(torrent_t *t, int interval);
+extern void storage_close(storage_t *s);
+
+extern uint32_t storage_piece_size(storage_t *s, uint32_t piece);
+extern uint32_t storage_num_blocks(storage_t *s, uint32_t piece);
+
+extern int storage_write_block(storage_t *s, uint32_t piece, uint32_t begin,
+                               const void *buf, uint32_t len);
+extern int storage_write_blocks(storage_t *s, uint32_t piece, uint32_t begin,
+                                struct iovec *iov, int n);
+extern void storage_mark_blocks(storage_t *s, uint32_t piece, uint32_t begin,
+                                uint64_t len);
+extern int storage_read_block(storage_t *s, uint32_t piece, uint32_t begin,
+                              void *buf, uint32_t len);
+
+extern int storage_has_piece(storage_t *s, uint32_t piece);
+extern int storage_has_block(storage_t *s, uint32_t piece, uint32_t block);
+extern int storage_next_missing(storage_t *s, uint32_t piece);
+extern void storage_piece_checked(storage_t *s, uint32_t piece, int ok);
+
+extern int storage_checkpoint(storage_t *s);
@@ -0,0 +1,306 @@
+/*
+ * wcache.c --- Hold blocks until their piece is verified, then write it
+ *
+ * Blocks arrive from many peers in no particular order, and writing each
+ * as it comes is a 16 KiB random write; on a spinning disk that's all the
+ * seeks we can afford and then some. So blocks are held, by reference,
+ * until their piece is complete. The piece is then hashed where it sits
+ * and, if it's good, written with a single pwritev(2) (or one per
+ * contiguous run, if some of it had to go to disk early). A bad piece is
+ * simply dropped, without ever having touched the disk.
+ *
+ * At most LIMIT blocks are held. Past that, the oldest piece is written
+ * out as it is, in runs, to make room: it's the one that's waited longest
+ * for its last blocks, so probably the one stuck on a slow peer. Its blocks
+ * are marked in the storage like any other, and it's hashed with what's
+ * on disk once it completes.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+#include <openssl/evp.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "storage.h"
+#include "wcache.h"
+
+
+
+/************* S M A L L   H E L P E R   F U N C T I O N S *************/
+
+
+
+/**
+ * Take P out of the table and the list. The caller holds the lock.
+ */
+static void
+piece_detach(wcache_t *wc, wc_piece_t *p)
+{
+    if (p->prev) p->prev->next = p->next;
+    else wc->oldest = p->next;
+    if (p->next) p->next->prev = p->prev;
+    else wc->newest = p->prev;
+    p->prev = p->next = NULL;
+
+    wc->pieces[p->piece] = NULL;
+    wc->held -= p->held;
+}
+
+/**
+ * Whether every block of P is held or already written
+ */
+static int
+piece_complete(wcache_t *wc, wc_piece_t *p)
+{
+    for (uint32_t j = 0; j < p->nblocks; j++)
+        if (p->blocks[j] == NULL && !storage_has_block(wc->s, p->piece, j))
+            return 0;
+    return 1;
+}
+
+static void
+piece_free(wc_piece_t *p)
+{
+    for (uint32_t i = 0; i < p->nblocks; i++) block_unref(p->blocks[i]);
+    free(p);
+}
+
+/**
+ * Write whatever P holds, one pwritev(2) per run of up to WC_RUN blocks
+ */
+static int
+piece_flush(wcache_t *wc, wc_piece_t *p)
+{
+    struct iovec iov[WC_RUN];
+    int          n = 0, ret = 0;
+    uint32_t     start = 0;
+
+    for (uint32_t i = 0; i <= p->nblocks; i++) {
+        block_t *b = i < p->nblocks ? p->blocks[i] : NULL;
+
+        if (b != NULL) {
+            if (n == 0) start = i;
+            iov[n].iov_base = b->data;
+            iov[n].iov_len  = b->len;
+            n++;
+        }
+        if (n > 0 && (b == NULL || n == WC_RUN)) {
+            if (storage_write_blocks(wc->s, p->piece, start * BLOCK_LEN, iov, n) < 0)
+                ret = -1;
+            __atomic_add_fetch(&wc->writes, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&wc->written, (uint64_t)n, __ATOMIC_RELAXED);
+            n = 0;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Hash the complete piece P from its blocks, and from the disk for any it
+ * doesn't hold, then write it if it's good. Returns an enum wc_result.
+ */
+static int
+piece_verify(wcache_t *wc, wc_piece_t *p)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    uint8_t       buf[BLOCK_LEN];
+    EVP_MD_CTX   *ctx;
+    int           ok;
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL ||
+        !EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)) {
+        FATAL("Can't hash piece %u\n", p->piece);
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    ok = wc->hashes[p->piece] != NULL;
+    for (uint32_t i = 0; ok && i < p->nblocks; i++) {
+        uint32_t len = storage_piece_size(wc->s, p->piece) - i * BLOCK_LEN;
+        if (len > BLOCK_LEN) len = BLOCK_LEN;
+
+        if (p->blocks[i] != NULL)
+            ok = EVP_DigestUpdate(ctx, p->blocks[i]->data, len);
+        else
+            ok = storage_read_block(wc->s, p->piece, i * BLOCK_LEN, buf, len) == 0 &&
+                 EVP_DigestUpdate(ctx, buf, len);
+    }
+    ok = ok && EVP_DigestFinal_ex(ctx, digest, NULL) &&
+         !memcmp(digest, wc->hashes[p->piece], 20);
+    EVP_MD_CTX_free(ctx);
+
+    if (!ok) {
+        DEBUG("Piece %u failed its hash, dropping it\n", p->piece);
+        __atomic_add_fetch(&wc->corrupt, 1, __ATOMIC_RELAXED);
+        storage_piece_checked(wc->s, p->piece, 0);
+        return WC_CORRUPT;
+    }
+    if (piece_flush(wc, p) < 0) return -1;
+    storage_piece_checked(wc->s, p->piece, 1);
+    return WC_VERIFIED;
+}
+
+
+
+/***************** M A I N   A P I   F U N C T I O N S *****************/
+
+
+
+/**
+ * Cache up to LIMIT blocks in front of T's storage
+ */
+wcache_t *
+wcache_create(torrent_t *t, size_t limit)
+{
+    wcache_t *wc;
+
+    if (t == NULL || t->storage == NULL) return NULL;
+    if ((wc = (wcache_t*)calloc(1, sizeof(wcache_t))) == NULL ||
+        (wc->pieces = (wc_piece_t**)calloc(t->storage->num_pieces,
+                                           sizeof(wc_piece_t*))) == NULL ||
+        (wc->hashes = (char**)calloc(t->storage->num_pieces,
+                                     sizeof(char*))) == NULL) {
+        perror("calloc");
+        if (wc != NULL) free(wc->pieces);
+        free(wc);
+        return NULL;
+    }
+    for (chunk_t *c = t->pieces; c != NULL; c = c->next)
+        if (c->num >= 0 && c->num < t->storage->num_pieces)
+            wc->hashes[c->num] = c->checksum;
+
+    wc->s     = t->storage;
+    wc->limit = limit > 0 ? limit : 1;
+    pthread_mutex_init(&wc->lock, NULL);
+    return wc;
+}
+
+/**
+ * Write out everything that's held, verified or not, so a restart doesn't
+ * have to fetch it again
+ */
+void
+wcache_destroy(wcache_t *wc)
+{
+    if (wc == NULL) return;
+
+    while (wc->oldest != NULL) {
+        wc_piece_t *p = wc->oldest;
+        piece_detach(wc, p);
+        piece_flush(wc, p);
+        piece_free(p);
+    }
+    DEBUG("Write cache: %llu writes of %llu blocks, %llu pieces evicted, "
+          "%llu corrupt\n", (unsigned long long)wc->writes,
+          (unsigned long long)wc->written, (unsigned long long)wc->evicted,
+          (unsigned long long)wc->corrupt);
+
+    pthread_mutex_destroy(&wc->lock);
+    free(wc->pieces);
+    free(wc->hashes);
+    free(wc);
+}
+
+/**
+ * Hand block B, with its piece, begin and len filled in, to the cache,
+ * which takes over the caller's reference. Returns an enum wc_result, or
+ * -1 if B doesn't belong to the torrent or can't be written.
+ */
+int
+wcache_put(wcache_t *wc, block_t *b)
+{
+    storage_t  *s = wc->s;
+    wc_piece_t *p, *victims = NULL, *done = NULL;
+    uint32_t    i = b->begin / BLOCK_LEN;
+    int         ret = WC_HELD;
+
+    if (b->piece >= s->num_pieces || b->begin % BLOCK_LEN != 0 ||
+        i >= storage_num_blocks(s, b->piece) ||
+        b->len != (i + 1 < storage_num_blocks(s, b->piece)
+                   ? BLOCK_LEN : storage_piece_size(s, b->piece) - b->begin)) {
+        FATAL("Block %u+%u of piece %u doesn't fit\n", b->begin, b->len, b->piece);
+        block_unref(b);
+        return -1;
+    }
+    if (storage_has_piece(s, b->piece)) {
+        block_unref(b);
+        return WC_HELD;
+    }
+
+    pthread_mutex_lock(&wc->lock);
+    if ((p = wc->pieces[b->piece]) == NULL) {
+        uint32_t n = storage_num_blocks(s, b->piece);
+        if ((p = (wc_piece_t*)calloc(1, sizeof(wc_piece_t) + n * sizeof(block_t*))) == NULL) {
+            pthread_mutex_unlock(&wc->lock);
+            perror("calloc");
+            block_unref(b);
+            return -1;
+        }
+        p->piece   = b->piece;
+        p->nblocks = n;
+        p->prev    = wc->newest;
+        if (wc->newest) wc->newest->next = p;
+        else wc->oldest = p;
+        wc->newest = p;
+        wc->pieces[b->piece] = p;
+    }
+
+    /* A block we already hold is just a duplicate */
+    if (p->blocks[i] != NULL) {
+        block_unref(p->blocks[i]);
+    } else {
+        p->held++;
+        wc->held++;
+    }
+    p->blocks[i] = b;
+
+    /* Complete, counting what's already been written out */
+    if (piece_complete(wc, p)) {
+        piece_detach(wc, p);
+        done = p;
+    }
+
+    /* Make room */
+    while (wc->held > wc->limit && wc->oldest != NULL) {
+        wc_piece_t *v = wc->oldest;
+        piece_detach(wc, v);
+        v->next = victims;
+        victims = v;
+    }
+    pthread_mutex_unlock(&wc->lock);
+
+    while (victims != NULL) {
+        wc_piece_t *v = victims;
+        uint32_t    piece = v->piece;
+        victims = v->next;
+        __atomic_add_fetch(&wc->evicted, 1, __ATOMIC_RELAXED);
+        if (piece_flush(wc, v) < 0) ret = -1;
+        piece_free(v);
+
+        /* Its last blocks may have arrived while that was being written */
+        pthread_mutex_lock(&wc->lock);
+        if ((v = wc->pieces[piece]) != NULL && v != done && piece_complete(wc, v))
+            piece_detach(wc, v);
+        else
+            v = NULL;
+        pthread_mutex_unlock(&wc->lock);
+        if (v != NULL) {
+            if (piece_verify(wc, v) < 0) ret = -1;
+            piece_free(v);
+        }
+    }
+    if (done != NULL) {
+        int r = piece_verify(wc, done);
+        if (ret == WC_HELD) ret = r;
+        piece_free(done);
+    }
+    return ret;
+}
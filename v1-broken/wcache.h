@@ -0,0 +1,51 @@
+/*
+ * wcache.h --- Hold blocks until their piece is verified, then write it
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitclient.h"
+#include "blockpool.h"
+#include "storage.h"
+
+#define WC_RUN 64   /* Most blocks written by one pwritev(2) */
+
+enum wc_result {
+    WC_HELD     = 0,   /* Cached until the rest of the piece arrives */
+    WC_VERIFIED = 1,   /* Completed the piece, which was good and written */
+    WC_CORRUPT  = 2,   /* Completed the piece, which was bad and dropped */
+};
+
+/* The blocks of one piece we're holding, in a list from oldest to newest */
+typedef struct wc_piece {
+    uint32_t         piece;
+    uint32_t         nblocks;
+    uint32_t         held;
+    struct wc_piece *prev;
+    struct wc_piece *next;
+    block_t         *blocks[];
+} wc_piece_t;
+
+typedef struct wcache {
+    storage_t      *s;
+    char          **hashes;     /* 20-byte SHA1 per piece, from t->pieces */
+    wc_piece_t    **pieces;     /* By index, NULL if nothing's held */
+    wc_piece_t     *oldest;
+    wc_piece_t     *newest;
+    size_t          held;       /* Blocks in the cache */
+    size_t          limit;      /* ...before the oldest piece is written out */
+    pthread_mutex_t lock;
+    /* For whoever's curious */
+    uint64_t        writes;     /* pwritev(2) calls */
+    uint64_t        written;    /* Blocks they wrote */
+    uint64_t        evicted;    /* Pieces written before they were verified */
+    uint64_t        corrupt;    /* Pieces that failed the hash */
+} wcache_t;
+
+extern wcache_t *wcache_create(torrent_t *t, size_t limit);
+extern void wcache_destroy(wcache_t *wc);
+extern int wcache_put(wcache_t *wc, block_t *b);
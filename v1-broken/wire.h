@@ -0,0 +1,448 @@
+/*
+ * wire.h --- Byte layouts of the tracker and peer messages
+ *
+ * Every message is described once, as the offset of each of its fields,
+ * and the offsets are checked against each other at compile time. The
+ * encoders write into a buffer the caller provides (usually on the stack)
+ * with one big-endian store per field, so once inlined they're a handful of
+ * mov and bswap instructions. The decoders check the length before they
+ * read anything and return -1 if the message is short or isn't the one we
+ * asked for.
+ *
+ * UDP tracker messages are from BEP 15, peer messages from BEP 3:
+ * www.bittorrent.org/beps/bep_0015.html
+ * www.bittorrent.org/beps/bep_0003.html
+ */
+
+#pragma once
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "peerwire.h"
+
+#define WIRE_UDP_MAGIC 0x41727101980ULL  /* protocol_id of a connect */
+
+enum wire_udp_action {
+    WIRE_CONNECT  = 0,
+    WIRE_ANNOUNCE = 1,
+    WIRE_SCRAPE   = 2,
+    WIRE_ERROR    = 3,
+};
+
+enum wire_udp_event {
+    WIRE_NONE      = 0,
+    WIRE_COMPLETED = 1,
+    WIRE_STARTED   = 2,
+    WIRE_STOPPED   = 3,
+};
+
+
+
+/******************* B I G   E N D I A N   F I E L D S *******************/
+
+
+
+static inline void
+wire_put8(uint8_t *p, uint8_t n)
+{
+    *p = n;
+}
+
+static inline void
+wire_put16(uint8_t *p, uint16_t n)
+{
+    n = htobe16(n);
+    memcpy(p, &n, sizeof(n));
+}
+
+static inline void
+wire_put32(uint8_t *p, uint32_t n)
+{
+    n = htobe32(n);
+    memcpy(p, &n, sizeof(n));
+}
+
+static inline void
+wire_put64(uint8_t *p, uint64_t n)
+{
+    n = htobe64(n);
+    memcpy(p, &n, sizeof(n));
+}
+
+static inline uint16_t
+wire_get16(const uint8_t *p)
+{
+    uint16_t n;
+    memcpy(&n, p, sizeof(n));
+    return be16toh(n);
+}
+
+static inline uint32_t
+wire_get32(const uint8_t *p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return be32toh(n);
+}
+
+static inline uint64_t
+wire_get64(const uint8_t *p)
+{
+    uint64_t n;
+    memcpy(&n, p, sizeof(n));
+    return be64toh(n);
+}
+
+
+
+/*************** U D P   T R A C K E R   M E S S A G E S ***************/
+
+
+
+/* connect request and response */
+enum {
+    WIRE_CONN_PROTOCOL = 0,
+    WIRE_CONN_ACTION   = 8,
+    WIRE_CONN_TRANS    = 12,
+    WIRE_CONN_LEN      = 16,
+};
+enum {
+    WIRE_CONNR_ACTION  = 0,
+    WIRE_CONNR_TRANS   = 4,
+    WIRE_CONNR_CONN_ID = 8,
+    WIRE_CONNR_LEN     = 16,
+};
+
+/* announce request, and the response's header and peers */
+enum {
+    WIRE_ANN_CONN_ID   = 0,
+    WIRE_ANN_ACTION    = 8,
+    WIRE_ANN_TRANS     = 12,
+    WIRE_ANN_INFO_HASH = 16,
+    WIRE_ANN_PEER_ID   = 36,
+    WIRE_ANN_DLOADED   = 56,
+    WIRE_ANN_LEFT      = 64,
+    WIRE_ANN_UPLOADED  = 72,
+    WIRE_ANN_EVENT     = 80,
+    WIRE_ANN_IP        = 84,
+    WIRE_ANN_KEY       = 88,
+    WIRE_ANN_NUM_WANT  = 92,
+    WIRE_ANN_PORT      = 96,
+    WIRE_ANN_LEN       = 98,
+};
+enum {
+    WIRE_ANNR_ACTION   = 0,
+    WIRE_ANNR_TRANS    = 4,
+    WIRE_ANNR_INTERVAL = 8,
+    WIRE_ANNR_LEECHERS = 12,
+    WIRE_ANNR_SEEDERS  = 16,
+    WIRE_ANNR_PEERS    = 20,
+    WIRE_ANNR_PEER_LEN = 6,      /* IPv4 address and port */
+};
+
+/* scrape request and response; one hash or one triple per torrent */
+enum {
+    WIRE_SCR_CONN_ID   = 0,
+    WIRE_SCR_ACTION    = 8,
+    WIRE_SCR_TRANS     = 12,
+    WIRE_SCR_HASHES    = 16,
+    WIRE_SCR_MAX       = 72,     /* Hashes that fit in one packet */
+};
+enum {
+    WIRE_SCRR_ACTION   = 0,
+    WIRE_SCRR_TRANS    = 4,
+    WIRE_SCRR_STATS    = 8,
+    WIRE_SCRR_STAT_LEN = 12,     /* seeders, completed, leechers */
+};
+
+_Static_assert(WIRE_CONN_TRANS + 4 == WIRE_CONN_LEN, "connect layout");
+_Static_assert(WIRE_CONNR_CONN_ID + 8 == WIRE_CONNR_LEN, "connect response layout");
+_Static_assert(WIRE_ANN_PEER_ID == WIRE_ANN_INFO_HASH + 20 &&
+               WIRE_ANN_DLOADED == WIRE_ANN_PEER_ID + 20 &&
+               WIRE_ANN_EVENT == WIRE_ANN_UPLOADED + 8 &&
+               WIRE_ANN_PORT + 2 == WIRE_ANN_LEN, "announce layout");
+_Static_assert(WIRE_ANNR_PEERS == WIRE_ANNR_SEEDERS + 4, "announce response layout");
+_Static_assert(WIRE_SCR_HASHES + 20 * WIRE_SCR_MAX <= 1500 - 28, "scrape fits a packet");
+
+typedef struct wire_announce {
+    uint64_t       conn_id;
+    uint32_t       trans_id;
+    const uint8_t *info_hash;    /* 20 bytes */
+    const uint8_t *peer_id;      /* 20 bytes */
+    uint64_t       dloaded;
+    uint64_t       left;
+    uint64_t       uploaded;
+    uint32_t       event;        /* enum wire_udp_event */
+    uint32_t       key;
+    int32_t        num_want;     /* -1 lets the tracker decide */
+    uint16_t       port;
+} wire_announce_t;
+
+/**
+ * Encoders return the bytes written to BUF, which must have room for them
+ */
+static inline size_t
+wire_udp_connect(uint8_t *buf, uint32_t trans_id)
+{
+    wire_put64(buf + WIRE_CONN_PROTOCOL, WIRE_UDP_MAGIC);
+    wire_put32(buf + WIRE_CONN_ACTION, WIRE_CONNECT);
+    wire_put32(buf + WIRE_CONN_TRANS, trans_id);
+    return WIRE_CONN_LEN;
+}
+
+static inline size_t
+wire_udp_announce(uint8_t *buf, const wire_announce_t *a)
+{
+    wire_put64(buf + WIRE_ANN_CONN_ID, a->conn_id);
+    wire_put32(buf + WIRE_ANN_ACTION, WIRE_ANNOUNCE);
+    wire_put32(buf + WIRE_ANN_TRANS, a->trans_id);
+    memcpy(buf + WIRE_ANN_INFO_HASH, a->info_hash, 20);
+    memcpy(buf + WIRE_ANN_PEER_ID, a->peer_id, 20);
+    wire_put64(buf + WIRE_ANN_DLOADED, a->dloaded);
+    wire_put64(buf + WIRE_ANN_LEFT, a->left);
+    wire_put64(buf + WIRE_ANN_UPLOADED, a->uploaded);
+    wire_put32(buf + WIRE_ANN_EVENT, a->event);
+    wire_put32(buf + WIRE_ANN_IP, 0);
+    wire_put32(buf + WIRE_ANN_KEY, a->key);
+    wire_put32(buf + WIRE_ANN_NUM_WANT, (uint32_t)a->num_want);
+    wire_put16(buf + WIRE_ANN_PORT, a->port);
+    return WIRE_ANN_LEN;
+}
+
+/**
+ * N is at most WIRE_SCR_MAX
+ */
+static inline size_t
+wire_udp_scrape(uint8_t *buf, uint64_t conn_id, uint32_t trans_id,
+                const uint8_t (*hashes)[20], size_t n)
+{
+    wire_put64(buf + WIRE_SCR_CONN_ID, conn_id);
+    wire_put32(buf + WIRE_SCR_ACTION, WIRE_SCRAPE);
+    wire_put32(buf + WIRE_SCR_TRANS, trans_id);
+    memcpy(buf + WIRE_SCR_HASHES, hashes, 20 * n);
+    return WIRE_SCR_HASHES + 20 * n;
+}
+
+/**
+ * Check the action and transaction id every response starts with
+ */
+static inline int
+wire_udp_check(const uint8_t *buf, size_t len, size_t min, uint32_t action,
+               uint32_t trans_id)
+{
+    if (len < min || len < 8) return -1;
+    if (wire_get32(buf + 4) != trans_id) return -1;
+    return wire_get32(buf) == action ? 0 : -1;
+}
+
+static inline int
+wire_udp_connected(const uint8_t *buf, size_t len, uint32_t trans_id,
+                   uint64_t *conn_id)
+{
+    if (wire_udp_check(buf, len, WIRE_CONNR_LEN, WIRE_CONNECT, trans_id) < 0)
+        return -1;
+    *conn_id = wire_get64(buf + WIRE_CONNR_CONN_ID);
+    return 0;
+}
+
+/**
+ * Returns the number of peers in an announce response, which
+ * wire_udp_peer() reads one at a time, or -1
+ */
+static inline int
+wire_udp_announced(const uint8_t *buf, size_t len, uint32_t trans_id,
+                   uint32_t *interval)
+{
+    if (wire_udp_check(buf, len, WIRE_ANNR_PEERS, WIRE_ANNOUNCE, trans_id) < 0)
+        return -1;
+    *interval = wire_get32(buf + WIRE_ANNR_INTERVAL);
+    return (int)((len - WIRE_ANNR_PEERS) / WIRE_ANNR_PEER_LEN);
+}
+
+static inline void
+wire_udp_peer(const uint8_t *buf, int i, uint8_t ip[4], uint16_t *port)
+{
+    const uint8_t *p = buf + WIRE_ANNR_PEERS + (size_t)i * WIRE_ANNR_PEER_LEN;
+    memcpy(ip, p, 4);
+    *port = wire_get16(p + 4);
+}
+
+/**
+ * Returns the number of torrents in a scrape response, or -1
+ */
+static inline int
+wire_udp_scraped(const uint8_t *buf, size_t len, uint32_t trans_id)
+{
+    if (wire_udp_check(buf, len, WIRE_SCRR_STATS, WIRE_SCRAPE, trans_id) < 0)
+        return -1;
+    return (int)((len - WIRE_SCRR_STATS) / WIRE_SCRR_STAT_LEN);
+}
+
+static inline void
+wire_udp_stat(const uint8_t *buf, int i, uint32_t *seeders,
+              uint32_t *completed, uint32_t *leechers)
+{
+    const uint8_t *p = buf + WIRE_SCRR_STATS + (size_t)i * WIRE_SCRR_STAT_LEN;
+    *seeders   = wire_get32(p);
+    *completed = wire_get32(p + 4);
+    *leechers  = wire_get32(p + 8);
+}
+
+
+
+/********************** P E E R   M E S S A G E S **********************/
+
+
+
+/* Every message after the handshake is a length, an id and the payload */
+enum {
+    WIRE_MSG_LEN       = 0,
+    WIRE_MSG_ID        = 4,
+    WIRE_MSG_PAYLOAD   = 5,
+};
+enum {
+    WIRE_HS_PSTRLEN    = 0,
+    WIRE_HS_PSTR       = 1,
+    WIRE_HS_RESERVED   = 20,
+    WIRE_HS_INFO_HASH  = 28,
+    WIRE_HS_PEER_ID    = 48,
+    WIRE_HS_LEN        = 68,
+};
+enum {
+    WIRE_HAVE_LEN      = WIRE_MSG_PAYLOAD + 4,
+    WIRE_REQUEST_LEN   = WIRE_MSG_PAYLOAD + 12,   /* Also CANCEL */
+    WIRE_PIECE_HDR_LEN = WIRE_MSG_PAYLOAD + 8,    /* Then the block */
+    WIRE_PORT_LEN      = WIRE_MSG_PAYLOAD + 2,
+};
+
+_Static_assert(WIRE_HS_PEER_ID + 20 == WIRE_HS_LEN, "handshake layout");
+_Static_assert(WIRE_HS_LEN == PW_HANDSHAKE_LEN, "peerwire agrees");
+
+static inline size_t
+wire_handshake(uint8_t *buf, const uint8_t *info_hash, const uint8_t *peer_id)
+{
+    wire_put8(buf + WIRE_HS_PSTRLEN, 19);
+    memcpy(buf + WIRE_HS_PSTR, "BitTorrent protocol", 19);
+    memset(buf + WIRE_HS_RESERVED, 0, 8);
+    memcpy(buf + WIRE_HS_INFO_HASH, info_hash, 20);
+    memcpy(buf + WIRE_HS_PEER_ID, peer_id, 20);
+    return WIRE_HS_LEN;
+}
+
+static inline size_t
+wire_keepalive(uint8_t *buf)
+{
+    wire_put32(buf + WIRE_MSG_LEN, 0);
+    return 4;
+}
+
+/**
+ * CHOKE, UNCHOKE, INTERESTED and NOT_INTERESTED have no payload
+ */
+static inline size_t
+wire_simple(uint8_t *buf, uint8_t id)
+{
+    wire_put32(buf + WIRE_MSG_LEN, 1);
+    wire_put8(buf + WIRE_MSG_ID, id);
+    return WIRE_MSG_PAYLOAD;
+}
+
+static inline size_t
+wire_have(uint8_t *buf, uint32_t index)
+{
+    wire_put32(buf + WIRE_MSG_LEN, WIRE_HAVE_LEN - 4);
+    wire_put8(buf + WIRE_MSG_ID, PW_HAVE);
+    wire_put32(buf + WIRE_MSG_PAYLOAD, index);
+    return WIRE_HAVE_LEN;
+}
+
+/**
+ * Just the header; the NBYTES of bitmap go after it
+ */
+static inline size_t
+wire_bitfield(uint8_t *buf, uint32_t nbytes)
+{
+    wire_put32(buf + WIRE_MSG_LEN, 1 + nbytes);
+    wire_put8(buf + WIRE_MSG_ID, PW_BITFIELD);
+    return WIRE_MSG_PAYLOAD;
+}
+
+/**
+ * ID is PW_REQUEST or PW_CANCEL, which look the same
+ */
+static inline size_t
+wire_request(uint8_t *buf, uint8_t id, uint32_t index, uint32_t begin,
+             uint32_t len)
+{
+    wire_put32(buf + WIRE_MSG_LEN, WIRE_REQUEST_LEN - 4);
+    wire_put8(buf + WIRE_MSG_ID, id);
+    wire_put32(buf + WIRE_MSG_PAYLOAD, index);
+    wire_put32(buf + WIRE_MSG_PAYLOAD + 4, begin);
+    wire_put32(buf + WIRE_MSG_PAYLOAD + 8, len);
+    return WIRE_REQUEST_LEN;
+}
+
+/**
+ * Just the header, so the block can be sent from wherever it is
+ */
+static inline size_t
+wire_piece(uint8_t *buf, uint32_t index, uint32_t begin, uint32_t len)
+{
+    wire_put32(buf + WIRE_MSG_LEN, WIRE_PIECE_HDR_LEN - 4 + len);
+    wire_put8(buf + WIRE_MSG_ID, PW_PIECE);
+    wire_put32(buf + WIRE_MSG_PAYLOAD, index);
+    wire_put32(buf + WIRE_MSG_PAYLOAD + 4, begin);
+    return WIRE_PIECE_HDR_LEN;
+}
+
+static inline size_t
+wire_port(uint8_t *buf, uint16_t port)
+{
+    wire_put32(buf + WIRE_MSG_LEN, WIRE_PORT_LEN - 4);
+    wire_put8(buf + WIRE_MSG_ID, PW_PORT);
+    wire_put16(buf + WIRE_MSG_PAYLOAD, port);
+    return WIRE_PORT_LEN;
+}
+
+/**
+ * Decoders take a message pw_next() framed
+ */
+static inline int
+wire_get_have(const pw_msg_t *m, uint32_t *index)
+{
+    if (m->id != PW_HAVE || m->len != 4) return -1;
+    *index = wire_get32(m->payload);
+    return 0;
+}
+
+static inline int
+wire_get_request(const pw_msg_t *m, uint32_t *index, uint32_t *begin,
+                 uint32_t *len)
+{
+    if ((m->id != PW_REQUEST && m->id != PW_CANCEL) || m->len != 12) return -1;
+    *index = wire_get32(m->payload);
+    *begin = wire_get32(m->payload + 4);
+    *len   = wire_get32(m->payload + 8);
+    return 0;
+}
+
+static inline int
+wire_get_port(const pw_msg_t *m, uint16_t *port)
+{
+    if (m->id != PW_PORT || m->len != 2) return -1;
+    *port = wire_get16(m->payload);
+    return 0;
+}
+
+static inline int
+wire_get_handshake(const pw_msg_t *m, const uint8_t **info_hash,
+                   const uint8_t **peer_id)
+{
+    if (m->id != PW_HANDSHAKE || m->len != WIRE_HS_LEN) return -1;
+    *info_hash = m->payload + WIRE_HS_INFO_HASH;
+    *peer_id   = m->payload + WIRE_HS_PEER_ID;
+    return 0;
+}
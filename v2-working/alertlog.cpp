@@ -0,0 +1,159 @@
+//
+// alertlog.cpp --- Asynchronous, batched alert logging.
+//
+// The alert loop copies each alert's message into a slot of a lock-free
+// ring and moves on. A writer thread drains the ring, formats a timestamped
+// line per record and hands whole batches to writev(2), so a busy session
+// costs a memcpy per alert on the main thread instead of a flush.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alertlog.hpp"
+
+// Records written per writev(2) call, at most
+static int const batch_size = 64;
+
+alert_logger::alert_logger(int fd)
+    : m_fd(fd)
+{
+    m_writer = std::thread(&alert_logger::writer_main, this);
+}
+
+alert_logger::alert_logger(std::string path, std::uint64_t max_bytes,
+                           int keep)
+    : m_owns_fd(true), m_path(std::move(path)), m_max_bytes(max_bytes),
+      m_keep(keep)
+{
+    if ((m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        perror("open");
+
+    struct stat st;
+    if (m_fd >= 0 && fstat(m_fd, &st) == 0)
+        m_written = static_cast<std::uint64_t>(st.st_size);
+
+    m_writer = std::thread(&alert_logger::writer_main, this);
+}
+
+alert_logger::~alert_logger()
+{
+    m_stop.store(true);
+    m_writer.join();
+    if (m_owns_fd && m_fd >= 0) close(m_fd);
+}
+
+void
+alert_logger::log(lt::alert const *a)
+{
+    record *r = m_ring.claim();
+    if (r == nullptr) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::string msg = a->message();
+    r->when = std::chrono::system_clock::now();
+    r->what = a->what();
+    r->len  = static_cast<std::uint16_t>(std::min(msg.size(), sizeof(r->msg)));
+    memcpy(r->msg, msg.data(), r->len);
+    m_ring.commit();
+}
+
+// Write N iovecs, picking up where writev(2) left off after a short write
+bool
+alert_logger::write_batch(iovec *iov, int n)
+{
+    while (n > 0) {
+        ssize_t w = writev(m_fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        m_written += static_cast<std::uint64_t>(w);
+
+        size_t left = static_cast<size_t>(w);
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+// Shift PATH.1 ... PATH.(KEEP-1) up by one, move PATH to PATH.1 and start
+// a fresh PATH
+void
+alert_logger::rotate()
+{
+    close(m_fd);
+
+    for (int i = m_keep - 1; i >= 1; i--) {
+        std::string from = m_path + "." + std::to_string(i);
+        std::string to   = m_path + "." + std::to_string(i + 1);
+        rename(from.c_str(), to.c_str());
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_APPEND;
+    if (m_keep > 0)
+        rename(m_path.c_str(), (m_path + ".1").c_str());
+    else
+        flags |= O_TRUNC;
+
+    if ((m_fd = open(m_path.c_str(), flags, 0644)) < 0) perror("open");
+    m_written = 0;
+}
+
+void
+alert_logger::writer_main()
+{
+    char  lines[batch_size][sizeof(record::msg) + 64];
+    iovec iov[batch_size];
+
+    for (;;) {
+        // Read the flag first so that nothing queued before it was set
+        // can be missed by the final pass
+        bool stopping = m_stop.load();
+        int  n        = 0;
+
+        for (record *r; n < batch_size && (r = m_ring.front()) != nullptr; n++) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          r->when.time_since_epoch()).count();
+            time_t    secs = static_cast<time_t>(ms / 1000);
+            struct tm tm;
+            localtime_r(&secs, &tm);
+
+            int len = snprintf(lines[n], sizeof(lines[n]),
+                               "%02d:%02d:%02d.%03d %s: %.*s\n", tm.tm_hour,
+                               tm.tm_min, tm.tm_sec, static_cast<int>(ms % 1000),
+                               r->what, static_cast<int>(r->len), r->msg);
+            m_ring.release();
+
+            iov[n].iov_base = lines[n];
+            iov[n].iov_len  = std::min(static_cast<size_t>(len),
+                                       sizeof(lines[n]) - 1);
+        }
+
+        if (n > 0 && m_fd >= 0) {
+            if (!write_batch(iov, n)) perror("writev");
+            if (m_owns_fd && m_max_bytes > 0 && m_written >= m_max_bytes)
+                rotate();
+        }
+
+        if (n == batch_size) continue; // There's probably more waiting
+        if (n == 0 && stopping) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
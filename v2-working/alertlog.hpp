@@ -0,0 +1,64 @@
+//
+// alertlog.hpp --- Log alerts from a background thread so that formatting
+// and writing them never holds up the alert loop.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include <sys/uio.h>
+
+#include <libtorrent/alert.hpp>
+
+#include "ring.hpp"
+
+class alert_logger {
+public:
+    // Log to FD, which is never rotated or closed
+    explicit alert_logger(int fd);
+    // Log to PATH, moving it to PATH.1 (and so on, up to PATH.KEEP) whenever
+    // it grows past MAX_BYTES
+    alert_logger(std::string path, std::uint64_t max_bytes, int keep);
+    // Writes out whatever is still queued
+    ~alert_logger();
+
+    alert_logger(alert_logger const &) = delete;
+    alert_logger &operator=(alert_logger const &) = delete;
+
+    // Queue an alert to be logged. Only ever call this from one thread. If
+    // the writer has fallen too far behind, the alert is counted and dropped
+    // rather than making the caller wait.
+    void log(lt::alert const *a);
+
+    std::uint64_t dropped() const { return m_dropped.load(); }
+
+private:
+    // The alert itself is freed by the next pop_alerts(), so its message
+    // has to be copied out here; everything else is done by the writer
+    struct record {
+        std::chrono::system_clock::time_point when;
+        char const *                          what; // Static string
+        std::uint16_t                         len;
+        char                                  msg[230];
+    };
+
+    void writer_main();
+    bool write_batch(iovec *iov, int n);
+    void rotate();
+
+    spsc_ring<record, 4096>    m_ring;
+    int                        m_fd;
+    bool                       m_owns_fd = false;
+    std::string                m_path;
+    std::uint64_t              m_max_bytes = 0;
+    std::uint64_t              m_written   = 0;
+    int                        m_keep      = 0;
+    std::atomic<bool>          m_stop{false};
+    std::atomic<std::uint64_t> m_dropped{0};
+    std::thread                m_writer;
+};
@@ -0,0 +1,317 @@
+//
+// bench.cpp --- Measure bitclient-lt's download throughput without touching
+// the internet.
+//
+// We make up a payload, build a .torrent for it in-process and seed it from
+// one or more sessions listening on loopback. Each seeder gets its own
+// 127.0.0.N address so the downloader treats them as distinct peers. Then we
+// run bitclient-lt in streaming mode on a magnet that names the seeders as
+// peers (x.pe), read the payload back through a pipe and time it.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/bencode.hpp>
+#include <libtorrent/create_torrent.hpp>
+#include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/session.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+namespace fs = std::filesystem;
+using bench_clock = std::chrono::steady_clock;
+
+#define USAGE                                                                  \
+    "\
+Usage: ./bench-lt [options]\n\
+    Options:\n\
+        -s || --size MiB       Payload size (256)\n\
+        -p || --piece KiB      Piece size (1024)\n\
+        -n || --seeders N      Seeding sessions to download from (1)\n\
+        -t || --timeout SECS   Give up after this long (300)\n\
+        -b || --binary PATH    The client to benchmark (./bitclient-lt)\n\
+        -S || --storage KIND   Passed on to the client's --storage\n\
+        -h || --help           Print this message and exit\n"
+
+// Fill PATH with SIZE bytes of xorshift noise, which won't compress and is
+// the same on every run
+static bool
+make_payload(fs::path const &path, long long size)
+{
+    std::ofstream out(path, std::ios::binary);
+    std::vector<std::uint64_t> block(1 << 17);
+    std::uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    for (long long left = size; left > 0;) {
+        for (auto &w : block) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            w = x;
+        }
+        auto n = std::min<long long>(left, block.size() * sizeof(block[0]));
+        out.write(reinterpret_cast<char const *>(block.data()), n);
+        left -= n;
+    }
+    return static_cast<bool>(out);
+}
+
+static std::shared_ptr<lt::torrent_info>
+make_torrent(fs::path const &dir, fs::path const &file, int piece_size)
+{
+    lt::file_storage files;
+    lt::add_files(files, file.string());
+
+    lt::create_torrent ct(files, piece_size);
+    lt::error_code     ec;
+    lt::set_piece_hashes(ct, dir.string(), ec);
+    if (ec) {
+        std::cerr << "Failed to hash the payload: " << ec.message()
+                  << std::endl;
+        return nullptr;
+    }
+
+    std::vector<char> buf;
+    lt::bencode(std::back_inserter(buf), ct.generate());
+    return std::make_shared<lt::torrent_info>(buf, lt::from_span);
+}
+
+// Have SES seed TI out of DIR, and return the port it ended up listening
+// on (or -1)
+static int
+start_seeder(lt::session &ses, std::shared_ptr<lt::torrent_info> ti,
+             fs::path const &dir)
+{
+    lt::add_torrent_params params;
+    params.ti        = std::move(ti);
+    params.save_path = dir.string();
+    params.flags |= lt::torrent_flags::seed_mode;
+    ses.add_torrent(std::move(params));
+
+    for (auto deadline = bench_clock::now() + std::chrono::seconds(10);
+         bench_clock::now() < deadline;) {
+        std::vector<lt::alert *> alerts;
+        ses.wait_for_alert(std::chrono::milliseconds(100));
+        ses.pop_alerts(&alerts);
+        for (lt::alert const *a : alerts) {
+            auto ls = lt::alert_cast<lt::listen_succeeded_alert>(a);
+            if (ls && ls->socket_type == lt::socket_type_t::tcp)
+                return ls->port;
+        }
+    }
+    return -1;
+}
+
+static lt::settings_pack
+seeder_settings(std::string const &addr)
+{
+    lt::settings_pack sp;
+    sp.set_str(lt::settings_pack::listen_interfaces, addr + ":0");
+    sp.set_bool(lt::settings_pack::enable_dht, false);
+    sp.set_bool(lt::settings_pack::enable_lsd, false);
+    sp.set_bool(lt::settings_pack::enable_upnp, false);
+    sp.set_bool(lt::settings_pack::enable_natpmp, false);
+    sp.set_int(lt::settings_pack::alert_mask,
+               lt::alert_category::error | lt::alert_category::status);
+    return sp;
+}
+
+static double
+seconds(timeval tv)
+{
+    return static_cast<double>(tv.tv_sec) +
+           static_cast<double>(tv.tv_usec) / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+    long long   size_mib  = 256;
+    int         piece_kib = 1024;
+    int         seeders   = 1;
+    int         timeout   = 300;
+    std::string binary    = "./bitclient-lt";
+    char const *storage   = "default";
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            std::cout << USAGE;
+            return 0;
+        } else if (has_arg && (!strcmp(argv[i], "-s") ||
+                               !strcmp(argv[i], "--size"))) {
+            size_mib = atoll(argv[++i]);
+        } else if (has_arg && (!strcmp(argv[i], "-p") ||
+                               !strcmp(argv[i], "--piece"))) {
+            piece_kib = atoi(argv[++i]);
+        } else if (has_arg && (!strcmp(argv[i], "-n") ||
+                               !strcmp(argv[i], "--seeders"))) {
+            seeders = atoi(argv[++i]);
+        } else if (has_arg && (!strcmp(argv[i], "-t") ||
+                               !strcmp(argv[i], "--timeout"))) {
+            timeout = atoi(argv[++i]);
+        } else if (has_arg && (!strcmp(argv[i], "-b") ||
+                               !strcmp(argv[i], "--binary"))) {
+            binary = argv[++i];
+        } else if (has_arg && (!strcmp(argv[i], "-S") ||
+                               !strcmp(argv[i], "--storage"))) {
+            storage = argv[++i];
+        } else {
+            std::cerr << USAGE;
+            return -1;
+        }
+    }
+
+    // Piece sizes must be a power of two of at least 16 KiB
+    if (size_mib <= 0 || seeders <= 0 || seeders > 250 || timeout <= 0 ||
+        piece_kib < 16 || (piece_kib & (piece_kib - 1)) != 0) {
+        std::cerr << USAGE;
+        return -1;
+    }
+
+    std::error_code ec;
+    binary = fs::absolute(binary, ec).string();
+
+    char tmpl[] = "/tmp/bench-lt.XXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+        perror("mkdtemp");
+        return -1;
+    }
+    fs::path root(tmpl), seed_dir = root / "seed", leech_dir = root / "leech";
+    fs::create_directories(seed_dir);
+    fs::create_directories(leech_dir);
+
+    std::cerr << "Generating " << size_mib << " MiB payload..." << std::endl;
+    fs::path payload = seed_dir / "payload.bin";
+    if (!make_payload(payload, size_mib << 20)) {
+        std::cerr << "Failed to write the payload" << std::endl;
+        fs::remove_all(root, ec);
+        return -1;
+    }
+
+    auto ti = make_torrent(seed_dir, payload, piece_kib << 10);
+    if (!ti) {
+        fs::remove_all(root, ec);
+        return -1;
+    }
+
+    // Start the swarm and point the magnet at every member of it
+    std::vector<std::unique_ptr<lt::session>> swarm;
+    std::string magnet = lt::make_magnet_uri(*ti);
+    for (int i = 0; i < seeders; i++) {
+        std::string addr = "127.0.0." + std::to_string(i + 2);
+        swarm.push_back(std::make_unique<lt::session>(seeder_settings(addr)));
+
+        int port = start_seeder(*swarm.back(), ti, seed_dir);
+        if (port < 0) {
+            std::cerr << "Seeder on " << addr << " never started" << std::endl;
+            fs::remove_all(root, ec);
+            return -1;
+        }
+        magnet += "&x.pe=" + addr + ":" + std::to_string(port);
+    }
+
+    // Run the client with its stdout on a pipe we drain
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        perror("pipe");
+        fs::remove_all(root, ec);
+        return -1;
+    }
+
+    auto  start = bench_clock::now();
+    pid_t pid   = fork();
+    if (pid < 0) {
+        perror("fork");
+        fs::remove_all(root, ec);
+        return -1;
+    } else if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (chdir(leech_dir.c_str()) < 0) _exit(127);
+        execl(binary.c_str(), binary.c_str(), "-s", "--storage", storage,
+              magnet.c_str(), static_cast<char *>(nullptr));
+        perror("execl");
+        _exit(127);
+    }
+    close(pipefd[1]);
+
+    std::vector<char>      buf(1 << 20);
+    long long              received = 0;
+    bench_clock::time_point first_byte;
+    bool                   timed_out = false;
+    auto                   deadline  = start + std::chrono::seconds(timeout);
+
+    for (;;) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - bench_clock::now()).count();
+        pollfd pfd = {pipefd[0], POLLIN, 0};
+        if (left <= 0 || poll(&pfd, 1, static_cast<int>(left)) == 0) {
+            timed_out = true;
+            kill(pid, SIGKILL);
+            break;
+        }
+
+        ssize_t n = read(pipefd[0], buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (received == 0) first_byte = bench_clock::now();
+        received += n;
+    }
+    auto finish = bench_clock::now();
+    close(pipefd[0]);
+
+    int           status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    swarm.clear();
+    fs::remove_all(root, ec);
+
+    long long expected = size_mib << 20;
+    if (timed_out || received != expected || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        std::cerr << "Download failed: got " << received << " of " << expected
+                  << " bytes" << (timed_out ? " before timing out" : "")
+                  << std::endl;
+        return -1;
+    }
+
+    using secs = std::chrono::duration<double>;
+    double total = secs(finish - start).count();
+    double ttfb  = secs(first_byte - start).count();
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "size_mib="     << size_mib
+              << " piece_kib="   << piece_kib
+              << " seeders="     << seeders
+              << " storage="     << storage
+              << " mb_per_s="    << static_cast<double>(expected) / 1e6 / total
+              << " ttfb_s="      << ttfb
+              << " complete_s="  << total
+              << " cpu_user_s="  << seconds(ru.ru_utime)
+              << " cpu_sys_s="   << seconds(ru.ru_stime)
+              << " peak_rss_kib=" << ru.ru_maxrss << std::endl;
+    return 0;
+}
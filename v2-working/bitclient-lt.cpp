@@ -5,70 +5,546 @@
 // Thalia Wright <wrightng@reed.edu>
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+
+#include <signal.h>
+#include <unistd.h>
 
 #include <libtorrent/session.hpp>
 #include <libtorrent/add_torrent_params.hpp>
 #include <libtorrent/torrent_handle.hpp>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/session_params.hpp>
+
+#include "alertlog.hpp"
+#include "bwclass.hpp"
+#include "config.hpp"
+#include "create.hpp"
+#include "files.hpp"
+#include "memory.hpp"
+#include "placement.hpp"
+#include "queue.hpp"
+#include "shard.hpp"
+#include "storage.hpp"
+#include "stream.hpp"
 
 static bool log_verbosely = false;
+static volatile sig_atomic_t reload_settings = 0;
+
+static void
+on_sighup(int)
+{
+    reload_settings = 1;
+}
+
+#define USAGE                                                                  \
+    "\
+Usage: ./bitclient-lt [options] [magnet ...]\n\
+       ./bitclient-lt create [options] [create options] PATH\n\
+    Options:\n\
+        -v || --verbose        Log every alert the session raises\n\
+        -l || --log FILE       Log alerts to FILE instead, rotating it\n\
+                               every --log-size MiB (64)\n\
+        -s || --stream         Write the payload to stdout, in order, as it\n\
+                               arrives; messages go to stderr instead\n\
+        -w || --window N       Pieces to prioritise ahead of the stream (8)\n\
+        --storage KIND         Where to keep pieces: default, mmap, posix or\n\
+                               memory (nothing is written to disk)\n\
+        --save-root DIR        Save torrents under DIR; given more than once,\n\
+                               each torrent goes wherever it'll finish first\n\
+        --rebalance PCT        Move finished torrents off roots with less\n\
+                               than PCT% free\n\
+        --include GLOB         Only download files matching GLOB, by path\n\
+                               or name; may be given more than once\n\
+        --exclude GLOB         Never download files matching GLOB\n\
+        --files LIST           Only download these files, e.g. 0,3,5-9\n\
+        --shards N             Run N sessions, each on its own core, and\n\
+                               split torrents between them (1)\n\
+        --port PORT            Listen on PORT; shard i uses PORT + i\n\
+        --memory MiB           Size buffers to stay within MiB, shrinking\n\
+                               them and refusing new peers as RSS nears it\n\
+        --profile NAME         Start from tuned settings: seedbox, batch\n\
+                               (many downloads) or edge (little memory)\n\
+        -c || --config FILE    Read libtorrent settings from FILE, as\n\
+                               NAME = VALUE lines; SIGHUP re-reads it\n\
+        --set NAME=VALUE       Override one libtorrent setting\n\
+        -h || --help           Print this message and exit\n\
+    Queue options:\n\
+        -b || --batch FILE     Also add the magnets in FILE, one per line,\n\
+                               as [priority=N] [deadline=SECS]\n\
+                               [class=NAME] magnet\n\
+        --active-downloads N   Torrents downloading at once (8)\n\
+        --active-seeds N       Torrents seeding at once (8)\n\
+        --active-limit N       Torrents running at once (16)\n\
+        --stall-rate KiB       Demote downloads slower than this... (10)\n\
+        --stall-time SECS      ...for this long (120)\n\
+        --seed-ratio R         Stop seeding at this upload ratio\n\
+        --seed-time SECS       Stop seeding after this long\n\
+    Bandwidth options:\n\
+        --bw-down KiB          Total download rate of the link\n\
+        --bw-up KiB            Total upload rate of the link\n\
+        --bw-class SPEC        Define a class as NAME[:share=PCT][,cap=KiB]\n\
+                               [,priority=N]; PCT% of the link is kept for\n\
+                               it while it's busy, it never exceeds KiB/s,\n\
+                               and higher priorities get spare bandwidth\n\
+                               first. May be given more than once.\n\
+        --bw-peers NAME=RANGE  Put peers in RANGE (A, A-B or A/LEN) in\n\
+                               class NAME; may be given more than once\n\
+    Create options:\n\
+        -o || --output FILE    Where to write the torrent (PATH.torrent)\n\
+        --format FORMAT        v1, v2 or hybrid (hybrid)\n\
+        --piece KiB            Piece size, a power of two of at least 16;\n\
+                               chosen from PATH's size if unset\n\
+        --threads N            Hashing threads (one per core)\n\
+        -t || --tracker URL    Announce to URL; may be given more than once\n\
+        --seed                 Seed PATH once the torrent is made\n"
 
 int
 main(int argc, char *argv[])
 {
-    lt::settings_pack settings;    // Tell the session how verbose to be
-    lt::add_torrent_params params; // Tell the session what to downloaded
-    lt::torrent_handle torrent;    // The thing the session is downloading
-    // session is declared below
+    lt::session_params session_params; // Tell the session how to behave
+    lt::add_torrent_params params;     // Tell the session what to downloaded
+    lt::torrent_handle torrent;        // The thing the session is downloading
+    // sessions are declared below
+    std::vector<queued_magnet> magnets;
+    queue_options queue_opts;
+    bool  stream = false;
+    int   window = 8;
+    char *log_path = nullptr;
+    long  log_size = 64;
+    std::unique_ptr<alert_logger> logger;
+    storage_kind storage = storage_kind::standard;
+    std::vector<std::string> save_roots;
+    int   rebalance_pct = 0;
+    file_selector files;
+    int   shards = 1, port = 0;
+    long  memory_budget = 0;
+    std::unique_ptr<memory_governor> governor;
+    char *profile = nullptr, *config_path = nullptr;
+    std::vector<std::string> overrides;
+    std::vector<bw_class> bw_classes;
+    int   bw_down = 0, bw_up = 0;
+    create_options create;
+    bool  creating = argc > 1 && !strcmp(argv[1], "create");
+    bool  seeding  = false;
 
-    if (argc < 2) {
-        std::cerr << "Usage: ./bitclient-lt [magnet]" << std::endl;
+    for (int i = creating ? 2 : 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
+            log_verbosely = true;
+        } else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--log")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            log_path      = argv[i];
+            log_verbosely = true;
+        } else if (!strcmp(argv[i], "--log-size")) {
+            if (++i == argc || (log_size = atol(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream")) {
+            stream = true;
+        } else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--window")) {
+            if (++i == argc || (window = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--storage")) {
+            if (++i == argc || !parse_storage_kind(argv[i], storage)) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--save-root")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            save_roots.push_back(argv[i]);
+        } else if (!strcmp(argv[i], "--rebalance")) {
+            if (++i == argc || (rebalance_pct = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--include")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            files.include(argv[i]);
+        } else if (!strcmp(argv[i], "--exclude")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            files.exclude(argv[i]);
+        } else if (!strcmp(argv[i], "--files")) {
+            if (++i == argc || !files.add_indices(argv[i])) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--shards")) {
+            if (++i == argc || (shards = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--port")) {
+            if (++i == argc || (port = atoi(argv[i])) <= 0 || port > 65535) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--memory")) {
+            if (++i == argc || (memory_budget = atol(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--profile")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            profile = argv[i];
+        } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--config")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            config_path = argv[i];
+        } else if (!strcmp(argv[i], "--set")) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            overrides.push_back(argv[i]);
+        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            std::cout << USAGE;
+            return 0;
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--batch")) {
+            if (++i == argc || !load_batch(argv[i], magnets)) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--active-downloads")) {
+            if (++i == argc || (queue_opts.active_downloads = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--active-seeds")) {
+            if (++i == argc || (queue_opts.active_seeds = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--active-limit")) {
+            if (++i == argc || (queue_opts.active_limit = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--stall-rate")) {
+            if (++i == argc || (queue_opts.stall_rate = atoi(argv[i]) * 1024) < 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--stall-time")) {
+            if (++i == argc || (queue_opts.stall_secs = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--seed-ratio")) {
+            if (++i == argc || (queue_opts.seed_ratio = strtof(argv[i], nullptr)) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--seed-time")) {
+            if (++i == argc || (queue_opts.seed_secs = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--bw-down")) {
+            if (++i == argc || (bw_down = atoi(argv[i]) * 1024) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--bw-up")) {
+            if (++i == argc || (bw_up = atoi(argv[i]) * 1024) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--bw-class")) {
+            bw_class c;
+            if (++i == argc || !parse_bw_class(argv[i], c)) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            bw_classes.push_back(std::move(c));
+        } else if (!strcmp(argv[i], "--bw-peers")) {
+            char const *eq = ++i == argc ? nullptr : strchr(argv[i], '=');
+            auto c = std::find_if(bw_classes.begin(), bw_classes.end(),
+                                  [&](bw_class const &x) {
+                                      return eq && x.name == std::string(argv[i], eq);
+                                  });
+            if (c == bw_classes.end()) {
+                std::cerr << "--bw-peers needs NAME=RANGE, after --bw-class NAME"
+                          << std::endl;
+                return -1;
+            }
+            c->ranges.push_back(eq + 1);
+        } else if (creating && (!strcmp(argv[i], "-o") ||
+                                !strcmp(argv[i], "--output"))) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            create.output = argv[i];
+        } else if (creating && !strcmp(argv[i], "--format")) {
+            if (++i == argc || !parse_torrent_format(argv[i], create.format)) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (creating && !strcmp(argv[i], "--piece")) {
+            // A power of two, no smaller than a block
+            int kib = ++i == argc ? 0 : atoi(argv[i]);
+            if (kib < 16 || (kib & (kib - 1)) != 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            create.piece_size = kib * 1024;
+        } else if (creating && !strcmp(argv[i], "--threads")) {
+            if (++i == argc || (create.threads = atoi(argv[i])) <= 0) {
+                std::cerr << USAGE;
+                return -1;
+            }
+        } else if (creating && (!strcmp(argv[i], "-t") ||
+                                !strcmp(argv[i], "--tracker"))) {
+            if (++i == argc) {
+                std::cerr << USAGE;
+                return -1;
+            }
+            create.trackers.push_back(argv[i]);
+        } else if (creating && !strcmp(argv[i], "--seed")) {
+            seeding = true;
+        } else if (creating && create.path.empty()) {
+            create.path = argv[i];
+        } else if (!strncmp("magnet:", argv[i], 7)) {
+            queued_magnet q;
+            q.magnet = argv[i];
+            magnets.push_back(std::move(q));
+        }
+    }
+
+    if (creating ? create.path.empty() : magnets.empty()) {
+        std::cerr << USAGE;
         return -1;
     }
 
-    // Register a few settings regarding verbosity
-    settings.set_int(lt::settings_pack::alert_mask,
-                     lt::alert_category::error   |
-                     lt::alert_category::storage |
-                     lt::alert_category::status);
+    // The stream can only carry one payload
+    if (stream && (creating || magnets.size() != 1)) {
+        std::cerr << "-s needs exactly one magnet" << std::endl;
+        return -1;
+    }
+    if (stream && files.active()) {
+        std::cerr << "-s writes the whole payload; it can't skip files"
+                  << std::endl;
+        return -1;
+    }
+    queue_manager queue(queue_opts);
+    if (save_roots.empty()) save_roots.push_back(".");
+    placement_engine placement(save_roots, rebalance_pct);
+    bandwidth_scheduler bw(std::move(bw_classes), bw_down, bw_up);
 
-    // Add the magnet URL
-    params = lt::parse_magnet_uri(argv[1]);
-    params.save_path = ".";
+    // When streaming, stdout belongs to the payload
+    std::ostream &out = stream ? std::cerr : std::cout;
+    piece_streamer streamer(STDOUT_FILENO, window);
+    if (stream) signal(SIGPIPE, SIG_IGN); // We'll see EPIPE from write(2)
 
-    // Create the torrent session with the previous settings
-    lt::session session(settings);
+    // Alerts are formatted and written on another thread, see alertlog.cpp
+    if (log_path != nullptr)
+        logger = std::make_unique<alert_logger>(
+            log_path, static_cast<std::uint64_t>(log_size) << 20, 4);
+    else if (log_verbosely)
+        logger = std::make_unique<alert_logger>(stream ? STDERR_FILENO
+                                                       : STDOUT_FILENO);
 
-    // Control the torrent
-    torrent = session.add_torrent(std::move(params));
+    if (memory_budget > 0)
+        governor = std::make_unique<memory_governor>(
+            static_cast<std::uint64_t>(memory_budget) << 20);
 
-    std::cout << "Downloading " << params.name << "..." << std::endl;
+    // The profile is the base, our own options go on top of it, and the
+    // config file and --set have the last word. The governor then fits
+    // the result to its budget. SIGHUP does all this again.
+    auto load_settings = [&](lt::session_params &sp) {
+        lt::settings_pack &settings = sp.settings;
+        if (profile != nullptr && !load_profile(profile, settings)) {
+            std::cerr << "No such profile: " << profile << std::endl;
+            return false;
+        }
+
+        // Register a few settings regarding verbosity
+        settings.set_int(lt::settings_pack::alert_mask,
+                         lt::alert_category::error   |
+                         lt::alert_category::storage |
+                         lt::alert_category::status);
+        queue.configure(settings);
+        bw.configure(settings);
+        use_storage(storage, sp);
+
+        if (config_path != nullptr && !load_config(config_path, settings))
+            return false;
+        for (std::string const &o : overrides)
+            if (!parse_setting(o, settings)) return false;
+        if (governor) governor->configure(settings);
+        return true;
+    };
+    if (!load_settings(session_params)) return -1;
+
+    if (creating) {
+        // Hashing reads the whole payload, so seeding straight away is
+        // served from a warm page cache and needs no recheck
+        std::shared_ptr<lt::torrent_info> ti = create_torrent_file(create);
+        if (ti == nullptr) return -1;
+        out << "Wrote " << create.output << std::endl;
+        if (!seeding) return 0;
+
+        params.ti        = std::move(ti);
+        params.save_path = std::filesystem::path(create.path).parent_path();
+        params.flags |= lt::torrent_flags::seed_mode;
+    }
+
+    // Create the torrent sessions with the previous settings. With more
+    // than one shard, each torrent lives in one of them; see shard.cpp.
+    session_pool sessions(session_params, shards, port);
+    if (!bw.setup(sessions)) return -1;
+    signal(SIGHUP, on_sighup);
+
+    // Control the torrents. They're all auto-managed, so the session only
+    // runs as many at once as the queue options allow.
+    if (creating) {
+        out << "Seeding " << params.ti->name() << "..." << std::endl;
+        torrent = sessions.add_torrent(std::move(params));
+        queue.add(torrent, 0, 0);
+        bw.add(torrent, "");
+    }
+    for (queued_magnet const &m : magnets) {
+        lt::error_code ec;
+        params = lt::parse_magnet_uri(m.magnet, ec);
+        if (ec) {
+            std::cerr << "Bad magnet " << m.magnet << ": " << ec.message()
+                      << std::endl;
+            return -1;
+        }
+        params.save_path = placement.place(0);
+        std::string name = params.name;
+
+        out << "Downloading " << params.name << " to " << params.save_path
+            << "..." << std::endl;
+        std::string root = params.save_path;
+        torrent = sessions.add_torrent(std::move(params));
+        queue.add(torrent, m.priority, m.deadline);
+        placement.add(torrent, root, 0);
+        if (!bw.add(torrent, m.bw_class)) {
+            std::cerr << "No bandwidth class called " << m.bw_class
+                      << " for " << name << std::endl;
+            return -1;
+        }
+    }
 
     // New enter a loop, polling the library for info until we're done
+    auto next_report = std::chrono::steady_clock::now();
+    auto next_tick   = next_report;
+    next_report += std::chrono::seconds(15);
     for (;;) {
         std::vector<lt::alert*> alerts;
-        session.pop_alerts(&alerts);
+        sessions.wait_for_alert(std::chrono::seconds(1));
+        sessions.pop_alerts(&alerts);
 
         for (lt::alert const *a : alerts) {
-            if (log_verbosely)
-                std::cout << a->message() << std::endl;
+            if (logger) logger->log(a);
+            files.handle_alert(a);
+            queue.handle_alert(a);
+            placement.handle_alert(a);
+            bw.handle_alert(a);
 
-            if (lt::alert_cast<lt::torrent_finished_alert>(a)) {
-                std::cout << "Torrent finished!" << std::endl;
-                session.abort(); // Remove these to keep seeding
-                return 0;        //
-            } else if (lt::alert_cast<lt::torrent_error_alert>(a)) {
-                std::cerr << "Failed to download the torrent :(" << std::endl;
-                return -1;
+            if (stream) {
+                if (lt::alert_cast<lt::metadata_received_alert>(a))
+                    streamer.start(torrent);
+                if (!streamer.handle_alert(a)) {
+                    sessions.abort();
+                    return -1;
+                }
             }
+
+            if (auto tf = lt::alert_cast<lt::torrent_finished_alert>(a)) {
+                if (queue.size() > 1)
+                    out << tf->torrent_name() << " finished" << std::endl;
+                next_tick = std::chrono::steady_clock::now();
+            } else if (auto te = lt::alert_cast<lt::torrent_error_alert>(a)) {
+                if (queue.size() == 1) {
+                    std::cerr << "Failed to download the torrent :(" << std::endl;
+                    return -1;
+                }
+                std::cerr << "Failed to download " << te->torrent_name()
+                          << " :(" << std::endl;
+                queue.forget(te->handle);
+                placement.forget(te->handle);
+                bw.forget(te->handle);
+                sessions.remove_torrent(te->handle);
+            }
+        }
+
+        if (reload_settings) {
+            lt::session_params sp;
+            reload_settings = 0;
+            if (load_settings(sp)) {
+                sessions.apply_settings(sp.settings);
+                out << "Reloaded settings" << std::endl;
+            } else {
+                std::cerr << "Keeping the old settings" << std::endl;
+            }
+        }
+
+        if (std::chrono::steady_clock::now() >= next_tick) {
+            queue.tick(sessions);
+            if (governor) governor->tick(sessions, queue.peers());
+            if (sessions.size() > 1) sessions.post_session_stats();
+            next_tick = std::chrono::steady_clock::now();
+            next_tick += std::chrono::seconds(5);
+        }
+
+        // Seeding something we just created only stops at a seed goal
+        if (!stream && queue.done() && (!seeding || queue.has_seed_goals())) {
+            out << "Torrent finished!" << std::endl;
+            sessions.abort(); // Remove these to keep seeding
+            return 0;        //
         }
-        std::this_thread::sleep_for(std::chrono::seconds(15));
-        double dl = static_cast<double>(torrent.status().total_payload_download);
-        std::cout << std::fixed << std::setprecision(2)
-                  << dl / 1024 / 1024 << " MB Downloaded" << std::endl;
+
+        if (stream && streamer.done()) {
+            out << "Torrent finished!" << std::endl;
+            sessions.abort();
+            return 0;
+        }
+
+        if (std::chrono::steady_clock::now() < next_report) continue;
+        next_report += std::chrono::seconds(15);
+        double dl = static_cast<double>(queue.total_downloaded());
+        out << std::fixed << std::setprecision(2)
+            << dl / 1024 / 1024 << " MB Downloaded" << std::endl;
+        if (logger && logger->dropped() > 0)
+            out << logger->dropped() << " alerts dropped from the log"
+                << std::endl;
+        if (sessions.size() > 1)
+            out << sessions.counter("peer.num_peers_connected")
+                << " peers across " << sessions.size() << " shards"
+                << std::endl;
+        if (governor)
+            out << (governor->rss() >> 20) << " of "
+                << (governor->budget() >> 20) << " MiB in use" << std::endl;
     }
     return 0;
 }
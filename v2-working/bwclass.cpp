@@ -0,0 +1,283 @@
+//
+// bwclass.cpp --- Guaranteed shares, caps and priorities for traffic classes
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <libtorrent/address.hpp>
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/ip_filter.hpp>
+#include <libtorrent/peer_class.hpp>
+
+#include "bwclass.hpp"
+
+bool
+parse_bw_class(char const *spec, bw_class &out)
+{
+    char const *colon = strchr(spec, ':');
+    out.name = colon ? std::string(spec, colon) : std::string(spec);
+    if (out.name.empty()) return false;
+
+    for (char const *p = colon; p != nullptr && *p != '\0';) {
+        p++;
+        char const *end = strchr(p, ',');
+        std::string kv  = end ? std::string(p, end) : std::string(p);
+        p = end;
+
+        if (!kv.compare(0, 6, "share="))
+            out.share = atoi(kv.c_str() + 6);
+        else if (!kv.compare(0, 4, "cap="))
+            out.cap = atoi(kv.c_str() + 4) * 1024;
+        else if (!kv.compare(0, 9, "priority="))
+            out.priority = atoi(kv.c_str() + 9);
+        else
+            return false;
+    }
+    return out.share >= 0 && out.share <= 100 && out.cap >= 0 &&
+           out.priority >= 1 && out.priority <= 255;
+}
+
+// Turn the first LEN bits of LO into a network prefix, and HI into the last
+// address in it
+template <typename Bytes>
+static bool
+apply_prefix(Bytes &lo, Bytes &hi, int len)
+{
+    if (len < 0 || len > static_cast<int>(lo.size() * 8)) return false;
+    for (std::size_t i = 0; i < lo.size(); i++) {
+        int bits = std::clamp(len - static_cast<int>(i * 8), 0, 8);
+        auto mask = static_cast<std::uint8_t>(0xff00 >> bits);
+        lo[i] = static_cast<std::uint8_t>(lo[i] & mask);
+        hi[i] = static_cast<std::uint8_t>(lo[i] | ~mask);
+    }
+    return true;
+}
+
+// Parse "A", "A-B" or "A/LEN", for IPv4 or IPv6
+static bool
+parse_range(std::string const &spec, lt::address &first, lt::address &last)
+{
+    lt::error_code ec;
+    auto dash  = spec.find('-');
+    auto slash = spec.find('/');
+
+    if (dash != std::string::npos) {
+        first = lt::make_address(spec.substr(0, dash), ec);
+        if (!ec) last = lt::make_address(spec.substr(dash + 1), ec);
+        return !ec && first.is_v4() == last.is_v4() && !(last < first);
+    }
+
+    first = last = lt::make_address(spec.substr(0, slash), ec);
+    if (ec) return false;
+    if (slash == std::string::npos) return true;
+
+    int len = atoi(spec.c_str() + slash + 1);
+    if (first.is_v4()) {
+        auto lo = first.to_v4().to_bytes(), hi = lo;
+        if (!apply_prefix(lo, hi, len)) return false;
+        first = lt::address_v4(lo);
+        last  = lt::address_v4(hi);
+    } else {
+        auto lo = first.to_v6().to_bytes(), hi = lo;
+        if (!apply_prefix(lo, hi, len)) return false;
+        first = lt::address_v6(lo);
+        last  = lt::address_v6(hi);
+    }
+    return true;
+}
+
+bandwidth_scheduler::bandwidth_scheduler(std::vector<bw_class> classes,
+                                         int total_down, int total_up)
+    : m_classes(std::move(classes)), m_total_down(total_down),
+      m_total_up(total_up)
+{
+    bool has_default = std::any_of(m_classes.begin(), m_classes.end(),
+                                   [](bw_class const &c) {
+                                       return c.name == "default";
+                                   });
+    if (!has_default) {
+        bw_class c;
+        c.name = "default";
+        m_classes.insert(m_classes.begin(), std::move(c));
+    }
+}
+
+void
+bandwidth_scheduler::configure(lt::settings_pack &settings) const
+{
+    if (m_total_down > 0)
+        settings.set_int(lt::settings_pack::download_rate_limit, m_total_down);
+    if (m_total_up > 0)
+        settings.set_int(lt::settings_pack::upload_rate_limit, m_total_up);
+}
+
+bool
+bandwidth_scheduler::setup(session_pool &sessions)
+{
+    auto bit = [](lt::peer_class_t pc) {
+        return std::uint32_t(1) << static_cast<std::uint32_t>(pc);
+    };
+    std::uint32_t global = bit(lt::session::global_peer_class_id);
+    std::uint32_t local  = bit(lt::session::local_peer_class_id);
+
+    // Installing a filter replaces the session's default one, so start by
+    // rebuilding that: everyone is global, except LAN peers, which are local
+    lt::ip_filter filter;
+    filter.add_rule(lt::make_address("0.0.0.0"),
+                    lt::make_address("255.255.255.255"), global);
+    filter.add_rule(lt::make_address("::"),
+                    lt::make_address("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"),
+                    global);
+    for (char const *lan : {"10.0.0.0/8", "172.16.0.0/12", "192.168.0.0/16",
+                            "169.254.0.0/16", "127.0.0.0/8"}) {
+        lt::address first, last;
+        parse_range(lan, first, last);
+        filter.add_rule(first, last, local);
+    }
+
+    // Tagged peers count against the global limits too, wherever they are.
+    // Every shard creates the same classes in the same order, so they get
+    // the same IDs and can share a filter; each gets its share of the cap.
+    bool any = false;
+    int  n   = static_cast<int>(sessions.size());
+    for (bw_class const &c : m_classes) {
+        if (c.ranges.empty()) continue;
+
+        lt::peer_class_t pc{};
+        for (std::size_t i = 0; i < sessions.size(); i++) {
+            lt::session &ses = sessions.shard(i);
+            pc = ses.create_peer_class(c.name.c_str());
+
+            lt::peer_class_info info = ses.get_peer_class(pc);
+            info.upload_limit      = (c.cap + n - 1) / n;
+            info.download_limit    = (c.cap + n - 1) / n;
+            info.upload_priority   = c.priority;
+            info.download_priority = c.priority;
+            ses.set_peer_class(pc, info);
+        }
+
+        for (std::string const &range : c.ranges) {
+            lt::address first, last;
+            if (!parse_range(range, first, last)) {
+                std::cerr << "Bad IP range for class " << c.name << ": "
+                          << range << std::endl;
+                return false;
+            }
+            filter.add_rule(first, last, global | bit(pc));
+        }
+        any = true;
+    }
+
+    if (!any) return true;
+    for (std::size_t i = 0; i < sessions.size(); i++)
+        sessions.shard(i).set_peer_class_filter(filter);
+    return true;
+}
+
+bool
+bandwidth_scheduler::add(lt::torrent_handle const &h, std::string const &name)
+{
+    std::string want = name.empty() ? "default" : name;
+    for (std::size_t i = 0; i < m_classes.size(); i++) {
+        if (m_classes[i].name != want) continue;
+        tagged t;
+        t.cls = i;
+        m_torrents.emplace(h, std::move(t));
+        return true;
+    }
+    return false;
+}
+
+void
+bandwidth_scheduler::forget(lt::torrent_handle const &h)
+{
+    m_torrents.erase(h);
+}
+
+void
+bandwidth_scheduler::handle_alert(lt::alert const *a)
+{
+    auto su = lt::alert_cast<lt::state_update_alert>(a);
+    if (su == nullptr) return;
+
+    for (lt::torrent_status const &st : su->status) {
+        auto it = m_torrents.find(st.handle);
+        if (it != m_torrents.end()) it->second.status = st;
+    }
+    rebalance();
+}
+
+// What class I may use of TOTAL: everything but the shares reserved by other
+// busy classes and the excess used by busier classes of higher priority, but
+// never less than its own share, nor more than its cap. -1 means unlimited.
+int
+bandwidth_scheduler::class_limit(std::size_t i, std::vector<usage> const &use,
+                                 int total) const
+{
+    bw_class const &c = m_classes[i];
+    if (total <= 0) return c.cap > 0 ? c.cap : -1;
+
+    double avail = total;
+    for (std::size_t j = 0; j < m_classes.size(); j++) {
+        if (j == i || !use[j].active) continue;
+        double reserve = total * m_classes[j].share / 100.0;
+        avail -= reserve;
+        if (m_classes[j].priority > c.priority)
+            avail -= std::max(0.0, use[j].rate - reserve);
+    }
+
+    double limit = std::max(avail, total * c.share / 100.0);
+    if (c.cap > 0) limit = std::min(limit, static_cast<double>(c.cap));
+    if (c.cap <= 0 && limit >= total) return -1;
+
+    // Never let a limit drop to 0, which libtorrent reads as unlimited
+    return std::max(static_cast<int>(limit) / 1024 * 1024, 1024);
+}
+
+void
+bandwidth_scheduler::rebalance()
+{
+    std::vector<usage> down(m_classes.size()), up(m_classes.size());
+
+    for (auto const &t : m_torrents) {
+        lt::torrent_status const &st = t.second.status;
+        if (!st.handle.is_valid() || (st.flags & lt::torrent_flags::paused))
+            continue;
+
+        usage &d = down[t.second.cls];
+        d.torrents++;
+        d.rate += st.download_payload_rate;
+        d.active |= st.state == lt::torrent_status::downloading ||
+                    st.state == lt::torrent_status::downloading_metadata;
+
+        usage &u = up[t.second.cls];
+        u.torrents++;
+        u.rate += st.upload_payload_rate;
+        u.active |= st.num_peers > 0;
+    }
+
+    std::vector<int> down_limit(m_classes.size()), up_limit(m_classes.size());
+    for (std::size_t i = 0; i < m_classes.size(); i++) {
+        down_limit[i] = class_limit(i, down, m_total_down);
+        up_limit[i]   = class_limit(i, up, m_total_up);
+    }
+
+    // Split each class's limits evenly between its running torrents
+    for (auto &t : m_torrents) {
+        tagged &tt = t.second;
+        if (!tt.status.handle.is_valid()) continue;
+
+        int n  = std::max(down[tt.cls].torrents, 1);
+        int dl = down_limit[tt.cls] < 0 ? -1
+                                        : std::max(down_limit[tt.cls] / n, 1024);
+        n      = std::max(up[tt.cls].torrents, 1);
+        int ul = up_limit[tt.cls] < 0 ? -1 : std::max(up_limit[tt.cls] / n, 1024);
+
+        if (dl != tt.down_limit) t.first.set_download_limit(tt.down_limit = dl);
+        if (ul != tt.up_limit) t.first.set_upload_limit(tt.up_limit = ul);
+    }
+}
@@ -0,0 +1,83 @@
+//
+// bwclass.hpp --- Share bandwidth between classes of traffic
+//
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <libtorrent/alert.hpp>
+#include <libtorrent/settings_pack.hpp>
+#include <libtorrent/torrent_handle.hpp>
+#include <libtorrent/torrent_status.hpp>
+
+#include "shard.hpp"
+
+struct bw_class {
+    std::string              name;
+    int                      share    = 0; // % of the total guaranteed while busy
+    int                      cap      = 0; // Bytes/s in each direction, 0: none
+    int                      priority = 1; // 1-255; higher gets spare bandwidth first
+    std::vector<std::string> ranges;       // Peer IP ranges in this class
+};
+
+// Parse "NAME[:share=PCT][,cap=KiB][,priority=N]", as given to --bw-class
+bool parse_bw_class(char const *spec, bw_class &out);
+
+// Torrents are tagged with a class when they're added (see queue.hpp's
+// batch files) and peers by IP range. Untagged torrents belong to an
+// implicit "default" class with no share, no cap and priority 1.
+//
+// Peer ranges map directly onto libtorrent peer classes, which enforce
+// their cap and priority. libtorrent has no per-torrent peer classes, so
+// torrent classes are enforced by us: whenever fresh status arrives, each
+// class is given whatever is left of the total once every other busy class
+// has its guaranteed share (and higher priority classes whatever they're
+// using beyond it), capped, and split evenly between its active torrents
+// as per-torrent rate limits. An idle class reserves nothing, so a lone
+// busy class can use the whole link.
+class bandwidth_scheduler {
+public:
+    // TOTAL_DOWN and TOTAL_UP are the link's capacity in bytes/s. Shares
+    // need them to mean anything; 0 leaves only caps and priorities.
+    bandwidth_scheduler(std::vector<bw_class> classes, int total_down,
+                        int total_up);
+
+    // Add the global rate limits to SETTINGS
+    void configure(lt::settings_pack &settings) const;
+
+    // Create the peer classes and IP filter in every shard. Returns false
+    // if a range doesn't parse.
+    bool setup(session_pool &sessions);
+
+    // Returns false if there's no class called NAME
+    bool add(lt::torrent_handle const &h, std::string const &name);
+    void forget(lt::torrent_handle const &h);
+
+    // Feed every alert through here; limits are recomputed whenever a
+    // state_update_alert brings fresh status
+    void handle_alert(lt::alert const *a);
+
+private:
+    struct usage {
+        bool   active = false;
+        int    torrents = 0;
+        double rate     = 0;
+    };
+
+    struct tagged {
+        std::size_t        cls;
+        int                down_limit = -1, up_limit = -1; // Last set
+        lt::torrent_status status;
+    };
+
+    int  class_limit(std::size_t i, std::vector<usage> const &use,
+                     int total) const;
+    void rebalance();
+
+    std::vector<bw_class> m_classes;
+    int                   m_total_down, m_total_up;
+    std::unordered_map<lt::torrent_handle, tagged> m_torrents;
+};
@@ -0,0 +1,142 @@
+//
+// config.cpp --- Settings that used to need a recompile.
+//
+// libtorrent already knows every setting by name (setting_by_name), and
+// its type from the bits of its index, so a config file can set any of
+// them without us keeping a list.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include <libtorrent/session.hpp>
+
+#include "config.hpp"
+
+bool
+load_profile(char const *name, lt::settings_pack &settings)
+{
+    if (!strcmp(name, "seedbox")) {
+        settings = lt::high_performance_seed();
+    } else if (!strcmp(name, "batch")) {
+        // Keep the big disk queue and request pipelines, but spend fewer
+        // unchoke slots on uploading and open connections faster
+        settings = lt::high_performance_seed();
+        settings.set_int(lt::settings_pack::unchoke_slots_limit, 16);
+        settings.set_int(lt::settings_pack::connection_speed, 200);
+        settings.set_int(lt::settings_pack::max_out_request_queue, 1500);
+        settings.set_int(lt::settings_pack::request_queue_time, 5);
+        settings.set_bool(lt::settings_pack::prioritize_partial_pieces, true);
+    } else if (!strcmp(name, "edge")) {
+        settings = lt::min_memory_usage();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static std::string
+trim(std::string const &s)
+{
+    auto first = s.find_first_not_of(" \t\r");
+    auto last  = s.find_last_not_of(" \t\r");
+    return first == std::string::npos ? "" : s.substr(first, last - first + 1);
+}
+
+static bool
+parse_bool(std::string const &v, bool &out)
+{
+    for (char const *t : {"true", "yes", "on", "1"}) {
+        if (v != t) continue;
+        out = true;
+        return true;
+    }
+    for (char const *f : {"false", "no", "off", "0"}) {
+        if (v != f) continue;
+        out = false;
+        return true;
+    }
+    return false;
+}
+
+static bool
+parse_int(std::string const &v, int &out)
+{
+    char *end;
+    errno = 0;
+    long long n = strtoll(v.c_str(), &end, 0);
+    if (end == v.c_str() || errno) return false;
+
+    switch (*end) {
+    case 'g': case 'G': n *= 1024; [[fallthrough]];
+    case 'm': case 'M': n *= 1024; [[fallthrough]];
+    case 'k': case 'K': n *= 1024; end++; break;
+    }
+    if (*end != '\0' || n < std::numeric_limits<int>::min() ||
+        n > std::numeric_limits<int>::max()) return false;
+    out = static_cast<int>(n);
+    return true;
+}
+
+bool
+parse_setting(std::string const &line, lt::settings_pack &settings)
+{
+    auto eq = line.find('=');
+    std::string name  = trim(line.substr(0, eq));
+    std::string value = eq == std::string::npos ? "" : trim(line.substr(eq + 1));
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+        value = value.substr(1, value.size() - 2);
+
+    int key = lt::setting_by_name(name);
+    if (eq == std::string::npos || key < 0) {
+        std::cerr << "No such setting: " << name << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    switch (key & lt::settings_pack::type_mask) {
+    case lt::settings_pack::string_type_base:
+        settings.set_str(key, value);
+        break;
+    case lt::settings_pack::int_type_base: {
+        int n = 0;
+        if ((ok = parse_int(value, n))) settings.set_int(key, n);
+        break;
+    }
+    case lt::settings_pack::bool_type_base: {
+        bool b = false;
+        if ((ok = parse_bool(value, b))) settings.set_bool(key, b);
+        break;
+    }
+    }
+    if (!ok) std::cerr << "Bad value for " << name << ": " << value << std::endl;
+    return ok;
+}
+
+bool
+load_config(char const *path, lt::settings_pack &settings)
+{
+    std::ifstream in(path);
+    if (!in) {
+        perror(path);
+        return false;
+    }
+
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';' || line[0] == '[')
+            continue;
+        if (!parse_setting(line, settings)) {
+            std::cerr << path << ":" << n << ": expected NAME = VALUE"
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
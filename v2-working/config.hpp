@@ -0,0 +1,27 @@
+//
+// config.hpp --- Build a settings_pack from profiles, files and flags
+//
+
+#pragma once
+
+#include <string>
+
+#include <libtorrent/settings_pack.hpp>
+
+// Replace SETTINGS with the named profile:
+//   seedbox  libtorrent's high_performance_seed(), for serving many peers
+//   batch    the same, tuned for downloading many torrents at once
+//   edge     libtorrent's min_memory_usage(), for small containers
+// Returns false if NAME isn't one of them.
+bool load_profile(char const *name, lt::settings_pack &settings);
+
+// Apply "NAME=VALUE" to SETTINGS, where NAME is any settings_pack key.
+// Integers may end in k, m or g (times 1024 each); booleans are
+// true/false, yes/no, on/off or 1/0. Returns false with a message on
+// stderr if the key is unknown or the value doesn't fit it.
+bool parse_setting(std::string const &line, lt::settings_pack &settings);
+
+// Apply every NAME = VALUE line in PATH to SETTINGS. Blank lines, lines
+// starting with # or ; and [section] headers are ignored, and values may
+// be quoted. Returns false if it can't be read or a line doesn't parse.
+bool load_config(char const *path, lt::settings_pack &settings);
@@ -0,0 +1,300 @@
+//
+// create.cpp --- Parallel .torrent creation.
+//
+// lt::set_piece_hashes() reads and hashes the payload one piece at a time.
+// Instead, a pool of threads claims runs of consecutive pieces and reads
+// each piece with as few large pread(2)s as its files allow, so every core
+// is hashing while the disk streams sequentially. The results go into plain
+// arrays and are only handed to lt::create_torrent, which isn't thread-safe,
+// once every worker is done.
+//
+// v2 piece hashes are the root of a merkle tree over the piece's 16 KiB
+// blocks, padded with zero hashes, as BEP 52 describes. In v2 and hybrid
+// torrents each file starts on a piece boundary, so a piece only ever holds
+// one real file followed by padding.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libtorrent/bencode.hpp>
+#include <libtorrent/create_torrent.hpp>
+#include <libtorrent/file_storage.hpp>
+#include <libtorrent/hasher.hpp>
+
+#include "create.hpp"
+
+// Consecutive pieces a worker claims at once, so that each thread's reads
+// stay sequential
+static int const batch_pieces = 16;
+static int const block_size   = 16 * 1024;
+
+namespace {
+
+// Where a piece's v2 hash goes: which file, and which piece of that file
+struct v2_hash {
+    lt::file_index_t file{0};
+    int              piece = -1; // -1 if the piece is all padding
+    lt::sha256_hash  root;
+};
+
+struct hash_job {
+    lt::file_storage const &      files;
+    std::vector<int>              fds; // -1 for pad files
+    bool                          v1, v2;
+    std::vector<lt::sha1_hash>    v1_hashes;
+    std::vector<v2_hash>          v2_hashes;
+    std::atomic<int>              next_piece{0};
+    std::atomic<int>              hashed{0};
+    std::atomic<bool>             failed{false};
+
+    explicit hash_job(lt::file_storage const &fs) : files(fs) {}
+};
+
+} // namespace
+
+bool
+parse_torrent_format(char const *name, torrent_format &format)
+{
+    if (!strcmp(name, "v1")) format = torrent_format::v1;
+    else if (!strcmp(name, "v2")) format = torrent_format::v2;
+    else if (!strcmp(name, "hybrid")) format = torrent_format::hybrid;
+    else return false;
+    return true;
+}
+
+static lt::sha256_hash
+merkle_root(std::vector<lt::sha256_hash> &nodes, std::size_t width)
+{
+    nodes.resize(width); // Zero hashes beyond the end of the file
+    while (nodes.size() > 1) {
+        for (std::size_t i = 0; i < nodes.size() / 2; i++) {
+            lt::hasher256 h;
+            h.update(nodes[2 * i].data(), static_cast<int>(nodes[2 * i].size()));
+            h.update(nodes[2 * i + 1].data(),
+                     static_cast<int>(nodes[2 * i + 1].size()));
+            nodes[i] = h.final();
+        }
+        nodes.resize(nodes.size() / 2);
+    }
+    return nodes[0];
+}
+
+static std::size_t
+next_pow2(std::size_t n)
+{
+    std::size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Read PIECE into BUF, filling padding with zeros
+static bool
+read_piece(hash_job &job, lt::piece_index_t piece, char *buf, int size)
+{
+    std::int64_t off = 0;
+    for (auto const &slice : job.files.map_block(piece, 0, size)) {
+        char *dst = buf + off;
+        auto  len = static_cast<std::size_t>(slice.size);
+        int   fd  = job.fds[static_cast<int>(slice.file_index)];
+
+        if (fd < 0) {
+            memset(dst, 0, len);
+        } else {
+            for (std::size_t done = 0; done < len;) {
+                ssize_t n = pread(fd, dst + done, len - done,
+                                  static_cast<off_t>(slice.offset) +
+                                      static_cast<off_t>(done));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                done += static_cast<std::size_t>(n);
+            }
+        }
+        off += slice.size;
+    }
+    return true;
+}
+
+static void
+hash_piece(hash_job &job, lt::piece_index_t piece, char const *buf, int size,
+           std::vector<lt::sha256_hash> &blocks)
+{
+    int p = static_cast<int>(piece);
+    if (job.v1) job.v1_hashes[p] = lt::hasher(buf, size).final();
+    if (!job.v2) return;
+
+    // The real file's bytes in this piece, i.e. everything but the padding
+    int len = job.files.piece_size2(piece);
+    if (len <= 0) return;
+    lt::file_index_t file = job.files.file_index_at_piece(piece);
+
+    blocks.clear();
+    for (int off = 0; off < len; off += block_size)
+        blocks.push_back(lt::hasher256(buf + off,
+                                       std::min(block_size, len - off)).final());
+
+    // Files smaller than a piece only pad out to the next power of two
+    int per_piece = job.files.piece_length() / block_size;
+    int width     = std::min(per_piece, job.files.file_num_blocks(file));
+    auto first    = job.files.file_offset(file) / job.files.piece_length();
+
+    v2_hash &h = job.v2_hashes[static_cast<std::size_t>(p)];
+    h.file     = file;
+    h.piece    = p - static_cast<int>(first);
+    h.root     = merkle_root(blocks, next_pow2(static_cast<std::size_t>(width)));
+}
+
+static void
+hash_worker(hash_job &job)
+{
+    int                          num_pieces = job.files.num_pieces();
+    std::vector<char>            buf(job.files.piece_length());
+    std::vector<lt::sha256_hash> blocks;
+
+    for (;;) {
+        int first = job.next_piece.fetch_add(batch_pieces);
+        if (first >= num_pieces || job.failed) return;
+
+        int last = std::min(first + batch_pieces, num_pieces);
+        for (int p = first; p < last; p++) {
+            lt::piece_index_t piece{p};
+            int               size = job.files.piece_size(piece);
+            if (!read_piece(job, piece, buf.data(), size)) {
+                perror("pread");
+                job.failed = true;
+                return;
+            }
+            hash_piece(job, piece, buf.data(), size, blocks);
+            job.hashed++;
+        }
+    }
+}
+
+std::shared_ptr<lt::torrent_info>
+create_torrent_file(create_options &opts)
+{
+    namespace fs = std::filesystem;
+
+    // Trailing slashes would make the torrent's name empty
+    while (opts.path.size() > 1 && opts.path.back() == '/') opts.path.pop_back();
+    fs::path    path   = fs::absolute(opts.path);
+    std::string parent = path.parent_path().string();
+    opts.path          = path.string();
+
+    lt::file_storage fs_in;
+    lt::add_files(fs_in, path.string());
+    if (fs_in.num_files() == 0) {
+        std::cerr << "Nothing to put in a torrent at " << opts.path << std::endl;
+        return nullptr;
+    }
+
+    lt::create_flags_t flags{};
+    if (opts.format == torrent_format::v1) flags = lt::create_torrent::v1_only;
+    if (opts.format == torrent_format::v2) flags = lt::create_torrent::v2_only;
+    // libtorrent throws if it doesn't like the piece size, e.g. one that
+    // isn't a power of two in a v2 torrent
+    std::optional<lt::create_torrent> made;
+    try {
+        made.emplace(fs_in, opts.piece_size, flags);
+    } catch (std::exception const &e) {
+        std::cerr << "Can't make a torrent with those options: " << e.what()
+                  << std::endl;
+        return nullptr;
+    }
+    lt::create_torrent &ct = *made;
+    ct.set_creator("bitclient-lt");
+    for (std::size_t i = 0; i < opts.trackers.size(); i++)
+        ct.add_tracker(opts.trackers[i], static_cast<int>(i));
+
+    // The torrent's own copy has the pad files we need to hash around
+    hash_job job(ct.files());
+    job.v1 = opts.format != torrent_format::v2;
+    job.v2 = opts.format != torrent_format::v1;
+    job.v1_hashes.resize(static_cast<std::size_t>(ct.num_pieces()));
+    job.v2_hashes.resize(static_cast<std::size_t>(ct.num_pieces()));
+
+    bool ok = true;
+    for (lt::file_index_t f : job.files.file_range()) {
+        int fd = -1;
+        if (!job.files.pad_file_at(f)) {
+            std::string name = job.files.file_path(f, parent);
+            if ((fd = open(name.c_str(), O_RDONLY)) < 0) {
+                perror(name.c_str());
+                ok = false;
+            } else {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+        }
+        job.fds.push_back(fd);
+    }
+
+    if (ok) {
+        int threads = opts.threads;
+        if (threads <= 0)
+            threads = static_cast<int>(std::thread::hardware_concurrency());
+        std::vector<std::thread> pool;
+        for (int i = 0; i < std::max(threads, 1); i++)
+            pool.emplace_back(hash_worker, std::ref(job));
+
+        // Report progress while we wait
+        while (job.hashed < ct.num_pieces() && !job.failed) {
+            std::cerr << "\rHashed " << job.hashed << " of " << ct.num_pieces()
+                      << " pieces" << std::flush;
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+        for (auto &t : pool) t.join();
+        std::cerr << "\rHashed " << job.hashed << " of " << ct.num_pieces()
+                  << " pieces" << std::endl;
+        ok = !job.failed;
+    }
+
+    for (int fd : job.fds)
+        if (fd >= 0) close(fd);
+    if (!ok) return nullptr;
+
+    for (int p = 0; p < ct.num_pieces(); p++) {
+        if (job.v1) ct.set_hash(lt::piece_index_t{p}, job.v1_hashes[p]);
+        v2_hash const &h = job.v2_hashes[static_cast<std::size_t>(p)];
+        if (job.v2 && h.piece >= 0)
+            ct.set_hash2(h.file, lt::piece_index_t::diff_type{h.piece}, h.root);
+    }
+
+    std::vector<char> buf;
+    try {
+        lt::bencode(std::back_inserter(buf), ct.generate());
+    } catch (std::exception const &e) {
+        std::cerr << "Failed to generate the torrent: " << e.what() << std::endl;
+        return nullptr;
+    }
+
+    if (opts.output.empty()) opts.output = path.filename().string() + ".torrent";
+    FILE *out = fopen(opts.output.c_str(), "wb");
+    if (out == nullptr || fwrite(buf.data(), 1, buf.size(), out) != buf.size()) {
+        perror(opts.output.c_str());
+        if (out != nullptr) fclose(out);
+        return nullptr;
+    }
+    fclose(out);
+
+    lt::error_code ec;
+    auto ti = std::make_shared<lt::torrent_info>(buf, ec, lt::from_span);
+    if (ec) {
+        std::cerr << "Failed to load the new torrent: " << ec.message()
+                  << std::endl;
+        return nullptr;
+    }
+    return ti;
+}
@@ -0,0 +1,34 @@
+//
+// create.hpp --- Make .torrent files, hashing on every core
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libtorrent/torrent_info.hpp>
+
+enum class torrent_format {
+    v1,     // BEP 3 only: SHA-1 piece hashes
+    v2,     // BEP 52 only: per-file SHA-256 merkle trees
+    hybrid, // Both, so v1-only and v2-only clients can join the same swarm
+};
+
+struct create_options {
+    std::string              path;   // File or directory to publish
+    std::string              output; // Defaults to <name>.torrent
+    std::vector<std::string> trackers;
+    int                      piece_size = 0; // 0 lets libtorrent choose
+    int                      threads    = 0; // 0 means one per core
+    torrent_format           format     = torrent_format::hybrid;
+};
+
+// Parse the argument to --format. Returns false if NAME isn't one we know.
+bool parse_torrent_format(char const *name, torrent_format &format);
+
+// Hash OPTS.path and write its metainfo to OPTS.output, making the former
+// absolute and filling in the latter if it was empty. Returns the new
+// torrent, ready to seed from the parent of OPTS.path, or nullptr on failure.
+std::shared_ptr<lt::torrent_info> create_torrent_file(create_options &opts);
@@ -0,0 +1,93 @@
+//
+// files.cpp --- File selection through prioritize_files()
+//
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include <fnmatch.h>
+
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/download_priority.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+#include "files.hpp"
+
+bool
+file_selector::add_indices(char const *list)
+{
+    char *end;
+    for (char const *p = list; *p != '\0'; p = end + (*end == ',')) {
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) return false;
+        if (*end == '-') {
+            char const *q = end + 1;
+            last = strtol(q, &end, 10);
+            if (end == q || last < first) return false;
+        }
+        if (*end != ',' && *end != '\0') return false;
+        m_ranges.emplace_back(static_cast<int>(first), static_cast<int>(last));
+    }
+    return !m_ranges.empty();
+}
+
+bool
+file_selector::matches(std::vector<std::string> const &globs,
+                       std::string const &path) const
+{
+    auto slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+    for (std::string const &g : globs)
+        if (!fnmatch(g.c_str(), path.c_str(), 0) ||
+            !fnmatch(g.c_str(), name.c_str(), 0))
+            return true;
+    return false;
+}
+
+bool
+file_selector::wanted(lt::file_storage const &fs, lt::file_index_t i) const
+{
+    if (fs.pad_file_at(i)) return false;
+
+    std::string path = fs.file_path(i);
+    int         idx  = static_cast<int>(i);
+    bool        in   = m_include.empty() && m_ranges.empty();
+
+    in = in || matches(m_include, path);
+    for (auto const &r : m_ranges)
+        in = in || (idx >= r.first && idx <= r.second);
+    return in && !matches(m_exclude, path);
+}
+
+void
+file_selector::handle_alert(lt::alert const *a)
+{
+    auto md = lt::alert_cast<lt::metadata_received_alert>(a);
+    if (md == nullptr || !active()) return;
+    auto ti = md->handle.torrent_file();
+    if (!ti) return;
+
+    lt::file_storage const &fs = ti->files();
+    std::vector<lt::download_priority_t> prios(
+        static_cast<std::size_t>(fs.num_files()), lt::dont_download);
+    int          count = 0;
+    std::int64_t bytes = 0;
+
+    for (lt::file_index_t i : fs.file_range()) {
+        if (!wanted(fs, i)) continue;
+        prios[static_cast<std::size_t>(static_cast<int>(i))] = lt::default_priority;
+        count++;
+        bytes += fs.file_size(i);
+    }
+
+    if (count == 0)
+        std::cerr << "No files selected in " << ti->name()
+                  << "; nothing to download" << std::endl;
+    else
+        std::cerr << "Selected " << count << " of " << fs.num_files()
+                  << " files in " << ti->name() << " (" << (bytes >> 20)
+                  << " of " << (fs.total_size() >> 20) << " MiB)" << std::endl;
+    md->handle.prioritize_files(std::move(prios));
+}
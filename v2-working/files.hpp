@@ -0,0 +1,47 @@
+//
+// files.hpp --- Only download some of a torrent's files
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <libtorrent/alert.hpp>
+#include <libtorrent/file_storage.hpp>
+
+// A file is wanted if it matches an --include pattern or is in the --files
+// list (or there are neither), and doesn't match an --exclude pattern.
+// Patterns are shell globs, tried against the file's path in the torrent
+// and against its name alone, so "*.mkv" finds them in any directory.
+//
+// Magnets don't know their files until the metadata arrives, so that's
+// when the selection is applied. libtorrent then only requests pieces that
+// overlap wanted files, and the torrent counts as finished (see
+// queue.cpp) once those are done.
+class file_selector {
+public:
+    void include(std::string glob) { m_include.push_back(std::move(glob)); }
+    void exclude(std::string glob) { m_exclude.push_back(std::move(glob)); }
+    // Parse a list like "0,3,5-9" of file indices. Returns false if it
+    // doesn't make sense.
+    bool add_indices(char const *list);
+
+    // True if anything would be left out
+    bool active() const
+    {
+        return !m_include.empty() || !m_exclude.empty() || !m_ranges.empty();
+    }
+
+    bool wanted(lt::file_storage const &fs, lt::file_index_t i) const;
+
+    // Feed every alert through here
+    void handle_alert(lt::alert const *a);
+
+private:
+    bool matches(std::vector<std::string> const &globs,
+                 std::string const &path) const;
+
+    std::vector<std::string>         m_include, m_exclude;
+    std::vector<std::pair<int, int>> m_ranges; // Inclusive
+};
@@ -0,0 +1,106 @@
+//
+// memory.cpp --- A feedback loop from RSS to libtorrent's buffer limits.
+//
+// Most of a busy session's memory is the disk queue (blocks waiting to be
+// written), send buffers (blocks waiting for a peer's socket) and the
+// per-peer state itself, so those are what we turn. Above high_water of the
+// budget they shrink multiplicatively, below low_water they grow back
+// slowly, and in between they're left alone so we don't oscillate. Above
+// throttle_water the connection limit is pinned to what we already have.
+//
+
+#include <algorithm>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "memory.hpp"
+
+static double const low_water      = 0.70;
+static double const high_water     = 0.85;
+static double const throttle_water = 0.95;
+// Never squeeze below this share of the base limits
+static double const min_scale      = 1.0 / 16;
+
+static std::uint64_t
+resident_bytes()
+{
+    unsigned long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return static_cast<std::uint64_t>(resident) *
+           static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+memory_governor::memory_governor(std::uint64_t budget)
+    : m_budget(budget)
+{
+}
+
+void
+memory_governor::configure(lt::settings_pack &settings)
+{
+    // Whatever's been asked for, but no more than an eighth of the budget
+    // queued for disk and half of it waiting in send buffers
+    auto fit = [&settings](int name, std::uint64_t cap) {
+        auto want = static_cast<std::uint64_t>(settings.get_int(name));
+        return static_cast<int>(
+            std::max<std::uint64_t>(std::min(want, cap), 16384));
+    };
+    m_base_conns = std::max(
+        settings.get_int(lt::settings_pack::connections_limit), 10);
+    m_base_disk = fit(lt::settings_pack::max_queued_disk_bytes, m_budget / 8);
+    m_base_send = fit(lt::settings_pack::send_buffer_watermark,
+                      m_budget / 2 / static_cast<std::uint64_t>(m_base_conns));
+
+    lt::settings_pack mine = limits(0);
+    for (int name : {lt::settings_pack::max_queued_disk_bytes,
+                     lt::settings_pack::send_buffer_watermark,
+                     lt::settings_pack::send_buffer_low_watermark,
+                     lt::settings_pack::connections_limit})
+        settings.set_int(name, mine.get_int(name));
+}
+
+lt::settings_pack
+memory_governor::limits(int peers) const
+{
+    auto scaled = [this](int base, int floor) {
+        return std::max(static_cast<int>(base * m_scale), floor);
+    };
+
+    lt::settings_pack p;
+    p.set_int(lt::settings_pack::max_queued_disk_bytes, scaled(m_base_disk, 16384));
+    p.set_int(lt::settings_pack::send_buffer_watermark, scaled(m_base_send, 16384));
+    p.set_int(lt::settings_pack::send_buffer_low_watermark,
+              scaled(m_base_send, 16384) / 4);
+
+    int conns = scaled(m_base_conns, 10);
+    if (m_throttled) conns = std::min(conns, std::max(peers, 10));
+    p.set_int(lt::settings_pack::connections_limit, conns);
+    return p;
+}
+
+void
+memory_governor::tick(session_pool &sessions, int peers)
+{
+    if ((m_rss = resident_bytes()) == 0) return;
+    double use = static_cast<double>(m_rss) / static_cast<double>(m_budget);
+
+    double scale     = m_scale;
+    bool   throttled = use >= throttle_water;
+    if (use >= high_water)
+        scale = std::max(m_scale * 0.7, min_scale);
+    else if (use < low_water)
+        scale = std::min(m_scale * 1.1, 1.0);
+
+    if (scale == m_scale && throttled == m_throttled) return;
+    if (throttled != m_throttled)
+        fprintf(stderr, "RSS at %.0f%% of the budget, %s new connections\n",
+                use * 100, throttled ? "pausing" : "resuming");
+
+    m_scale     = scale;
+    m_throttled = throttled;
+    sessions.apply_settings(limits(peers));
+}
@@ -0,0 +1,44 @@
+//
+// memory.hpp --- Keep the process within a memory budget
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include <libtorrent/settings_pack.hpp>
+
+#include "shard.hpp"
+
+// libtorrent's buffers grow with the number of torrents and peers, and its
+// defaults don't know how much memory the container has. The governor
+// starts from settings sized to the budget, then watches RSS and scales
+// the disk queue, send buffers and peer counts down as it nears the budget
+// and back up when there's room again. Once RSS is close to the budget, no
+// new connections are made until it drops.
+class memory_governor {
+public:
+    explicit memory_governor(std::uint64_t budget);
+
+    // Size SETTINGS' buffer and queue limits for the budget. Call after
+    // everything else has had its say, e.g. use_storage().
+    void configure(lt::settings_pack &settings);
+
+    // Call every few seconds, with how many PEERS are connected. RSS comes
+    // from /proc/self/statm, so it needs no session stats.
+    void tick(session_pool &sessions, int peers);
+
+    std::uint64_t budget() const { return m_budget; }
+    std::uint64_t rss() const { return m_rss; }
+
+private:
+    lt::settings_pack limits(int peers) const;
+
+    std::uint64_t m_budget;
+    std::uint64_t m_rss       = 0;
+    double        m_scale     = 1;     // Share of the base limits we allow
+    bool          m_throttled = false; // No new connections
+    int           m_base_disk;         // Limits at m_scale == 1
+    int           m_base_send;
+    int           m_base_conns;
+};
@@ -0,0 +1,229 @@
+//
+// placement.cpp --- Choose a storage root for each torrent.
+//
+// Every root is scored by how long it would take to drain what's already
+// queued for it plus the new torrent, at the write rate we've seen it
+// sustain. That favours idle and fast devices, and spreads a batch across
+// all of them so their bandwidth adds up. Roots without room for the
+// torrent are only used if none have room. libtorrent doesn't tell us about
+// per-device write queues, so the bytes still to be downloaded to a root
+// stand in for its queue depth.
+//
+// Magnets don't know their size until the metadata arrives, so we place
+// them as if they were assumed_size and move them, while there's nothing to
+// move yet, if the real size turns out not to fit.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#include <sys/statvfs.h>
+
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/torrent_info.hpp>
+#include <libtorrent/torrent_status.hpp>
+
+#include "placement.hpp"
+
+// What we assume a root can write before we've measured it, in bytes/s
+static double const assumed_rate = 100e6;
+// What we assume a torrent holds before its metadata arrives, so that a
+// batch of magnets added at once doesn't all land on the same root
+static std::int64_t const assumed_size = std::int64_t(1) << 30;
+
+placement_engine::placement_engine(std::vector<std::string> roots,
+                                   int rebalance_pct)
+    : m_rebalance_pct(rebalance_pct)
+{
+    // libtorrent reports absolute save paths, so that's what we compare
+    for (auto const &path : roots) {
+        root r;
+        r.path = std::filesystem::absolute(path).lexically_normal().string();
+        if (r.path.size() > 1 && r.path.back() == '/') r.path.pop_back();
+        m_roots.push_back(std::move(r));
+    }
+    refresh();
+}
+
+void
+placement_engine::refresh()
+{
+    for (root &r : m_roots) {
+        struct statvfs st;
+        if (statvfs(r.path.c_str(), &st) < 0) {
+            perror(r.path.c_str());
+            r.capacity = r.free = 0;
+            continue;
+        }
+        r.capacity = static_cast<std::uint64_t>(st.f_blocks) * st.f_frsize;
+        r.free     = static_cast<std::uint64_t>(st.f_bavail) * st.f_frsize;
+    }
+}
+
+int
+placement_engine::pick(std::int64_t size, int exclude) const
+{
+    int    best = -1, roomiest = -1;
+    double best_drain = 0;
+    std::int64_t most_room = 0;
+
+    for (int i = 0; i < static_cast<int>(m_roots.size()); i++) {
+        if (i == exclude) continue;
+        root const  &r    = m_roots[static_cast<std::size_t>(i)];
+        std::int64_t room = static_cast<std::int64_t>(r.free) - r.pending;
+
+        if (roomiest < 0 || room > most_room) {
+            roomiest  = i;
+            most_room = room;
+        }
+        if (room < size) continue;
+
+        double rate  = r.rate > 0 ? r.rate : assumed_rate;
+        double drain = static_cast<double>(r.pending + size) / rate;
+        if (best < 0 || drain < best_drain) {
+            best       = i;
+            best_drain = drain;
+        }
+    }
+    return best >= 0 ? best : roomiest;
+}
+
+int
+placement_engine::find_root(std::string const &path) const
+{
+    for (std::size_t i = 0; i < m_roots.size(); i++)
+        if (m_roots[i].path == path) return static_cast<int>(i);
+    return -1;
+}
+
+std::string const &
+placement_engine::place(std::int64_t size)
+{
+    refresh();
+    int i = pick(size > 0 ? size : assumed_size);
+    return m_roots[static_cast<std::size_t>(i)].path;
+}
+
+void
+placement_engine::add(lt::torrent_handle const &h, std::string const &root,
+                      std::int64_t size)
+{
+    placed p;
+    if ((p.root = find_root(root)) < 0) return;
+    p.remaining = size > 0 ? size : assumed_size;
+    m_roots[static_cast<std::size_t>(p.root)].pending += p.remaining;
+    m_torrents.emplace(h, p);
+}
+
+void
+placement_engine::forget(lt::torrent_handle const &h)
+{
+    auto it = m_torrents.find(h);
+    if (it == m_torrents.end()) return;
+    m_roots[static_cast<std::size_t>(it->second.root)].pending -= it->second.remaining;
+    m_torrents.erase(it);
+}
+
+void
+placement_engine::move(lt::torrent_handle const &h, placed &p, int to)
+{
+    root &from = m_roots[static_cast<std::size_t>(p.root)];
+    root &dest = m_roots[static_cast<std::size_t>(to)];
+
+    std::cerr << "Moving " << h.status(lt::torrent_handle::query_name).name
+              << " from " << from.path << " to " << dest.path << std::endl;
+    from.pending -= p.remaining;
+    dest.pending += p.remaining;
+    p.root = to;
+    h.move_storage(dest.path);
+}
+
+void
+placement_engine::handle_alert(lt::alert const *a)
+{
+    if (auto md = lt::alert_cast<lt::metadata_received_alert>(a)) {
+        // Now we know how big it is, make sure it still fits where it is
+        auto it = m_torrents.find(md->handle);
+        auto ti = md->handle.torrent_file();
+        if (it == m_torrents.end() || !ti) return;
+
+        placed &p    = it->second;
+        root   &r    = m_roots[static_cast<std::size_t>(p.root)];
+        r.pending   -= p.remaining;
+        p.remaining  = ti->total_size();
+        r.pending   += p.remaining;
+
+        refresh();
+        if (static_cast<std::int64_t>(r.free) - r.pending < 0) {
+            int to = pick(p.remaining, p.root);
+            if (to >= 0) move(md->handle, p, to);
+        }
+
+    } else if (auto su = lt::alert_cast<lt::state_update_alert>(a)) {
+        std::vector<double> rates(m_roots.size(), 0);
+
+        for (lt::torrent_status const &st : su->status) {
+            auto it = m_torrents.find(st.handle);
+            if (it == m_torrents.end() || !st.has_metadata) continue;
+            it->second.remaining = st.total_wanted - st.total_wanted_done;
+            it->second.rate      = st.download_payload_rate;
+        }
+
+        for (root &r : m_roots) r.pending = 0;
+        for (auto const &t : m_torrents) {
+            std::size_t i = static_cast<std::size_t>(t.second.root);
+            m_roots[i].pending += t.second.remaining;
+            rates[i] += t.second.rate;
+        }
+
+        // Only learn from roots that were actually busy
+        for (std::size_t i = 0; i < m_roots.size(); i++) {
+            if (rates[i] <= 0) continue;
+            double &rate = m_roots[i].rate;
+            rate = rate > 0 ? 0.8 * rate + 0.2 * rates[i] : rates[i];
+        }
+
+    } else if (auto tf = lt::alert_cast<lt::torrent_finished_alert>(a)) {
+        auto it = m_torrents.find(tf->handle);
+        if (m_rebalance_pct <= 0 || it == m_torrents.end()) return;
+
+        // Finished torrents move off roots that are running out of space,
+        // to the root with the largest share free that it fits on
+        refresh();
+        placed &p = it->second;
+        root   &r = m_roots[static_cast<std::size_t>(p.root)];
+        auto share = [](root const &x) {
+            return x.capacity ? static_cast<double>(x.free) / x.capacity : 0.0;
+        };
+        if (share(r) * 100 >= m_rebalance_pct) return;
+
+        auto ti   = tf->handle.torrent_file();
+        auto size = ti ? static_cast<std::uint64_t>(ti->total_size()) : 0;
+        int  to   = -1;
+        for (std::size_t i = 0; i < m_roots.size(); i++) {
+            root const &c = m_roots[i];
+            if (static_cast<int>(i) == p.root || c.free < size) continue;
+            if (to < 0 || share(c) > share(m_roots[static_cast<std::size_t>(to)]))
+                to = static_cast<int>(i);
+        }
+        if (to >= 0 && share(m_roots[static_cast<std::size_t>(to)]) > share(r))
+            move(tf->handle, p, to);
+
+    } else if (auto sm = lt::alert_cast<lt::storage_moved_alert>(a)) {
+        auto it = m_torrents.find(sm->handle);
+        int  to = find_root(sm->storage_path());
+        if (it != m_torrents.end() && to >= 0) it->second.root = to;
+
+    } else if (auto sf = lt::alert_cast<lt::storage_moved_failed_alert>(a)) {
+        std::cerr << "Failed to move " << sf->torrent_name() << ": "
+                  << sf->error.message() << std::endl;
+
+        // It's still wherever it was before
+        auto it = m_torrents.find(sf->handle);
+        auto st = sf->handle.status(lt::torrent_handle::query_save_path);
+        int  at = find_root(st.save_path);
+        if (it != m_torrents.end() && at >= 0) it->second.root = at;
+    }
+}
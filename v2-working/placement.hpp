@@ -0,0 +1,57 @@
+//
+// placement.hpp --- Spread torrents across several storage roots
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <libtorrent/alert.hpp>
+#include <libtorrent/torrent_handle.hpp>
+
+class placement_engine {
+public:
+    // Place torrents under ROOTS. If REBALANCE_PCT is non-zero, a torrent
+    // that finishes on a root with less than that percentage free is moved
+    // to whichever root has the most room.
+    placement_engine(std::vector<std::string> roots, int rebalance_pct);
+
+    // Choose a root for a torrent of SIZE bytes (0 if not yet known).
+    // Returns the save path to use.
+    std::string const &place(std::int64_t size);
+    // Start tracking H, which was added under ROOT
+    void add(lt::torrent_handle const &h, std::string const &root,
+             std::int64_t size);
+    // Stop tracking H, e.g. once it has been removed
+    void forget(lt::torrent_handle const &h);
+
+    // Feed every alert through here
+    void handle_alert(lt::alert const *a);
+
+private:
+    struct root {
+        std::string   path;
+        std::uint64_t capacity = 0;
+        std::uint64_t free     = 0;
+        std::int64_t  pending  = 0; // Bytes still to be written here
+        double        rate     = 0; // Smoothed write rate while busy
+    };
+
+    struct placed {
+        int          root;
+        std::int64_t remaining = 0;
+        int          rate      = 0;
+    };
+
+    void refresh();
+    int  pick(std::int64_t size, int exclude = -1) const;
+    int  find_root(std::string const &path) const;
+    void move(lt::torrent_handle const &h, placed &p, int to);
+
+    std::vector<root> m_roots;
+    int               m_rebalance_pct;
+    std::unordered_map<lt::torrent_handle, placed> m_torrents;
+};
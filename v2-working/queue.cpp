@@ -0,0 +1,241 @@
+//
+// queue.cpp --- Queueing policy on top of libtorrent's auto-managed torrents
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <tuple>
+
+#include <libtorrent/alert_types.hpp>
+
+#include "queue.hpp"
+
+bool
+load_batch(char const *path, std::vector<queued_magnet> &out)
+{
+    std::ifstream in(path);
+    if (!in) {
+        perror(path);
+        return false;
+    }
+
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        std::istringstream words(line);
+        std::string        word;
+        queued_magnet      q;
+        bool               blank = true, bad = false;
+
+        while (!bad && words >> word && word[0] != '#') {
+            blank = false;
+            if (!word.compare(0, 9, "priority="))
+                q.priority = atoi(word.c_str() + 9);
+            else if (!word.compare(0, 9, "deadline="))
+                q.deadline = atoi(word.c_str() + 9);
+            else if (!word.compare(0, 6, "class="))
+                q.bw_class = word.substr(6);
+            else if (!word.compare(0, 7, "magnet:") && q.magnet.empty())
+                q.magnet = word;
+            else
+                bad = true;
+        }
+
+        if (blank) continue;
+        if (bad || q.magnet.empty()) {
+            std::cerr << path << ":" << n << ": expected "
+                      << "[priority=N] [deadline=SECS] [class=NAME] magnet" << std::endl;
+            return false;
+        }
+        out.push_back(std::move(q));
+    }
+    return true;
+}
+
+queue_manager::queue_manager(queue_options const &opts)
+    : m_opts(opts)
+{
+}
+
+void
+queue_manager::configure(lt::settings_pack &settings) const
+{
+    settings.set_int(lt::settings_pack::active_downloads, m_opts.active_downloads);
+    settings.set_int(lt::settings_pack::active_seeds, m_opts.active_seeds);
+    settings.set_int(lt::settings_pack::active_limit, m_opts.active_limit);
+
+    // Torrents that aren't moving any data don't take up a slot
+    settings.set_bool(lt::settings_pack::dont_count_slow_torrents, true);
+
+    // Let libtorrent rotate queued seeds by the same goals we retire them at
+    if (m_opts.seed_ratio > 0)
+        settings.set_int(lt::settings_pack::share_ratio_limit,
+                         static_cast<int>(m_opts.seed_ratio * 100));
+    if (m_opts.seed_secs > 0)
+        settings.set_int(lt::settings_pack::seed_time_limit, m_opts.seed_secs);
+}
+
+void
+queue_manager::add(lt::torrent_handle const &h, int priority, int deadline)
+{
+    entry e;
+    e.priority = priority;
+    e.deadline = deadline > 0
+                     ? clock::now() + std::chrono::seconds(deadline)
+                     : clock::time_point::max();
+    e.order    = m_added++;
+    m_torrents.emplace(h, std::move(e));
+}
+
+void
+queue_manager::forget(lt::torrent_handle const &h)
+{
+    m_torrents.erase(h);
+}
+
+void
+queue_manager::handle_alert(lt::alert const *a)
+{
+    auto su = lt::alert_cast<lt::state_update_alert>(a);
+    if (su == nullptr) return;
+
+    for (lt::torrent_status const &st : su->status) {
+        auto it = m_torrents.find(st.handle);
+        if (it == m_torrents.end()) continue;
+        it->second.status = st;
+        check_seed_goals(it->first, it->second);
+    }
+}
+
+// An active download that hasn't beaten the stall rate in stall_secs goes
+// to the back of the queue for a while, so that the auto-manager can give
+// its slot to a torrent that might do better
+void
+queue_manager::check_stalled(lt::torrent_handle const &h, entry &e,
+                             clock::time_point now)
+{
+    lt::torrent_status const &st = e.status;
+    bool active = !(st.flags & lt::torrent_flags::paused) &&
+                  (st.state == lt::torrent_status::downloading ||
+                   st.state == lt::torrent_status::downloading_metadata);
+
+    if (!active || st.download_payload_rate >= m_opts.stall_rate) {
+        e.slow_since = clock::time_point();
+        return;
+    }
+
+    if (e.slow_since == clock::time_point()) {
+        e.slow_since = now;
+    } else if (now - e.slow_since >= std::chrono::seconds(m_opts.stall_secs)) {
+        std::cerr << "Demoting stalled torrent " << st.name << std::endl;
+        e.demoted_until = now + std::chrono::seconds(m_opts.stall_secs) * 5;
+        e.slow_since    = clock::time_point();
+        h.queue_position_bottom();
+    }
+}
+
+// A finished torrent is retired once it has met its seed goals, or right
+// away if there aren't any
+void
+queue_manager::check_seed_goals(lt::torrent_handle const &h, entry &e)
+{
+    lt::torrent_status const &st = e.status;
+    if (e.retired || !st.is_finished) return;
+
+    if (has_seed_goals()) {
+        double ratio = static_cast<double>(st.all_time_upload) /
+                       static_cast<double>(std::max<std::int64_t>(st.total_wanted, 1));
+        bool ratio_met = m_opts.seed_ratio > 0 && ratio >= m_opts.seed_ratio;
+        bool time_met  = m_opts.seed_secs > 0 &&
+                        st.seeding_duration >= std::chrono::seconds(m_opts.seed_secs);
+        if (!ratio_met && !time_met) return;
+
+        std::cerr << "Reached seed goal for " << st.name << std::endl;
+        h.unset_flags(lt::torrent_flags::auto_managed);
+        h.pause();
+    }
+    e.retired = true;
+}
+
+// Put the unfinished torrents into queue order: anything with a deadline
+// first, soonest first, then by priority and finally by the order they were
+// added. Stalled torrents sit at the back until their demotion runs out.
+// Each shard is a session with a queue of its own, so each is ordered on
+// its own.
+void
+queue_manager::reorder(session_pool const &sessions)
+{
+    auto now = clock::now();
+    std::vector<std::vector<std::pair<lt::torrent_handle, entry const *>>> queues(
+        sessions.size());
+    for (auto const &t : m_torrents)
+        if (t.second.status.handle.is_valid() && !t.second.status.is_finished)
+            queues[sessions.shard_of(t.first)].emplace_back(t.first, &t.second);
+
+    auto key = [now](entry const *e) {
+        return std::make_tuple(e->demoted_until > now, e->deadline,
+                               -e->priority, e->order);
+    };
+    for (auto &queue : queues) {
+        std::sort(queue.begin(), queue.end(), [&](auto const &a, auto const &b) {
+            return key(a.second) < key(b.second);
+        });
+
+        // Moving a torrent shifts the others, so only touch the queue if
+        // the order is actually wrong, and then set every position top to
+        // bottom
+        bool sorted = true;
+        for (std::size_t i = 1; i < queue.size() && sorted; i++)
+            sorted = queue[i - 1].second->status.queue_position <
+                     queue[i].second->status.queue_position;
+        if (sorted) continue;
+
+        for (std::size_t i = 0; i < queue.size(); i++)
+            queue[i].first.queue_position_set(
+                lt::queue_position_t{static_cast<int>(i)});
+    }
+}
+
+// A state_update_alert leaves out torrents whose status hasn't changed, and
+// one that has stalled completely is exactly such a torrent, so the stall
+// check runs here over all of them, on the last status each one reported
+void
+queue_manager::tick(session_pool &sessions)
+{
+    auto now = clock::now();
+    for (auto &t : m_torrents)
+        if (t.second.status.handle.is_valid())
+            check_stalled(t.first, t.second, now);
+    reorder(sessions);
+    sessions.post_torrent_updates();
+}
+
+std::int64_t
+queue_manager::total_downloaded() const
+{
+    std::int64_t total = 0;
+    for (auto const &t : m_torrents) total += t.second.status.total_payload_download;
+    return total;
+}
+
+int
+queue_manager::peers() const
+{
+    int total = 0;
+    for (auto const &t : m_torrents) total += t.second.status.num_peers;
+    return total;
+}
+
+bool
+queue_manager::done() const
+{
+    if (m_torrents.empty()) return false;
+    for (auto const &t : m_torrents)
+        if (!t.second.retired) return false;
+    return true;
+}
@@ -0,0 +1,98 @@
+//
+// queue.hpp --- Decide which of many torrents get to run at once
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <libtorrent/alert.hpp>
+#include <libtorrent/settings_pack.hpp>
+#include <libtorrent/torrent_handle.hpp>
+#include <libtorrent/torrent_status.hpp>
+
+#include "shard.hpp"
+
+struct queue_options {
+    int   active_downloads = 8;     // Torrents downloading at once
+    int   active_seeds     = 8;     // Torrents seeding at once
+    int   active_limit     = 16;    // Both together
+    int   stall_rate       = 10240; // Bytes/s an active download must beat...
+    int   stall_secs       = 120;   // ...at least once in this long
+    float seed_ratio       = 0;     // Stop seeding at this ratio (0: never)
+    int   seed_secs        = 0;     // Or after this long (0: never)
+};
+
+// A line of a --batch file: "[priority=N] [deadline=SECS] [class=NAME] magnet"
+struct queued_magnet {
+    std::string magnet;
+    int         priority = 0; // Higher runs first
+    int         deadline = 0; // Seconds from now; 0 means none
+    std::string bw_class;     // See bwclass.hpp; empty means default
+};
+
+// Append the magnets in PATH to OUT. Returns false if it can't be read or
+// a line doesn't make sense.
+bool load_batch(char const *path, std::vector<queued_magnet> &out);
+
+// libtorrent's auto-manager keeps at most active_downloads/active_seeds
+// torrents running and starts the next one in queue order when a slot
+// frees up. We keep that order sorted by deadline and priority, push
+// torrents that have stalled to the back so something else gets their slot,
+// and retire seeds once they reach their goals.
+class queue_manager {
+public:
+    explicit queue_manager(queue_options const &opts);
+
+    // Add the auto-manager and seed-goal settings to SETTINGS
+    void configure(lt::settings_pack &settings) const;
+
+    void add(lt::torrent_handle const &h, int priority, int deadline);
+    void forget(lt::torrent_handle const &h);
+    std::size_t size() const { return m_torrents.size(); }
+
+    // Feed every alert through here, to keep each torrent's status fresh
+    void handle_alert(lt::alert const *a);
+
+    // Call every few seconds, or whenever something has changed, to apply
+    // the policy and ask for fresh status
+    void tick(session_pool &sessions);
+
+    bool has_seed_goals() const
+    {
+        return m_opts.seed_ratio > 0 || m_opts.seed_secs > 0;
+    }
+
+    // Payload bytes downloaded by every torrent, as of the last update
+    std::int64_t total_downloaded() const;
+    // Peers connected to every torrent, as of the last update
+    int peers() const;
+
+    // True once every torrent has finished downloading and met its seed goals
+    bool done() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct entry {
+        int               priority;
+        clock::time_point deadline;    // max() if there's none
+        unsigned          order;       // Order added, to break ties
+        clock::time_point slow_since;  // When it last dropped below the stall rate
+        clock::time_point demoted_until;
+        bool              retired = false;
+        lt::torrent_status status;
+    };
+
+    void reorder(session_pool const &sessions);
+    void check_stalled(lt::torrent_handle const &h, entry &e, clock::time_point now);
+    void check_seed_goals(lt::torrent_handle const &h, entry &e);
+
+    queue_options m_opts;
+    unsigned      m_added = 0;
+    std::unordered_map<lt::torrent_handle, entry> m_torrents;
+};
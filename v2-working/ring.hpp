@@ -0,0 +1,64 @@
+//
+// ring.hpp --- A fixed-size, lock-free, single-producer single-consumer queue
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// N must be a power of two. Exactly one thread may push and exactly one
+// (possibly different) thread may pop. Neither ever blocks or allocates.
+template <typename T, std::size_t N>
+class spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+    // Returns nullptr if the ring is full. Fill in the slot, then commit().
+    T *
+    claim()
+    {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail_cache == N) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head - m_tail_cache == N) return nullptr;
+        }
+        return &m_slots[head & (N - 1)];
+    }
+
+    void
+    commit()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+    }
+
+    // Returns nullptr if the ring is empty. Read the slot, then release().
+    T *
+    front()
+    {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head_cache) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail == m_head_cache) return nullptr;
+        }
+        return &m_slots[tail & (N - 1)];
+    }
+
+    void
+    release()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+    }
+
+private:
+    // Keep each side's index on its own cache line so the producer and
+    // consumer don't bounce them back and forth
+    alignas(64) std::atomic<std::size_t> m_head{0};
+    std::size_t                          m_tail_cache = 0; // Producer's view
+    alignas(64) std::atomic<std::size_t> m_tail{0};
+    std::size_t                          m_head_cache = 0; // Consumer's view
+    alignas(64) std::array<T, N>         m_slots;
+};
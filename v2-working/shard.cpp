@@ -0,0 +1,195 @@
+//
+// shard.cpp --- A pool of sessions that looks like one.
+//
+// Each shard listens on its own port. SO_REUSEPORT would let them share
+// one, but the kernel spreads incoming connections by address hash, not by
+// which torrent the peer wants, so most would land on a shard that doesn't
+// have it. With a port each, every shard announces its own port for the
+// torrents it owns and peers connect straight to the right one.
+//
+// Torrents are placed by the first bytes of their info-hash, which are
+// uniformly distributed, so a large batch spreads evenly. A magnet that
+// only carries a v1 hash may gain a v2 hash with its metadata, so we
+// remember each torrent's shard rather than recomputing it.
+//
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/session_stats.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+#include "shard.hpp"
+
+// Settings that bound the whole process rather than one session
+static int const budgets[] = {
+    lt::settings_pack::download_rate_limit,
+    lt::settings_pack::upload_rate_limit,
+    lt::settings_pack::connections_limit,
+    lt::settings_pack::active_downloads,
+    lt::settings_pack::active_seeds,
+    lt::settings_pack::active_limit,
+    lt::settings_pack::aio_threads,
+    lt::settings_pack::hashing_threads,
+    lt::settings_pack::max_queued_disk_bytes,
+};
+
+session_pool::session_pool(lt::session_params const &params, int shards,
+                           int port)
+    : m_count(shards), m_port(port)
+{
+    for (int i = 0; i < shards; i++) {
+        lt::session_params sp = params;
+        split(sp.settings);
+        if (port > 0) listen_on(sp.settings, static_cast<std::size_t>(i));
+
+        m_shards.push_back(std::make_unique<lt::session>(std::move(sp)));
+        m_shards.back()->set_alert_notify([this] {
+            // Called on the shard's network thread; mustn't call into it
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending = true;
+            m_cv.notify_one();
+        });
+    }
+    m_counters.resize(m_shards.size());
+}
+
+void
+session_pool::split(lt::settings_pack &settings) const
+{
+    int n = m_count;
+    if (n <= 1) return;
+
+    // Round up, so that a limit never turns into 0, which usually means
+    // unlimited. Negative values already mean unlimited.
+    for (int name : budgets) {
+        int v = settings.get_int(name);
+        if (v > 0) settings.set_int(name, (v + n - 1) / n);
+    }
+}
+
+void
+session_pool::listen_on(lt::settings_pack &settings, std::size_t shard) const
+{
+    std::string p = std::to_string(m_port + static_cast<int>(shard));
+    settings.set_str(lt::settings_pack::listen_interfaces,
+                     "0.0.0.0:" + p + ",[::]:" + p);
+}
+
+std::size_t
+session_pool::shard_of(lt::info_hash_t const &ih) const
+{
+    std::uint64_t x;
+    lt::sha1_hash h = ih.get_best();
+    std::memcpy(&x, h.data(), sizeof x);
+    return static_cast<std::size_t>(x % m_shards.size());
+}
+
+lt::torrent_handle
+session_pool::add_torrent(lt::add_torrent_params params)
+{
+    lt::info_hash_t ih = params.ti ? params.ti->info_hashes()
+                                   : params.info_hashes;
+    std::size_t i = shard_of(ih);
+    lt::torrent_handle h = m_shards[i]->add_torrent(std::move(params));
+    m_owner[h] = i;
+    return h;
+}
+
+std::size_t
+session_pool::shard_of(lt::torrent_handle const &h) const
+{
+    auto it = m_owner.find(h);
+    return it == m_owner.end() ? 0 : it->second;
+}
+
+void
+session_pool::remove_torrent(lt::torrent_handle const &h)
+{
+    auto it = m_owner.find(h);
+    if (it == m_owner.end()) return;
+    m_shards[it->second]->remove_torrent(h);
+    m_owner.erase(it);
+}
+
+void
+session_pool::apply_settings(lt::settings_pack settings)
+{
+    split(settings);
+
+    // Shards can't share a port, so new interfaces get each shard's own
+    // port back, or are ignored if there's no --port to derive one from
+    bool listen = settings.has_val(lt::settings_pack::listen_interfaces);
+    if (listen && m_port <= 0 && m_shards.size() > 1) {
+        std::cerr << "Ignoring listen_interfaces with more than one shard; "
+                  << "use --port" << std::endl;
+        settings.clear(lt::settings_pack::listen_interfaces);
+        listen = false;
+    }
+    for (std::size_t i = 0; i < m_shards.size(); i++) {
+        if (listen && m_port > 0) listen_on(settings, i);
+        m_shards[i]->apply_settings(settings);
+    }
+}
+
+void
+session_pool::wait_for_alert(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait_for(lock, timeout, [this] { return m_pending; });
+    m_pending = false;
+}
+
+void
+session_pool::pop_alerts(std::vector<lt::alert *> *alerts)
+{
+    alerts->clear();
+    std::vector<lt::alert *> some;
+    for (std::size_t i = 0; i < m_shards.size(); i++) {
+        m_shards[i]->pop_alerts(&some);
+        for (lt::alert *a : some) {
+            if (auto ss = lt::alert_cast<lt::session_stats_alert>(a)) {
+                auto c = ss->counters();
+                m_counters[i].assign(c.begin(), c.end());
+            }
+        }
+        alerts->insert(alerts->end(), some.begin(), some.end());
+    }
+}
+
+void
+session_pool::post_torrent_updates()
+{
+    for (auto &s : m_shards) s->post_torrent_updates();
+}
+
+void
+session_pool::post_session_stats()
+{
+    for (auto &s : m_shards) s->post_session_stats();
+}
+
+std::int64_t
+session_pool::counter(char const *name) const
+{
+    int idx = lt::find_metric_idx(name);
+    if (idx < 0) return 0;
+
+    std::int64_t total = 0;
+    for (auto const &c : m_counters)
+        if (static_cast<std::size_t>(idx) < c.size())
+            total += c[static_cast<std::size_t>(idx)];
+    return total;
+}
+
+void
+session_pool::abort()
+{
+    // Each proxy blocks until its shard is gone, so start them all first
+    std::vector<lt::session_proxy> proxies;
+    for (auto &s : m_shards) proxies.push_back(s->abort());
+    proxies.clear();
+    m_shards.clear();
+}
@@ -0,0 +1,81 @@
+//
+// shard.hpp --- Run several sessions side by side, one torrent per shard
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <libtorrent/add_torrent_params.hpp>
+#include <libtorrent/alert.hpp>
+#include <libtorrent/info_hash.hpp>
+#include <libtorrent/session.hpp>
+#include <libtorrent/session_params.hpp>
+#include <libtorrent/settings_pack.hpp>
+#include <libtorrent/torrent_handle.hpp>
+
+// A session does all its peer-protocol work on one network thread, which
+// runs out of core long before a fast NIC runs out of bandwidth. A pool
+// runs several independent sessions instead, and gives each torrent to one
+// of them by info-hash. To the rest of the program it looks like a single
+// session: torrents are added and removed through it, and alerts from
+// every shard come out of one pop_alerts().
+class session_pool {
+public:
+    // Start SHARDS sessions from PARAMS. The session-wide budgets in its
+    // settings (rate, connection, active torrent, disk thread and disk
+    // queue limits) are split evenly between them, so the pool as a whole
+    // stays within them. If PORT is non-zero, shard i listens on PORT + i.
+    session_pool(lt::session_params const &params, int shards, int port);
+
+    std::size_t size() const { return m_shards.size(); }
+    lt::session &shard(std::size_t i) { return *m_shards[i]; }
+
+    // Add PARAMS to the shard that owns its info-hash
+    lt::torrent_handle add_torrent(lt::add_torrent_params params);
+    void remove_torrent(lt::torrent_handle const &h);
+    // Which shard H was added to. Queue positions are per shard.
+    std::size_t shard_of(lt::torrent_handle const &h) const;
+
+    // Apply SETTINGS to every shard, splitting budgets as above and
+    // keeping each shard on its own port
+    void apply_settings(lt::settings_pack settings);
+
+    // Wait until any shard has alerts, or TIMEOUT passes
+    void wait_for_alert(std::chrono::milliseconds timeout);
+    // Append every shard's pending alerts to ALERTS. As with a session,
+    // they're valid until the next call.
+    void pop_alerts(std::vector<lt::alert *> *alerts);
+
+    void post_torrent_updates();
+    // Ask every shard for its counters; see counter()
+    void post_session_stats();
+    // The sum of metric NAME over every shard, as of their last stats
+    std::int64_t counter(char const *name) const;
+
+    // Shut every shard down at once, and wait for them all
+    void abort();
+
+private:
+    std::size_t shard_of(lt::info_hash_t const &ih) const;
+    void        split(lt::settings_pack &settings) const;
+    // Listen on m_port + SHARD
+    void        listen_on(lt::settings_pack &settings, std::size_t shard) const;
+
+    // Set from the sessions' threads when an alert queue becomes non-empty
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+    bool                    m_pending = false;
+
+    int                                       m_count;
+    int                                       m_port; // 0 if not given
+    std::vector<std::unique_ptr<lt::session>> m_shards;
+    std::vector<std::vector<std::int64_t>>    m_counters; // Per shard
+    std::unordered_map<lt::torrent_handle, std::size_t> m_owner;
+};
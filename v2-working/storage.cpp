@@ -0,0 +1,378 @@
+//
+// storage.cpp --- Disk I/O backends for the session.
+//
+// libtorrent already ships mmap and pread/pwrite backends, so for those we
+// only pick the constructor and size the disk thread pools. The in-memory
+// backend is our own disk_interface, modelled on libtorrent's
+// custom_storage example: every piece is a buffer owned by the storage, so
+// reads hand out pointers into it without copying. That takes the file
+// system out of the picture entirely, which is handy for benchmarks and for
+// streaming jobs that never need the data on disk.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/post.hpp>
+
+#include <libtorrent/aux_/vector.hpp>
+#include <libtorrent/disk_buffer_holder.hpp>
+#include <libtorrent/disk_interface.hpp>
+#include <libtorrent/error_code.hpp>
+#include <libtorrent/file_storage.hpp>
+#include <libtorrent/hasher.hpp>
+#include <libtorrent/io_context.hpp>
+#include <libtorrent/mmap_disk_io.hpp>
+#include <libtorrent/posix_disk_io.hpp>
+#include <libtorrent/settings_pack.hpp>
+
+#include "storage.hpp"
+
+namespace {
+
+lt::storage_error
+read_error()
+{
+    lt::storage_error se;
+    se.operation = lt::operation_t::file_read;
+    se.ec        = boost::asio::error::eof;
+    return se;
+}
+
+lt::storage_error
+unsupported()
+{
+    return lt::storage_error(lt::error_code(
+        boost::system::errc::operation_not_supported, lt::system_category()));
+}
+
+// One torrent's pieces, each allocated in full the first time any block of
+// it is written so that pointers we've handed out never move
+class memory_storage {
+public:
+    explicit memory_storage(lt::file_storage const &fs) : m_files(fs) {}
+
+    lt::span<char const>
+    read(lt::peer_request const &r, lt::storage_error &se) const
+    {
+        auto it = m_pieces.find(r.piece);
+        if (it == m_pieces.end() || static_cast<int>(it->second.size()) <= r.start) {
+            se = read_error();
+            return {};
+        }
+        int len = std::min(r.length, static_cast<int>(it->second.size()) - r.start);
+        return {it->second.data() + r.start, len};
+    }
+
+    void
+    write(lt::span<char const> buf, lt::piece_index_t piece, int offset)
+    {
+        auto &data = m_pieces[piece];
+        if (data.empty())
+            data.resize(static_cast<std::size_t>(m_files.piece_size(piece)));
+        std::size_t len = std::min(static_cast<std::size_t>(buf.size()),
+                                   data.size() - static_cast<std::size_t>(offset));
+        memcpy(data.data() + offset, buf.data(), len);
+    }
+
+    // SHA-1 of the whole piece, plus the SHA-256 of each block if this is a
+    // v2 torrent and BLOCK_HASHES wants them
+    lt::sha1_hash
+    hash(lt::piece_index_t piece, lt::span<lt::sha256_hash> block_hashes,
+         lt::storage_error &se) const
+    {
+        auto it = m_pieces.find(piece);
+        if (it == m_pieces.end()) {
+            se = read_error();
+            return {};
+        }
+
+        char const *buf = it->second.data();
+        int         len = m_files.piece_size2(piece);
+        for (int k = 0, off = 0; k < static_cast<int>(block_hashes.size()) &&
+                                 off < len; k++) {
+            int n = std::min(lt::default_block_size, len - off);
+            block_hashes[k] = lt::hasher256(buf + off, n).final();
+            off += n;
+        }
+        return lt::hasher(it->second).final();
+    }
+
+    lt::sha256_hash
+    hash2(lt::piece_index_t piece, int offset, lt::storage_error &se) const
+    {
+        auto it = m_pieces.find(piece);
+        if (it == m_pieces.end()) {
+            se = read_error();
+            return {};
+        }
+        int n = std::min(lt::default_block_size,
+                         m_files.piece_size2(piece) - offset);
+        return lt::hasher256(it->second.data() + offset, n).final();
+    }
+
+private:
+    lt::file_storage const &m_files;
+    std::map<lt::piece_index_t, std::vector<char>> m_pieces;
+};
+
+// Every job completes immediately; the handlers are posted back to the
+// network thread as libtorrent expects
+class memory_disk_io final : public lt::disk_interface,
+                             public lt::buffer_allocator_interface {
+public:
+    explicit memory_disk_io(lt::io_context &ioc) : m_ioc(ioc) {}
+
+    lt::storage_holder
+    new_torrent(lt::storage_params const &p,
+                std::shared_ptr<void> const &) override
+    {
+        lt::storage_index_t idx = m_torrents.end_index();
+        if (!m_free_slots.empty()) {
+            idx = m_free_slots.back();
+            m_free_slots.pop_back();
+        }
+
+        auto storage = std::make_unique<memory_storage>(p.files);
+        if (idx == m_torrents.end_index())
+            m_torrents.emplace_back(std::move(storage));
+        else
+            m_torrents[idx] = std::move(storage);
+        return lt::storage_holder(idx, *this);
+    }
+
+    void
+    remove_torrent(lt::storage_index_t idx) override
+    {
+        m_torrents[idx].reset();
+        m_free_slots.push_back(idx);
+    }
+
+    // The buffer belongs to the storage and stays valid for as long as the
+    // torrent is in the session, so there's nothing for the holder to free
+    void
+    async_read(lt::storage_index_t storage, lt::peer_request const &r,
+               std::function<void(lt::disk_buffer_holder,
+                                  lt::storage_error const &)> handler,
+               lt::disk_job_flags_t) override
+    {
+        lt::storage_error    se;
+        lt::span<char const> buf = m_torrents[storage]->read(r, se);
+        boost::asio::post(m_ioc, [=] {
+            handler(lt::disk_buffer_holder(*this, const_cast<char *>(buf.data()),
+                                           static_cast<int>(buf.size())),
+                    se);
+        });
+    }
+
+    bool
+    async_write(lt::storage_index_t storage, lt::peer_request const &r,
+                char const *buf, std::shared_ptr<lt::disk_observer>,
+                std::function<void(lt::storage_error const &)> handler,
+                lt::disk_job_flags_t) override
+    {
+        m_torrents[storage]->write({buf, r.length}, r.piece, r.start);
+        boost::asio::post(m_ioc, [=] { handler(lt::storage_error()); });
+        return false; // Never ask the peer to back off
+    }
+
+    void
+    async_hash(lt::storage_index_t storage, lt::piece_index_t piece,
+               lt::span<lt::sha256_hash> block_hashes, lt::disk_job_flags_t,
+               std::function<void(lt::piece_index_t, lt::sha1_hash const &,
+                                  lt::storage_error const &)> handler) override
+    {
+        lt::storage_error se;
+        lt::sha1_hash     h = m_torrents[storage]->hash(piece, block_hashes, se);
+        boost::asio::post(m_ioc, [=] { handler(piece, h, se); });
+    }
+
+    void
+    async_hash2(lt::storage_index_t storage, lt::piece_index_t piece,
+                int offset, lt::disk_job_flags_t,
+                std::function<void(lt::piece_index_t, lt::sha256_hash const &,
+                                   lt::storage_error const &)> handler) override
+    {
+        lt::storage_error se;
+        lt::sha256_hash   h = m_torrents[storage]->hash2(piece, offset, se);
+        boost::asio::post(m_ioc, [=] { handler(piece, h, se); });
+    }
+
+    void
+    async_move_storage(lt::storage_index_t, std::string p, lt::move_flags_t,
+                       std::function<void(lt::status_t, std::string const &,
+                                          lt::storage_error const &)> handler)
+        override
+    {
+        boost::asio::post(m_ioc, [=] {
+            handler(lt::status_t::fatal_disk_error, p, unsupported());
+        });
+    }
+
+    void
+    async_release_files(lt::storage_index_t,
+                        std::function<void()> handler) override
+    {
+        if (handler) boost::asio::post(m_ioc, handler);
+    }
+
+    void
+    async_delete_files(lt::storage_index_t, lt::remove_flags_t,
+                       std::function<void(lt::storage_error const &)> handler)
+        override
+    {
+        boost::asio::post(m_ioc, [=] { handler(lt::storage_error()); });
+    }
+
+    // There's never anything already "on disk" to check
+    void
+    async_check_files(lt::storage_index_t, lt::add_torrent_params const *,
+                      lt::aux::vector<std::string, lt::file_index_t>,
+                      std::function<void(lt::status_t,
+                                         lt::storage_error const &)> handler)
+        override
+    {
+        boost::asio::post(m_ioc, [=] {
+            handler(lt::status_t::no_error, lt::storage_error());
+        });
+    }
+
+    void
+    async_rename_file(lt::storage_index_t, lt::file_index_t idx,
+                      std::string name,
+                      std::function<void(std::string const &, lt::file_index_t,
+                                         lt::storage_error const &)> handler)
+        override
+    {
+        boost::asio::post(m_ioc, [=] {
+            handler(name, idx, lt::storage_error());
+        });
+    }
+
+    void
+    async_stop_torrent(lt::storage_index_t,
+                       std::function<void()> handler) override
+    {
+        if (handler) boost::asio::post(m_ioc, handler);
+    }
+
+    // Every piece is kept whatever its priority, so just say so
+    void
+    async_set_file_priority(
+        lt::storage_index_t,
+        lt::aux::vector<lt::download_priority_t, lt::file_index_t> prio,
+        std::function<void(lt::storage_error const &,
+                           lt::aux::vector<lt::download_priority_t,
+                                           lt::file_index_t>)> handler) override
+    {
+        boost::asio::post(m_ioc, [=] { handler(lt::storage_error(), prio); });
+    }
+
+    void
+    async_clear_piece(lt::storage_index_t, lt::piece_index_t index,
+                      std::function<void(lt::piece_index_t)> handler) override
+    {
+        boost::asio::post(m_ioc, [=] { handler(index); });
+    }
+
+    void
+    free_disk_buffer(char *) override
+    {
+    }
+
+    void
+    update_stats_counters(lt::counters &) const override
+    {
+    }
+
+    std::vector<lt::open_file_state>
+    get_status(lt::storage_index_t) const override
+    {
+        return {};
+    }
+
+    void
+    abort(bool) override
+    {
+    }
+
+    void
+    submit_jobs() override
+    {
+    }
+
+    void
+    settings_updated() override
+    {
+    }
+
+private:
+    lt::io_context &m_ioc;
+    lt::aux::vector<std::unique_ptr<memory_storage>, lt::storage_index_t>
+                                     m_torrents;
+    std::vector<lt::storage_index_t> m_free_slots;
+};
+
+std::unique_ptr<lt::disk_interface>
+memory_disk_io_constructor(lt::io_context &ioc, lt::settings_interface const &,
+                           lt::counters &)
+{
+    return std::make_unique<memory_disk_io>(ioc);
+}
+
+} // namespace
+
+bool
+parse_storage_kind(char const *name, storage_kind &kind)
+{
+    static struct {
+        char const  *name;
+        storage_kind kind;
+    } const kinds[] = {
+        {"default", storage_kind::standard},
+        {"mmap", storage_kind::mmap},
+        {"posix", storage_kind::posix},
+        {"memory", storage_kind::memory},
+    };
+
+    for (auto const &k : kinds) {
+        if (!strcmp(name, k.name)) {
+            kind = k.kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+use_storage(storage_kind kind, lt::session_params &params)
+{
+    int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    switch (kind) {
+    case storage_kind::standard:
+        break;
+
+    case storage_kind::mmap:
+        // NVMe drives want lots of requests in flight, so give the page
+        // faults and hashing a thread per core and let more writes queue up
+        params.disk_io_constructor = lt::mmap_disk_io_constructor;
+        params.settings.set_int(lt::settings_pack::aio_threads, cores);
+        params.settings.set_int(lt::settings_pack::hashing_threads, cores);
+        params.settings.set_int(lt::settings_pack::max_queued_disk_bytes,
+                                64 * 1024 * 1024);
+        break;
+
+    case storage_kind::posix:
+        params.disk_io_constructor = lt::posix_disk_io_constructor;
+        break;
+
+    case storage_kind::memory:
+        params.disk_io_constructor = memory_disk_io_constructor;
+        break;
+    }
+}
@@ -0,0 +1,20 @@
+//
+// storage.hpp --- Choose where the session keeps the pieces it downloads
+//
+
+#pragma once
+
+#include <libtorrent/session_params.hpp>
+
+enum class storage_kind {
+    standard, // Whatever libtorrent thinks is best on this platform
+    mmap,     // Memory-mapped files with disk threads sized for fast SSDs
+    posix,    // Plain pread(2)/pwrite(2), for filesystems that hate mmap
+    memory,   // Nothing touches the disk; pieces live in RAM until exit
+};
+
+// Parse the argument to --storage. Returns false if NAME isn't one we know.
+bool parse_storage_kind(char const *name, storage_kind &kind);
+
+// Install KIND's disk I/O constructor and settings into PARAMS
+void use_storage(storage_kind kind, lt::session_params &params);
@@ -0,0 +1,121 @@
+//
+// stream.cpp --- Deadline-driven, in-order streaming of a torrent's payload.
+//
+// libtorrent's time-critical piece picker lets us put a deadline on the
+// pieces just ahead of what we've written so far. Asking for an alert when
+// each one becomes available gets us a read_piece_alert carrying its data,
+// which we write out as soon as everything before it has been written.
+// Since only pieces inside the window are ever read back, at most WINDOW
+// pieces are held in memory at once.
+//
+// Note that multi-file torrents are streamed as one concatenated payload,
+// exactly as they're laid out in pieces.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+
+#include <unistd.h>
+
+#include <libtorrent/alert_types.hpp>
+#include <libtorrent/torrent_info.hpp>
+
+#include "stream.hpp"
+
+// How far apart, in milliseconds, consecutive pieces' deadlines are
+static int const deadline_step_ms = 250;
+
+static bool
+write_all(int fd, char const *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = ::write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+piece_streamer::piece_streamer(int fd, int window)
+    : m_fd(fd), m_window(window > 0 ? window : 1)
+{
+}
+
+void
+piece_streamer::start(lt::torrent_handle const &torrent)
+{
+    if (started()) return;
+
+    auto ti = torrent.torrent_file();
+    if (!ti) return;
+
+    m_torrent    = torrent;
+    m_num_pieces = ti->num_pieces();
+
+    // Pieces outside the window still get fetched, but roughly in order so
+    // they're likely to be there by the time the window reaches them
+    m_torrent.set_flags(lt::torrent_flags::sequential_download);
+    request_window();
+}
+
+// Put a deadline on every piece in the window that doesn't already have one.
+// alert_when_available makes libtorrent post a read_piece_alert with the
+// piece's contents once it's been downloaded and checked, or immediately if
+// we already have it.
+void
+piece_streamer::request_window()
+{
+    int end = std::min(m_cursor + m_window, m_num_pieces);
+
+    for (; m_requested < end; m_requested++) {
+        int deadline = (m_requested - m_cursor + 1) * deadline_step_ms;
+        m_torrent.set_piece_deadline(lt::piece_index_t{m_requested}, deadline,
+                                     lt::torrent_handle::alert_when_available);
+    }
+}
+
+// Write out the contiguous run of pieces starting at the cursor
+bool
+piece_streamer::flush()
+{
+    for (auto it = m_pending.find(m_cursor); it != m_pending.end();
+         it = m_pending.find(m_cursor)) {
+        buffered_piece const &p = it->second;
+        if (!write_all(m_fd, p.buf.get(), static_cast<size_t>(p.size))) {
+            perror("write");
+            return false;
+        }
+        m_pending.erase(it);
+        m_cursor++;
+    }
+    request_window();
+    return true;
+}
+
+bool
+piece_streamer::handle_alert(lt::alert const *a)
+{
+    if (auto rp = lt::alert_cast<lt::read_piece_alert>(a)) {
+        if (!started() || rp->handle != m_torrent) return true;
+
+        int piece = static_cast<int>(rp->piece);
+        if (rp->error) {
+            std::cerr << "Failed to read back piece " << piece << ": "
+                      << rp->error.message() << std::endl;
+            return false;
+        }
+
+        // Stale or duplicate reads are simply dropped
+        if (piece < m_cursor || piece >= m_requested) return true;
+
+        m_pending[piece] = buffered_piece{rp->buffer, rp->size};
+        return flush();
+    }
+    return true;
+}
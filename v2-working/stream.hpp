@@ -0,0 +1,48 @@
+//
+// stream.hpp --- Write a torrent's payload to a file descriptor in order
+// as the pieces arrive, rather than waiting for the whole thing.
+//
+
+#pragma once
+
+#include <map>
+
+#include <boost/shared_array.hpp>
+
+#include <libtorrent/alert.hpp>
+#include <libtorrent/torrent_handle.hpp>
+
+class piece_streamer {
+public:
+    // Write to FD, keeping deadlines on at most WINDOW pieces ahead of the
+    // last one written. WINDOW also bounds how many pieces we buffer.
+    piece_streamer(int fd, int window);
+
+    // Call once the torrent's metadata is known
+    void start(lt::torrent_handle const &torrent);
+
+    // Feed every alert through here. Returns false if we can't continue,
+    // e.g. because a piece couldn't be read back or the reader went away.
+    bool handle_alert(lt::alert const *a);
+
+    bool started() const { return m_num_pieces > 0; }
+    bool done() const { return started() && m_cursor == m_num_pieces; }
+
+private:
+    void request_window();
+    bool flush();
+
+    // A piece that has been read back but can't be written yet
+    struct buffered_piece {
+        boost::shared_array<char> buf;
+        int                       size;
+    };
+
+    lt::torrent_handle m_torrent;
+    int                m_fd;
+    int                m_window;
+    int                m_num_pieces = 0;
+    int                m_cursor     = 0; // Next piece to write out
+    int                m_requested  = 0; // One past the last piece requested
+    std::map<int, buffered_piece> m_pending;
+};